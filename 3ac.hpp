@@ -3,6 +3,7 @@
 
 #include "list"
 #include "map"
+#include "vector"
 #include "err.hpp"
 #include "symbol_table.hpp"
 
@@ -10,6 +11,11 @@ namespace lake{
 
 class Procedure;
 class IRProgram;
+class OptOptions;
+class ModRef;
+class SymOpd;
+class LitOpd;
+class AuxOpd;
 
 class Label{
 public:
@@ -33,6 +39,9 @@ public:
 	virtual void genLoad(std::ostream& out, std::string dstReg="$t0") = 0;
 	virtual void genStore(std::ostream& out, std::string srcReg="$t0") = 0;
 	virtual OpdType getType() = 0;
+	virtual SymOpd * asSym(){ return nullptr; }
+	virtual LitOpd * asLit(){ return nullptr; }
+	virtual AuxOpd * asAux(){ return nullptr; }
 };
 
 class SymOpd : public Opd{
@@ -58,6 +67,7 @@ public:
 		// we just return numeric
 		return NUMERIC;
 	}
+	virtual SymOpd * asSym() override{ return this; }
 private:
 	SymOpd(SemSymbol * sym) : mySym(sym) {} 
 	SemSymbol * mySym;
@@ -81,6 +91,10 @@ public:
 		// AuxOpd, we know this literal is numeric
 		return NUMERIC;
 	}
+	virtual LitOpd * asLit() override{ return this; }
+	long int getVal(){
+		return std::stol(val);
+	}
 private:
 	std::string val;
 };
@@ -108,6 +122,12 @@ public:
 	virtual OpdType getType() override{
 		return myType;
 	}
+	virtual AuxOpd * asAux() override{ return this; }
+	//Temporaries hold numeric values; string handles
+	// are AuxOpds of type STRING and never change
+	bool isTmp(){
+		return myType == NUMERIC;
+	}
 private:
 	std::string name;
 	std::string myLoc = "UNINIT";
@@ -123,17 +143,77 @@ enum UnaryOp{
 enum Syscall {
 	WRITE, READ, EXIT
 };
+enum MemoOp {
+	PROBE, FETCH, STORE
+};
+
+class BinOpQuad;
+class UnaryOpQuad;
+class AssignQuad;
+class JmpQuad;
+class JmpIfQuad;
+class NopQuad;
+class SyscallQuad;
+class CallQuad;
+class SetInQuad;
+class GetInQuad;
+class SetOutQuad;
+class GetOutQuad;
+class MemoQuad;
 
 class Quad{
 public:
 	Quad();
 	void addLabel(Label * label);
+	std::list<Label *> getLabels(){ return labels; }
+	bool hasLabels(){ return !labels.empty(); }
+	//Move this quad's labels onto another quad, so that
+	// jumps to them land there instead
+	void moveLabelsTo(Quad * other);
+	//Drop a label that nothing jumps to any more
+	void removeLabel(Label * label);
 	virtual std::string repr() = 0;
 	std::string commentStr();
 	virtual std::string toString(bool verbose=false);
 	void setComment(std::string commentIn);
 	virtual void codegenX64(std::ostream& out) = 0;
 	void codegenLabels(std::ostream& out);
+
+	//Dataflow view of the quad, used by the optimizer.
+	// getDst is the operand the quad writes (if any), and
+	// getSrcs lists every operand the quad reads
+	virtual Opd * getDst(){ return nullptr; }
+	virtual void setDst(Opd * opd){ }
+	virtual std::list<Opd *> getSrcs(){ return std::list<Opd *>(); }
+	virtual void replaceSrc(Opd * oldOpd, Opd * newOpd){ }
+	//The label this quad may transfer control to, if any
+	virtual Label * getTarget(){ return nullptr; }
+	//Whether control can reach the next quad in the list
+	virtual bool fallsThrough(){ return true; }
+	//Quads that do more than write getDst (I/O, calls,
+	// argument passing, control flow) must be kept even
+	// when nothing reads their result
+	virtual bool hasSideEffects(){ return false; }
+
+	virtual BinOpQuad * asBinOp(){ return nullptr; }
+	virtual UnaryOpQuad * asUnaryOp(){ return nullptr; }
+	virtual AssignQuad * asAssign(){ return nullptr; }
+	virtual JmpQuad * asJmp(){ return nullptr; }
+	virtual JmpIfQuad * asJmpIf(){ return nullptr; }
+	virtual NopQuad * asNop(){ return nullptr; }
+	virtual SyscallQuad * asSyscall(){ return nullptr; }
+	virtual CallQuad * asCall(){ return nullptr; }
+	virtual SetInQuad * asSetIn(){ return nullptr; }
+	virtual GetInQuad * asGetIn(){ return nullptr; }
+	virtual SetOutQuad * asSetOut(){ return nullptr; }
+	virtual GetOutQuad * asGetOut(){ return nullptr; }
+	virtual MemoQuad * asMemo(){ return nullptr; }
+
+	//A copy of the quad (sharing its operands), without
+	// its labels
+	Quad * clone();
+protected:
+	virtual Quad * copy() = 0;
 private:
 	std::string myComment;
 	std::list<Label *> labels;
@@ -144,11 +224,30 @@ public:
 	BinOpQuad(Opd * dstIn, BinOp opIn, Opd * src1In, Opd * src2In);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	Opd * getDst() override{ return dst; }
+	void setDst(Opd * opd) override{ dst = opd; }
+	std::list<Opd *> getSrcs() override;
+	void replaceSrc(Opd * oldOpd, Opd * newOpd) override;
+	BinOpQuad * asBinOp() override{ return this; }
+	BinOp getOp(){ return op; }
+	Opd * getSrc1(){ return src1; }
+	Opd * getSrc2(){ return src2; }
+	Quad * copy() override{ return new BinOpQuad(*this); }
+	//What range analysis proved about the operands of a
+	// division: whether neither is negative, and whether both
+	// fit in 32 bits (unsigned ones, if neither is negative).
+	// Either lets it use a cheaper divide.
+	void setDivFacts(bool nonNegIn, bool narrowIn){
+		nonNeg = nonNegIn;
+		narrow = narrowIn;
+	}
 private:
 	Opd * dst;
 	BinOp op;
 	Opd * src1;
 	Opd * src2;
+	bool nonNeg = false;
+	bool narrow = false;
 };
 
 class UnaryOpQuad : public Quad {
@@ -156,6 +255,14 @@ public:
 	UnaryOpQuad(Opd * dstIn, UnaryOp opIn, Opd * srcIn);
 	std::string repr() override ;
 	void codegenX64(std::ostream& out) override;
+	Opd * getDst() override{ return dst; }
+	void setDst(Opd * opd) override{ dst = opd; }
+	std::list<Opd *> getSrcs() override;
+	void replaceSrc(Opd * oldOpd, Opd * newOpd) override;
+	UnaryOpQuad * asUnaryOp() override{ return this; }
+	UnaryOp getOp(){ return op; }
+	Opd * getSrc(){ return src; }
+	Quad * copy() override{ return new UnaryOpQuad(*this); }
 private:
 	Opd * dst;
 	UnaryOp op;
@@ -170,7 +277,14 @@ public:
 	{ }
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
-
+	Opd * getDst() override{ return dst; }
+	void setDst(Opd * opd) override{ dst = opd; }
+	std::list<Opd *> getSrcs() override;
+	void replaceSrc(Opd * oldOpd, Opd * newOpd) override;
+	AssignQuad * asAssign() override{ return this; }
+	Opd * getSrc(){ return src; }
+
+	Quad * copy() override{ return new AssignQuad(*this); }
 private:
 	Opd * dst;
 	Opd * src;
@@ -181,6 +295,8 @@ public:
 	LocQuad(Opd * srcIn, Opd * tgtIn);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	bool hasSideEffects() override{ return true; }
+	Quad * copy() override{ return new LocQuad(*this); }
 private:
 	Opd * src;
 	Opd * tgt;
@@ -191,6 +307,12 @@ public:
 	JmpQuad(Label * tgtIn);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	Label * getTarget() override{ return tgt; }
+	bool fallsThrough() override{ return false; }
+	bool hasSideEffects() override{ return true; }
+	JmpQuad * asJmp() override{ return this; }
+	void setTarget(Label * tgtIn){ tgt = tgtIn; }
+	Quad * copy() override{ return new JmpQuad(*this); }
 private:
 	Label * tgt;
 };
@@ -200,6 +322,18 @@ public:
 	JmpIfQuad(Opd * cndIn, bool invertIn, Label * tgtIn);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	std::list<Opd *> getSrcs() override;
+	void replaceSrc(Opd * oldOpd, Opd * newOpd) override;
+	Label * getTarget() override{ return tgt; }
+	bool hasSideEffects() override{ return true; }
+	JmpIfQuad * asJmpIf() override{ return this; }
+	void setTarget(Label * tgtIn){ tgt = tgtIn; }
+	Opd * getCnd(){ return cnd; }
+	//An inverted JmpIfQuad jumps when cnd is true, 
+	// otherwise it jumps when cnd is false
+	bool isInverted(){ return invert; }
+	void setInverted(bool invertIn){ invert = invertIn; }
+	Quad * copy() override{ return new JmpIfQuad(*this); }
 private:
 	Opd * cnd;
 	bool invert;
@@ -211,6 +345,8 @@ public:
 	NopQuad();
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	NopQuad * asNop() override{ return this; }
+	Quad * copy() override{ return new NopQuad(*this); }
 };
 
 class SyscallQuad : public Quad {
@@ -218,6 +354,16 @@ public:
 	SyscallQuad(Syscall syscall, Opd * arg);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	Opd * getDst() override;
+	void setDst(Opd * opd) override;
+	std::list<Opd *> getSrcs() override;
+	void replaceSrc(Opd * oldOpd, Opd * newOpd) override;
+	bool fallsThrough() override{ return mySyscall != EXIT; }
+	bool hasSideEffects() override{ return true; }
+	SyscallQuad * asSyscall() override{ return this; }
+	Syscall getSyscall(){ return mySyscall; }
+	Opd * getArg(){ return myArg; }
+	Quad * copy() override{ return new SyscallQuad(*this); }
 private:
 	Opd * myArg;
 	Syscall mySyscall;
@@ -228,8 +374,23 @@ public:
 	CallQuad(SemSymbol * calleeIn);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	bool hasSideEffects() override{ return true; }
+	CallQuad * asCall() override{ return this; }
+	SemSymbol * getCallee(){ return callee; }
+	//A tail call reuses the caller's frame, jumping to the
+	// callee so that it returns straight to the caller's caller
+	bool isTail(){ return tail; }
+	void setTail(bool tailIn){ tail = tailIn; }
+	//A copy may land where the call is not in tail position
+	// (as when inlined), so markTailCalls has to mark it anew
+	Quad * copy() override{
+		CallQuad * res = new CallQuad(*this);
+		res->tail = false;
+		return res;
+	}
 private:
 	SemSymbol * callee;
+	bool tail = false;
 };
 
 class EnterQuad : public Quad{
@@ -237,6 +398,8 @@ public:
 	EnterQuad(Procedure * proc);
 	virtual std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	bool hasSideEffects() override{ return true; }
+	Quad * copy() override{ return new EnterQuad(*this); }
 private:
 	Procedure * myProc;
 };
@@ -246,6 +409,9 @@ public:
 	LeaveQuad(Procedure * proc);
 	virtual std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	bool fallsThrough() override{ return false; }
+	bool hasSideEffects() override{ return true; }
+	Quad * copy() override{ return new LeaveQuad(*this); }
 private:
 	Procedure * myProc;
 };
@@ -255,6 +421,13 @@ public:
 	SetInQuad(size_t indexIn, Opd * opdIn);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	std::list<Opd *> getSrcs() override;
+	void replaceSrc(Opd * oldOpd, Opd * newOpd) override;
+	bool hasSideEffects() override{ return true; }
+	SetInQuad * asSetIn() override{ return this; }
+	size_t getIndex(){ return index; }
+	Opd * getOpd(){ return opd; }
+	Quad * copy() override{ return new SetInQuad(*this); }
 private:
 	size_t index;
 	Opd * opd;
@@ -265,6 +438,13 @@ public:
 	GetInQuad(size_t indexIn, Opd * opdIn);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	//The formal is bound to its argument slot, so the
+	// destination of a getin is never renamed
+	Opd * getDst() override{ return opd; }
+	GetInQuad * asGetIn() override{ return this; }
+	size_t getIndex(){ return index; }
+	Opd * getOpd(){ return opd; }
+	Quad * copy() override{ return new GetInQuad(*this); }
 private:
 	size_t index;
 	Opd * opd;
@@ -275,6 +455,13 @@ public:
 	SetOutQuad(size_t indexIn, Opd * opdIn);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	std::list<Opd *> getSrcs() override;
+	void replaceSrc(Opd * oldOpd, Opd * newOpd) override;
+	bool hasSideEffects() override{ return true; }
+	SetOutQuad * asSetOut() override{ return this; }
+	size_t getIndex(){ return index; }
+	Opd * getOpd(){ return opd; }
+	Quad * copy() override{ return new SetOutQuad(*this); }
 private:
 	size_t index;
 	Opd * opd;
@@ -285,11 +472,50 @@ public:
 	GetOutQuad(size_t indexIn, Opd * opdIn);
 	std::string repr() override;
 	void codegenX64(std::ostream& out) override;
+	Opd * getDst() override{ return opd; }
+	void setDst(Opd * opdIn) override{ opd = opdIn; }
+	GetOutQuad * asGetOut() override{ return this; }
+	size_t getIndex(){ return index; }
+	Opd * getOpd(){ return opd; }
+	Quad * copy() override{ return new GetOutQuad(*this); }
 private:
 	size_t index;
 	Opd * opd;
 };
 
+//Access to the table a memoized procedure keeps its results
+// in, keyed by its arguments. A probe sets opd to whether the
+// table holds a result for the keys (counting a hit or a miss),
+// a fetch reads that result into opd, and a store puts opd
+// there. The table is direct-mapped, so a store may evict the
+// result for other keys.
+class MemoQuad : public Quad{
+public:
+	MemoQuad(MemoOp opIn, std::string tableIn, size_t entriesIn,
+		std::vector<Opd *> keysIn, Opd * opdIn);
+	std::string repr() override;
+	void codegenX64(std::ostream& out) override;
+	Opd * getDst() override{ return op == STORE ? nullptr : opd; }
+	void setDst(Opd * opdIn) override{ if (op != STORE){ opd = opdIn; } }
+	std::list<Opd *> getSrcs() override;
+	void replaceSrc(Opd * oldOpd, Opd * newOpd) override;
+	bool hasSideEffects() override{ return true; }
+	MemoQuad * asMemo() override{ return this; }
+	MemoOp getOp(){ return op; }
+	Quad * copy() override{ return new MemoQuad(*this); }
+	//Bytes in a table with the given number of entries and keys
+	static size_t tableSize(size_t entries, size_t numKeys){
+		return entries * (numKeys + 2) * 8;
+	}
+private:
+	void genEntry(std::ostream& out);
+	MemoOp op;
+	std::string table;
+	size_t entries;
+	std::vector<Opd *> keys;
+	Opd * opd;
+};
+
 class Procedure{
 public:
 	Procedure(IRProgram * prog, std::string name);
@@ -308,6 +534,22 @@ public:
 
 	lake::Label * getLeaveLabel();
 
+	//The optimizer rewrites the body in place
+	std::list<Quad *> * getQuads(){ return &bodyQuads; }
+	std::list<SymOpd *> * getFormals(){ return &formals; }
+	std::list<AuxOpd *> * getTemps(){ return &temps; }
+	std::list<SymOpd *> getLocals();
+	//Drop a temporary that no quad refers to anymore
+	void removeTmp(AuxOpd * tmp);
+	//A copy of the procedure under another name, with its own
+	// formals, locals, temps and labels
+	Procedure * clone(std::string name);
+	//What a call to the procedure may do, once the optimizer
+	// has worked it out (until then, anything)
+	ModRef * getModRef(){ return modRef; }
+	void setModRef(ModRef * modRefIn){ modRef = modRefIn; }
+
+	void optimize(OptOptions * opts);
 	void toX64(std::ostream& out);
 	size_t numLocals() const;
 	size_t numTemps() const;
@@ -325,6 +567,7 @@ private:
 	std::list<Quad *> bodyQuads;
 	std::string myName;
 	size_t maxTmp;
+	ModRef * modRef = nullptr;
 };
 
 class IRProgram{
@@ -334,9 +577,22 @@ public:
 	Opd * makeString(std::string val);
 	void gatherGlobal(SemSymbol * sym);
 	SymOpd * getGlobal(SemSymbol * sym);
+	std::list<SymOpd *> getGlobals();
+	bool isGlobal(Opd * opd);
+	std::list<Procedure *> * getProcs(){ return &procs; }
+	//Reserve zeroed memory for a memo table, along with its
+	// hit and miss counters
+	void addMemoTable(std::string table, size_t bytes);
+	//The literal text, quotes and escapes included, of a
+	// string made by makeString. Returns false if opd is not
+	// such a string.
+	bool getString(Opd * opd, std::string * val);
+	//Start a global off holding val rather than 0
+	void setInitial(SymOpd * global, long int val);
 
 	std::string toString(bool verbose=false);
 
+	void optimize(OptOptions * opts);
 	void toX64(std::ostream& out);
 private:
 	size_t max_label = 0;
@@ -344,6 +600,8 @@ private:
 	std::list<Procedure *> procs; 
 	HashMap<AuxOpd *, std::string> strings;
 	std::map<SemSymbol *, SymOpd *> globals;
+	std::map<std::string, size_t> memoTables;
+	std::map<SymOpd *, long int> initials;
 
 	void datagenX64(std::ostream& out);
 	void allocGlobals();
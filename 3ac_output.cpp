@@ -131,10 +131,14 @@ Opd * AssignNode::flatten(Procedure * proc){
 	return lhs;
 }
 
-Opd * CallExpNode::flatten(Procedure * proc){
+void CallExpNode::to3AC(Procedure * proc){
 	myExpList->to3AC(proc);
 	Quad * callQuad = new CallQuad(myId->getSymbol());
 	proc->addQuad(callQuad);
+}
+
+Opd * CallExpNode::flatten(Procedure * proc){
+	to3AC(proc);
 
 	SemSymbol * idSym = myId->getSymbol();
 	const FnType * calleeType = idSym->getType()->asFn();
@@ -366,16 +370,9 @@ void WhileStmtNode::to3AC(Procedure * proc){
 }
 
 void CallStmtNode::to3AC(Procedure * proc){
-	Opd * res = myCallExp->flatten(proc);
-	//Since we're in a callStmt, the GetOut quad
-	// generated as the last action of the subtree
-	// was unnecessary. Remove it from the procedure.
-	if (res != nullptr){
-		//A void call will not generate a getout
-		Quad * last = proc->popQuad();
-	}
-	//Should probably delete the last quad, but
-	// we've leaked so much memory why start worrying now?
+	//Since we're in a callStmt, the result is not used,
+	// so there is no getout (or temp) to fetch it into
+	myCallExp->to3AC(proc);
 }
 
 void ReturnStmtNode::to3AC(Procedure * proc){
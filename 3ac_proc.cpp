@@ -97,6 +97,18 @@ AuxOpd * Procedure::makeTmp(){
 	return res;
 }
 
+void Procedure::removeTmp(AuxOpd * tmp){
+	temps.remove(tmp);
+}
+
+std::list<SymOpd *> Procedure::getLocals(){
+	std::list<SymOpd *> res;
+	for (auto local : locals){
+		res.push_back(local.second);
+	}
+	return res;
+}
+
 size_t Procedure::numTemps() const{
 	return this->temps.size();
 }
@@ -21,6 +21,42 @@ SymOpd * IRProgram::getGlobal(SemSymbol * sym){
 	return nullptr;
 }
 
+std::list<SymOpd *> IRProgram::getGlobals(){
+	std::list<SymOpd *> res;
+	for (auto global : globals){
+		res.push_back(global.second);
+	}
+	return res;
+}
+
+void IRProgram::addMemoTable(std::string table, size_t bytes){
+	memoTables[table] = bytes;
+}
+
+bool IRProgram::getString(Opd * opd, std::string * val){
+	AuxOpd * aux = opd == nullptr ? nullptr : opd->asAux();
+	if (aux == nullptr){ return false; }
+	auto found = strings.find(aux);
+	if (found == strings.end()){ return false; }
+	*val = found->second;
+	return true;
+}
+
+void IRProgram::setInitial(SymOpd * global, long int val){
+	if (val == 0){
+		initials.erase(global);
+	} else {
+		initials[global] = val;
+	}
+}
+
+bool IRProgram::isGlobal(Opd * opd){
+	for (auto global : globals){
+		if (global.second == opd){ return true; }
+	}
+	return false;
+}
+
 void IRProgram::gatherGlobal(SemSymbol * sym){
 	SymOpd * res = new SymOpd(sym);
 	globals[sym] = res;
@@ -37,7 +73,12 @@ std::string IRProgram::toString(bool verbose){
 	std::string res = "";
 	res += "[BEGIN GLOBALS]\n";
 	for (auto entry : globals){
-		res += entry.second->toString() + "\n"; 
+		res += entry.second->toString();
+		auto init = initials.find(entry.second);
+		if (init != initials.end()){
+			res += " " + std::to_string(init->second);
+		}
+		res += "\n";
 	}
 	for (auto entry : strings){
 		res += entry.first->toString(); 
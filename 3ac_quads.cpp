@@ -10,6 +10,23 @@ void Quad::addLabel(Label * label){
 	labels.push_back(label);
 }
 
+void Quad::moveLabelsTo(Quad * other){
+	for (auto label : labels){
+		other->addLabel(label);
+	}
+	labels.clear();
+}
+
+void Quad::removeLabel(Label * label){
+	labels.remove(label);
+}
+
+Quad * Quad::clone(){
+	Quad * res = copy();
+	res->labels.clear();
+	return res;
+}
+
 void Quad::setComment(std::string commentIn){
 	this->myComment = commentIn;
 }
@@ -44,7 +61,7 @@ std::string Quad::toString(bool verbose){
 CallQuad::CallQuad(SemSymbol * calleeIn) : callee(calleeIn){ }
 
 std::string CallQuad::repr(){
-	return "call " + callee->getName();
+	return (tail ? "tailcall " : "call ") + callee->getName();
 }
 
 EnterQuad::EnterQuad(Procedure * procIn) : Quad(), myProc(procIn)
@@ -66,6 +83,14 @@ std::string AssignQuad::repr(){
 	
 }
 
+std::list<Opd *> AssignQuad::getSrcs(){
+	return std::list<Opd *>({src});
+}
+
+void AssignQuad::replaceSrc(Opd * oldOpd, Opd * newOpd){
+	if (src == oldOpd){ src = newOpd; }
+}
+
 BinOpQuad::BinOpQuad(Opd * dstIn, BinOp opIn, Opd * src1In, Opd * src2In)
 : dst(dstIn), op(opIn), src1(src1In), src2(src2In){ }
 
@@ -115,6 +140,15 @@ std::string BinOpQuad::repr(){
 		+ src2->toString();
 }
 
+std::list<Opd *> BinOpQuad::getSrcs(){
+	return std::list<Opd *>({src1, src2});
+}
+
+void BinOpQuad::replaceSrc(Opd * oldOpd, Opd * newOpd){
+	if (src1 == oldOpd){ src1 = newOpd; }
+	if (src2 == oldOpd){ src2 = newOpd; }
+}
+
 UnaryOpQuad::UnaryOpQuad(Opd * dstIn, UnaryOp opIn, Opd * srcIn)
 : dst(dstIn), op(opIn), src(srcIn) { }
 
@@ -132,6 +166,14 @@ std::string UnaryOpQuad::repr(){
 		+ src->toString();
 }
 
+std::list<Opd *> UnaryOpQuad::getSrcs(){
+	return std::list<Opd *>({src});
+}
+
+void UnaryOpQuad::replaceSrc(Opd * oldOpd, Opd * newOpd){
+	if (src == oldOpd){ src = newOpd; }
+}
+
 SyscallQuad::SyscallQuad(Syscall syscall, Opd * opd) 
 : myArg(opd), mySyscall(syscall){ }
 
@@ -151,6 +193,53 @@ std::string SyscallQuad::repr(){
 	return res;
 }
 
+Opd * SyscallQuad::getDst(){
+	if (mySyscall == READ){ return myArg; }
+	return nullptr;
+}
+
+void SyscallQuad::setDst(Opd * opd){
+	if (mySyscall == READ){ myArg = opd; }
+}
+
+std::list<Opd *> SyscallQuad::getSrcs(){
+	if (mySyscall == WRITE){ return std::list<Opd *>({myArg}); }
+	return std::list<Opd *>();
+}
+
+void SyscallQuad::replaceSrc(Opd * oldOpd, Opd * newOpd){
+	if (mySyscall == WRITE && myArg == oldOpd){ myArg = newOpd; }
+}
+
+MemoQuad::MemoQuad(MemoOp opIn, std::string tableIn, size_t entriesIn,
+	std::vector<Opd *> keysIn, Opd * opdIn)
+: op(opIn), table(tableIn), entries(entriesIn), keys(keysIn), opd(opdIn){ }
+
+std::string MemoQuad::repr(){
+	std::string res;
+	switch (op){
+	case PROBE: res = opd->toString() + " := memoprobe " + table; break;
+	case FETCH: res = opd->toString() + " := memofetch " + table; break;
+	case STORE: res = "memostore " + table; break;
+	}
+	for (auto key : keys){ res += " " + key->toString(); }
+	if (op == STORE){ res += " " + opd->toString(); }
+	return res;
+}
+
+std::list<Opd *> MemoQuad::getSrcs(){
+	std::list<Opd *> res(keys.begin(), keys.end());
+	if (op == STORE){ res.push_back(opd); }
+	return res;
+}
+
+void MemoQuad::replaceSrc(Opd * oldOpd, Opd * newOpd){
+	for (size_t i = 0 ; i < keys.size() ; i++){
+		if (keys[i] == oldOpd){ keys[i] = newOpd; }
+	}
+	if (op == STORE && opd == oldOpd){ opd = newOpd; }
+}
+
 JmpQuad::JmpQuad(Label * tgtIn)
 : Quad(), tgt(tgtIn){ }
 
@@ -175,6 +264,14 @@ std::string JmpIfQuad::repr(){
 	return res;
 }
 
+std::list<Opd *> JmpIfQuad::getSrcs(){
+	return std::list<Opd *>({cnd});
+}
+
+void JmpIfQuad::replaceSrc(Opd * oldOpd, Opd * newOpd){
+	if (cnd == oldOpd){ cnd = newOpd; }
+}
+
 NopQuad::NopQuad()
 : Quad() { }
 
@@ -201,6 +298,14 @@ std::string SetInQuad::repr(){
 	return res;
 }
 
+std::list<Opd *> SetInQuad::getSrcs(){
+	return std::list<Opd *>({opd});
+}
+
+void SetInQuad::replaceSrc(Opd * oldOpd, Opd * newOpd){
+	if (opd == oldOpd){ opd = newOpd; }
+}
+
 GetInQuad::GetInQuad(size_t indexIn, Opd * opdIn) 
 : index(indexIn), opd(opdIn){
 }
@@ -221,6 +326,14 @@ std::string SetOutQuad::repr(){
 	return res;
 }
 
+std::list<Opd *> SetOutQuad::getSrcs(){
+	return std::list<Opd *>({opd});
+}
+
+void SetOutQuad::replaceSrc(Opd * oldOpd, Opd * newOpd){
+	if (opd == oldOpd){ opd = newOpd; }
+}
+
 }
 
 
@@ -422,6 +422,8 @@ public:
 	DataType * getRetType();
 
 	virtual Opd * flatten(Procedure * proc) override;
+	//Just the call, for when its result is not used
+	void to3AC(Procedure * proc);
 private:
 	IdNode * myId;
 	ExpListNode * myExpList;
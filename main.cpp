@@ -5,6 +5,7 @@
 #include "scanner.hpp"
 #include "symbol_table.hpp"
 #include "types.hpp"
+#include "opt.hpp"
 
 using namespace lake;
 
@@ -16,6 +17,9 @@ static void usageAndDie(){
 	<< " [-c]"
 	<< " [-a <3ACFile>]"
 	<< " [-o <x64File>]"
+	<< " [-O]"
+	<< " [-s <optStatsFile>]"
+	<< " [-f <optKnob>=<value>]"
 	<< "\n"
 	;
 	exit(1);
@@ -55,6 +59,26 @@ static void writeAssembly(IRProgram * prog, const char * outPath){
 
 }
 
+static void optimize(IRProgram * prog, OptOptions * opts, 
+	const char * statsFile){
+	if (statsFile == nullptr){
+		prog->optimize(opts);
+	} else if (strcmp(statsFile, "--") == 0){
+		opts->stats = &std::cout;
+		prog->optimize(opts);
+	} else {
+		std::ofstream statsStream(statsFile);
+		if (!statsStream.good()){
+			std::string msg = "Bad stats file " + std::string(statsFile);
+			throw new InternalError(msg.c_str());
+		}
+		opts->stats = &statsStream;
+		prog->optimize(opts);
+		statsStream.close();
+	}
+	opts->stats = nullptr;
+}
+
 static void write3AC(IRProgram * prog, const char * outFile, bool verbose){
 	if (outFile == nullptr){
 		throw new InternalError("Null 3AC flat file given");
@@ -122,6 +146,9 @@ main( const int argc, const char **argv )
 	bool doTypeChecking = false;
 	const char * flattenFile = NULL;
 	const char * assemblyFile = NULL;
+	bool doOptimize = false;
+	const char * statsFile = NULL;
+	OptOptions optOptions;
 	bool verbose = false;
 	bool useful = false;
 	int i = 1;
@@ -151,6 +178,16 @@ main( const int argc, const char **argv )
 				i++;
 				assemblyFile = argv[i];
 				useful = true;
+			} else if (argv[i][1] == 'O'){
+				doOptimize = true;
+			} else if (argv[i][1] == 's'){
+				i++;
+				statsFile = argv[i];
+			} else if (argv[i][1] == 'f'){
+				i++;
+				if (i >= argc || !optOptions.set(argv[i])){
+					usageAndDie();
+				}
 			}
 		} else {
 			if (inFile == NULL){
@@ -259,6 +296,9 @@ main( const int argc, const char **argv )
 				exit(1);
 			}
 			IRProgram * prog = astRoot->to3AC();
+			if (doOptimize){
+				optimize(prog, &optOptions, statsFile);
+			}
 			write3AC(prog, flattenFile, verbose);
 		} catch (ToDoError * e){
 			std::cerr << "ToDo: " << e->what() << std::endl;
@@ -286,6 +326,9 @@ main( const int argc, const char **argv )
 				exit(1);
 			}
 			IRProgram * prog = astRoot->to3AC();
+			if (prog != NULL && doOptimize){
+				optimize(prog, &optOptions, statsFile);
+			}
 			if (prog != NULL){
 				writeAssembly(prog, assemblyFile);
 			}
@@ -0,0 +1,403 @@
+#ifndef LAKE_OPT_HPP
+#define LAKE_OPT_HPP
+
+#include <set>
+#include <vector>
+#include "3ac.hpp"
+
+namespace lake{
+
+//Settings for the 3AC optimizer, filled in by main from
+// the command line
+class OptOptions{
+public:
+	//Set a tuning knob from "name=value". Returns false if
+	// there is no such knob or the value is not a number.
+	bool set(const char * setting);
+
+	//Where to report per-procedure statistics, if anywhere
+	std::ostream * stats = nullptr;
+	//How many copies of the body a partially unrolled loop
+	// gets (1 turns partial unrolling off)
+	size_t unrollFactor = 4;
+	//The most quads an unrolled loop body may grow to
+	size_t unrollBudget = 64;
+	//The most quads a loop may have to be copied when it is
+	// unswitched
+	size_t unswitchBudget = 32;
+	//The most quads a block may have to be copied when a jump
+	// is threaded through it
+	size_t threadBudget = 8;
+	//The most quads that may be copied to give a superblock
+	// a single entry
+	size_t superblockBudget = 32;
+	//The largest callee (in quads) that is inlined
+	size_t inlineBudget = 24;
+	//The most quads a caller may grow to by inlining
+	size_t inlineGrowth = 400;
+	//How many specialized copies a procedure may get for
+	// calls with constant arguments (0 turns it off)
+	size_t specializeCopies = 4;
+	//The largest procedure (in quads) that is specialized
+	size_t specializeBudget = 48;
+	//The most quads run to evaluate a call at compile time
+	// (0 turns it off)
+	size_t evalFuel = 1000000;
+	//How many entries the memo table of a memoized procedure
+	// has (0, the default, turns memoization off)
+	size_t memoEntries = 0;
+	//The most quads of main run at compile time, up to its
+	// first read of input (0, the default, turns it off)
+	size_t precomputeFuel = 0;
+};
+
+//A maximal straight-line run of quads. Only the first quad
+// of a block carries labels, and only the last quad may
+// jump elsewhere.
+class BasicBlock{
+public:
+	BasicBlock(size_t idIn) : id(idIn){ }
+	size_t getID(){ return id; }
+	std::list<Quad *> * getQuads(){ return &quads; }
+	std::list<BasicBlock *> * getSuccs(){ return &succs; }
+	std::list<BasicBlock *> * getPreds(){ return &preds; }
+	//Put quads where they run as control leaves the block:
+	// before the jump that ends it, if there is one (taking
+	// over the jump's labels if it is the only quad)
+	void append(std::list<Quad *> * more);
+private:
+	size_t id;
+	std::list<Quad *> quads;
+	std::list<BasicBlock *> succs;
+	std::list<BasicBlock *> preds;
+};
+
+//The control flow graph of a procedure body. The blocks
+// are kept in layout order, so falling through a block
+// leads to the next one in the list. Jumps to the leave
+// label (and falling off the end of the body) lead to
+// the exit block, which holds no quads.
+class ControlFlowGraph{
+public:
+	ControlFlowGraph(Procedure * proc);
+	Procedure * getProc(){ return myProc; }
+	std::vector<BasicBlock *> * getBlocks(){ return &blocks; }
+	BasicBlock * getEntry();
+	BasicBlock * getExit(){ return exit; }
+	//A label that leads to block, adding one if it has none
+	Label * getLabel(BasicBlock * block);
+	//Write the blocks back into the procedure body
+	void commit();
+private:
+	void addEdge(BasicBlock * from, BasicBlock * to);
+
+	Procedure * myProc;
+	std::vector<BasicBlock *> blocks;
+	BasicBlock * exit;
+};
+
+//Backward liveness of variables (locals, formals, temps
+// and globals) over a control flow graph. Strong liveness
+// only counts reads by quads whose own result is needed, so
+// a variable that only feeds dead code is not live.
+class Liveness{
+public:
+	Liveness(ControlFlowGraph * cfg, bool strong=false);
+	std::set<Opd *> * getLiveIn(BasicBlock * block);
+	std::set<Opd *> * getLiveOut(BasicBlock * block);
+	//Variables whose current value may still be read
+	// after quad executes
+	std::set<Opd *> * getLiveAfter(Quad * quad);
+private:
+	std::map<BasicBlock *, std::set<Opd *>> liveIn;
+	std::map<BasicBlock *, std::set<Opd *>> liveOut;
+	std::map<Quad *, std::set<Opd *>> liveAfter;
+};
+
+//Dominator tree of a control flow graph. Blocks that are
+// unreachable from the entry have no dominator.
+class Dominators{
+public:
+	Dominators(ControlFlowGraph * cfg);
+	BasicBlock * getIDom(BasicBlock * block);
+	std::list<BasicBlock *> * getChildren(BasicBlock * block);
+	bool dominates(BasicBlock * a, BasicBlock * b);
+	bool isReachable(BasicBlock * block);
+	//Reachable blocks (including the exit) in reverse postorder
+	std::vector<BasicBlock *> * getOrder(){ return &order; }
+private:
+	std::vector<BasicBlock *> order;
+	std::map<BasicBlock *, size_t> orderIdx;
+	std::map<BasicBlock *, BasicBlock *> idoms;
+	std::map<BasicBlock *, std::list<BasicBlock *>> children;
+};
+
+//A natural loop: a header, and every block that can reach
+// one of the back edges into it (from its latches) without
+// going through the header
+class NaturalLoop{
+public:
+	NaturalLoop(BasicBlock * headerIn) : header(headerIn){
+		blocks.insert(headerIn);
+	}
+	BasicBlock * getHeader(){ return header; }
+	std::set<BasicBlock *> * getBlocks(){ return &blocks; }
+	std::list<BasicBlock *> * getLatches(){ return &latches; }
+	bool contains(BasicBlock * block){ return blocks.count(block) > 0; }
+	//Blocks in the loop with a successor outside it
+	std::list<BasicBlock *> getExiting();
+	//Blocks outside the loop that it can branch to
+	std::set<BasicBlock *> getExits();
+private:
+	BasicBlock * header;
+	std::set<BasicBlock *> blocks;
+	std::list<BasicBlock *> latches;
+};
+
+//The natural loops of a control flow graph, one per header,
+// with inner loops before the loops that contain them
+std::list<NaturalLoop *> findLoops(ControlFlowGraph * cfg,
+	Dominators * doms);
+
+//Whether quads can be put where they run once, each time
+// before loop is entered
+bool canPlacePreheader(ControlFlowGraph * cfg, NaturalLoop * loop);
+//Put quads there: at the end of the block outside the loop
+// that only leads to the header, if there is one, or else in
+// a new preheader laid out in front of the header
+void placePreheader(Procedure * proc, ControlFlowGraph * cfg,
+	NaturalLoop * loop, std::list<Quad *> * quads);
+
+//A rotated loop that counts: the latch steps a counter by a
+// constant and then branches back to the header while the
+// counter compares a certain way with a bound the loop never
+// changes. The body is laid out from the header down to the
+// latch.
+class CountedLoop{
+public:
+	//The counting structure of loop, or null if it has none
+	static CountedLoop * analyze(ControlFlowGraph * cfg,
+		NaturalLoop * loop);
+	std::vector<BasicBlock *> * getBody(){ return &body; }
+	BasicBlock * getExit(){ return exit; }
+	Opd * getCounter(){ return counter; }
+	Opd * getBound(){ return bound; }
+	long int getStep(){ return step; }
+	//The loop goes around again while counter cmp bound
+	BinOp getCmp(){ return cmp; }
+	BinOpQuad * getStepQuad(){ return stepQuad; }
+	BinOpQuad * getTest(){ return test; }
+	JmpIfQuad * getBranch(){ return branch; }
+	//The counter's value on entry, if it is a known constant
+	bool getInit(long int * val){ *val = init; return hasInit; }
+	//How many times the body runs, if that is known and no
+	// more than limit
+	bool tripCount(size_t limit, size_t * count);
+	//Quads in the body, not counting nops
+	size_t size();
+	//A copy of the body without the branch back to the
+	// header, with fresh labels
+	std::list<Quad *> cloneBody(Procedure * proc);
+private:
+	CountedLoop(){ }
+	std::vector<BasicBlock *> body;
+	BasicBlock * exit = nullptr;
+	Opd * counter = nullptr;
+	Opd * bound = nullptr;
+	long int step = 0;
+	BinOp cmp = LT;
+	BinOpQuad * stepQuad = nullptr;
+	BinOpQuad * test = nullptr;
+	JmpIfQuad * branch = nullptr;
+	bool hasInit = false;
+	long int init = 0;
+};
+
+//The values a variable may hold, from lo to hi inclusive
+struct Range{
+	long int lo;
+	long int hi;
+	bool isConst(){ return lo == hi; }
+};
+
+//Forward range analysis of integer variables over a control
+// flow graph. Ranges come from literals and arithmetic, and
+// are narrowed along the edges out of a conditional branch by
+// the comparison it tests, which also bounds the counters of
+// loops. Loop headers widen ranges that keep growing, first
+// to the constants the procedure compares with and then to
+// the full range, and a few more passes narrow them again.
+class ValueRanges{
+public:
+	ValueRanges(Procedure * proc, ControlFlowGraph * cfg);
+	//Whether the ranges leave any way for control to reach quad
+	bool isReachable(Quad * quad);
+	//The values opd may hold just before quad runs
+	Range getRange(Quad * quad, Opd * opd);
+	//Whether the branch that ends block always goes the same
+	// way when control comes in from pred, and if so whether
+	// it jumps
+	bool decideBranch(BasicBlock * pred, BasicBlock * block, bool * jumps);
+private:
+	//The ranges at a point, if control can reach it. Variables
+	// without an entry may hold anything.
+	struct State{
+		bool reached = false;
+		std::map<Opd *, Range> ranges;
+		bool operator==(const State & other) const;
+	};
+	Range get(State * state, Opd * opd);
+	void transfer(State * state, Quad * quad);
+	void refine(State * state, JmpIfQuad * branch, BasicBlock * block,
+		bool taken);
+	State edgeState(BasicBlock * from, BasicBlock * to);
+	void update(BasicBlock * block);
+	State join(BasicBlock * block);
+	void widen(State * old, State * next,
+		const std::set<long int> & thresholds);
+
+	Procedure * proc;
+	ControlFlowGraph * cfg;
+	std::map<BasicBlock *, BasicBlock *> layoutNext;
+	std::map<BasicBlock *, State> in;
+	std::map<BasicBlock *, State> out;
+	std::map<Quad *, State> before;
+};
+
+//Which procedures call which. Procedures that call each
+// other (directly or not) form a cycle of recursion.
+class CallGraph{
+public:
+	CallGraph(IRProgram * prog);
+	//The procedure a call quad transfers to
+	Procedure * getProc(CallQuad * call);
+	std::set<Procedure *> * getCallees(Procedure * proc);
+	std::set<Procedure *> * getCallers(Procedure * proc);
+	//How many call quads in the program reach proc
+	size_t numCallSites(Procedure * proc);
+	//Every procedure, each after the procedures it calls
+	// unless they are in a cycle with it
+	std::vector<Procedure *> * getBottomUp(){ return &bottomUp; }
+	//Whether a and b are in the same cycle of recursion (a
+	// procedure that calls itself is in a cycle with itself)
+	bool isRecursive(Procedure * a, Procedure * b);
+private:
+	void findCycles(Procedure * proc);
+
+	std::map<std::string, Procedure *> byName;
+	std::map<Procedure *, std::set<Procedure *>> callees;
+	std::map<Procedure *, std::set<Procedure *>> callers;
+	std::map<Procedure *, size_t> callSites;
+	std::vector<Procedure *> bottomUp;
+	std::map<Procedure *, size_t> cycleOf;
+	//Bookkeeping for finding the cycles (Tarjan's algorithm)
+	std::map<Procedure *, size_t> index;
+	std::map<Procedure *, size_t> lowLink;
+	std::vector<Procedure *> stack;
+	std::set<Procedure *> onStack;
+};
+
+//The side effects of calling a procedure, counting those of
+// whatever it calls in turn
+class ModRef{
+public:
+	//Globals the call may read
+	std::set<Opd *> reads;
+	//Globals the call may write
+	std::set<Opd *> writes;
+	//Whether the call may read input or write output
+	bool io = false;
+	//Whether the call surely returns: it has no loops, divisions
+	// that may fault or recursion
+	bool halts = true;
+	//Whether the call changes nothing the caller could see, so
+	// that its result depends only on its arguments and the
+	// globals it reads
+	bool isPure(){ return writes.empty() && !io; }
+};
+
+//Work out the side effects of every procedure
+void summarizeProcs(CallGraph * calls);
+//Bring proc's summary up to date after it has changed, given
+// the summaries of what it calls. Returns true if it shrank.
+bool summarizeProc(Procedure * proc, CallGraph * calls);
+//The procedure a call in caller transfers to
+Procedure * findCallee(Procedure * caller, CallQuad * call);
+//The summary of the procedure a call transfers to, if known
+ModRef * calleeModRef(Procedure * caller, CallQuad * call);
+
+//Find the setin for each of the numArgs arguments of the call
+// at callPos (indexed from 1), walking back through straight-
+// line code so that all of them run whenever the call does
+bool findSetIns(std::list<Quad *> * quads,
+	std::list<Quad *>::iterator callPos, size_t numArgs,
+	std::vector<std::list<Quad *>::iterator> * setIns);
+//Drop a call along with its setins and its getout (if any),
+// putting repl (if any) in its place. Returns the position
+// after what was dropped.
+std::list<Quad *>::iterator dropCall(std::list<Quad *> * quads,
+	std::list<Quad *>::iterator callPos,
+	std::vector<std::list<Quad *>::iterator> * setIns, Quad * repl);
+
+//Evaluate a comparison operator on two constants
+bool evalCmp(BinOp op, long int a, long int b);
+//Evaluate op on two constants as the generated code would,
+// with 64-bit wraparound. Division by zero (and the one
+// overflowing division) is left for run time.
+bool foldBinOp(BinOp op, long int a, long int b, long int * res);
+long int foldUnaryOp(UnaryOp op, long int a);
+
+//Whether opd names storage that can be written: a symbol
+// or a (non-string) temporary
+bool isVar(Opd * opd);
+//Variables read by quad, including the globals that a call
+// may read (all of them, unless the callee is summarized)
+std::set<Opd *> quadUses(Procedure * proc, Quad * quad);
+//Variables whose value may be changed by quad, including
+// the globals that a call may write
+std::set<Opd *> quadMayDefs(Procedure * proc, Quad * quad);
+//Whether quad may fault when it runs. Only division can, and
+// only when its divisor is not a literal known to be safe.
+// Such quads must not be moved past other side effects.
+bool mayFault(Quad * quad);
+//Remove the quad at pos, keeping any labels on it alive.
+// Returns the position after the removed quad.
+std::list<Quad *>::iterator eraseQuad(std::list<Quad *> * quads,
+	std::list<Quad *>::iterator pos);
+//Replace every occurrence of oldOpd in the procedure body
+void renameOpd(Procedure * proc, Opd * oldOpd, Opd * newOpd);
+//Drop temps that no quad refers to from the frame
+bool removeUnusedTemps(Procedure * proc);
+
+//Optimization passes. Each returns true if it changed the
+// procedure.
+bool propagateCopies(Procedure * proc);
+bool coalesceTemps(Procedure * proc);
+bool removeDeadCode(Procedure * proc);
+bool numberValues(Procedure * proc);
+bool eliminatePartialRedundancy(Procedure * proc);
+bool simplifyAlgebra(Procedure * proc);
+bool cleanUpControlFlow(Procedure * proc);
+bool reassociate(Procedure * proc);
+bool hoistInvariants(Procedure * proc);
+bool rotateLoops(Procedure * proc);
+bool unswitchLoops(Procedure * proc, OptOptions * opts);
+bool threadJumps(Procedure * proc, OptOptions * opts);
+bool replaceFinalValues(Procedure * proc);
+bool reduceInductionVars(Procedure * proc);
+bool unrollLoops(Procedure * proc, OptOptions * opts);
+bool formSuperblocks(Procedure * proc, OptOptions * opts);
+bool inlineCalls(Procedure * caller, CallGraph * calls, OptOptions * opts);
+bool removePureCalls(Procedure * proc);
+bool evaluateCalls(Procedure * proc, OptOptions * opts);
+bool propagateRanges(Procedure * proc);
+bool memoize(Procedure * proc, CallGraph * calls, OptOptions * opts);
+bool precompute(Procedure * proc, OptOptions * opts);
+bool specializeProcs(IRProgram * prog, OptOptions * opts);
+bool removeTailRecursion(Procedure * proc);
+bool accumulateRecursion(Procedure * proc);
+bool markTailCalls(Procedure * proc);
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+CallGraph::CallGraph(IRProgram * prog){
+	for (auto proc : *prog->getProcs()){
+		byName[proc->getName()] = proc;
+		callees[proc];
+		callers[proc];
+	}
+	for (auto proc : *prog->getProcs()){
+		for (auto quad : *proc->getQuads()){
+			CallQuad * call = quad->asCall();
+			if (call == nullptr){ continue; }
+			Procedure * callee = getProc(call);
+			if (callee == nullptr){ continue; }
+			callees[proc].insert(callee);
+			callers[callee].insert(proc);
+			callSites[callee]++;
+		}
+	}
+	for (auto proc : *prog->getProcs()){
+		if (!index.count(proc)){ findCycles(proc); }
+	}
+}
+
+//Tarjan's algorithm, which finishes each cycle only after
+// every cycle it calls into, giving the bottom-up order
+void CallGraph::findCycles(Procedure * proc){
+	size_t idx = index.size();
+	index[proc] = idx;
+	lowLink[proc] = idx;
+	stack.push_back(proc);
+	onStack.insert(proc);
+	for (auto callee : callees[proc]){
+		if (!index.count(callee)){
+			findCycles(callee);
+			lowLink[proc] = std::min(lowLink[proc], lowLink[callee]);
+		} else if (onStack.count(callee)){
+			lowLink[proc] = std::min(lowLink[proc], index[callee]);
+		}
+	}
+	if (lowLink[proc] != index[proc]){ return; }
+	Procedure * member;
+	do {
+		member = stack.back();
+		stack.pop_back();
+		onStack.erase(member);
+		cycleOf[member] = idx;
+		bottomUp.push_back(member);
+	} while (member != proc);
+}
+
+Procedure * CallGraph::getProc(CallQuad * call){
+	auto found = byName.find(call->getCallee()->getName());
+	if (found == byName.end()){ return nullptr; }
+	return found->second;
+}
+
+std::set<Procedure *> * CallGraph::getCallees(Procedure * proc){
+	return &callees[proc];
+}
+
+std::set<Procedure *> * CallGraph::getCallers(Procedure * proc){
+	return &callers[proc];
+}
+
+size_t CallGraph::numCallSites(Procedure * proc){
+	return callSites[proc];
+}
+
+bool findSetIns(std::list<Quad *> * quads,
+	std::list<Quad *>::iterator callPos, size_t numArgs,
+	std::vector<std::list<Quad *>::iterator> * setIns){
+	if ((*callPos)->hasLabels()){ return false; }
+	setIns->assign(numArgs + 1, quads->end());
+	size_t found = 0;
+	for (auto itr = callPos ; found < numArgs && itr != quads->begin() ; ){
+		--itr;
+		Quad * quad = *itr;
+		if (quad->asCall() != nullptr || !quad->fallsThrough()
+			|| quad->getTarget() != nullptr){
+			break;
+		}
+		SetInQuad * setIn = quad->asSetIn();
+		if (setIn != nullptr && setIn->getIndex() >= 1
+			&& setIn->getIndex() <= numArgs
+			&& (*setIns)[setIn->getIndex()] == quads->end()){
+			(*setIns)[setIn->getIndex()] = itr;
+			found++;
+		}
+		if (quad->hasLabels()){ break; }
+	}
+	return found == numArgs;
+}
+
+std::list<Quad *>::iterator dropCall(std::list<Quad *> * quads,
+	std::list<Quad *>::iterator callPos,
+	std::vector<std::list<Quad *>::iterator> * setIns, Quad * repl){
+	auto end = std::next(callPos);
+	if (end != quads->end() && (*end)->asGetOut() != nullptr){ ++end; }
+	for (size_t i = 1 ; i < setIns->size() ; i++){
+		eraseQuad(quads, (*setIns)[i]);
+	}
+	if (repl != nullptr){ end = quads->insert(end, repl); }
+	while (callPos != end){ callPos = eraseQuad(quads, callPos); }
+	return repl == nullptr ? end : std::next(end);
+}
+
+bool CallGraph::isRecursive(Procedure * a, Procedure * b){
+	if (cycleOf[a] != cycleOf[b]){ return false; }
+	return a != b || callees[a].count(a) > 0;
+}
+
+}
@@ -0,0 +1,427 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+ControlFlowGraph::ControlFlowGraph(Procedure * proc) : myProc(proc){
+	//Labels and jumps split the body into blocks
+	BasicBlock * cur = nullptr;
+	bool blockEnded = true;
+	for (auto quad : *proc->getQuads()){
+		if (blockEnded || quad->hasLabels()){
+			cur = new BasicBlock(blocks.size());
+			blocks.push_back(cur);
+		}
+		cur->getQuads()->push_back(quad);
+		blockEnded = quad->getTarget() != nullptr
+			|| !quad->fallsThrough();
+	}
+	exit = new BasicBlock(blocks.size());
+
+	std::map<Label *, BasicBlock *> labelBlocks;
+	for (auto block : blocks){
+		for (auto label : block->getQuads()->front()->getLabels()){
+			labelBlocks[label] = block;
+		}
+	}
+	labelBlocks[proc->getLeaveLabel()] = exit;
+
+	for (size_t i = 0 ; i < blocks.size() ; i++){
+		BasicBlock * block = blocks[i];
+		Quad * last = block->getQuads()->back();
+		Label * tgt = last->getTarget();
+		if (tgt != nullptr){
+			auto found = labelBlocks.find(tgt);
+			if (found == labelBlocks.end()){
+				throw new InternalError("Jump to unknown label");
+			}
+			addEdge(block, found->second);
+		}
+		if (last->fallsThrough()){
+			BasicBlock * next = exit;
+			if (i + 1 < blocks.size()){ next = blocks[i + 1]; }
+			addEdge(block, next);
+		}
+	}
+}
+
+BasicBlock * ControlFlowGraph::getEntry(){
+	if (blocks.empty()){ return exit; }
+	return blocks.front();
+}
+
+void ControlFlowGraph::addEdge(BasicBlock * from, BasicBlock * to){
+	for (auto succ : *from->getSuccs()){
+		if (succ == to){ return; }
+	}
+	from->getSuccs()->push_back(to);
+	to->getPreds()->push_back(from);
+}
+
+Label * ControlFlowGraph::getLabel(BasicBlock * block){
+	if (block == exit){ return myProc->getLeaveLabel(); }
+	Quad * first = block->getQuads()->front();
+	if (!first->hasLabels()){ first->addLabel(myProc->makeLabel()); }
+	return first->getLabels().front();
+}
+
+void BasicBlock::append(std::list<Quad *> * more){
+	if (more->empty()){ return; }
+	auto pos = quads.end();
+	if (!quads.empty() && quads.back()->getTarget() != nullptr){ --pos; }
+	if (pos == quads.begin() && pos != quads.end()){
+		(*pos)->moveLabelsTo(more->front());
+	}
+	quads.splice(pos, *more);
+}
+
+void ControlFlowGraph::commit(){
+	std::list<Quad *> * body = myProc->getQuads();
+	body->clear();
+	for (auto block : blocks){
+		for (auto quad : *block->getQuads()){
+			body->push_back(quad);
+		}
+	}
+}
+
+std::list<BasicBlock *> NaturalLoop::getExiting(){
+	std::list<BasicBlock *> res;
+	for (auto block : blocks){
+		for (auto succ : *block->getSuccs()){
+			if (!contains(succ)){
+				res.push_back(block);
+				break;
+			}
+		}
+	}
+	return res;
+}
+
+std::set<BasicBlock *> NaturalLoop::getExits(){
+	std::set<BasicBlock *> res;
+	for (auto block : blocks){
+		for (auto succ : *block->getSuccs()){
+			if (!contains(succ)){ res.insert(succ); }
+		}
+	}
+	return res;
+}
+
+std::list<NaturalLoop *> findLoops(ControlFlowGraph * cfg,
+	Dominators * doms){
+	std::map<BasicBlock *, NaturalLoop *> byHeader;
+	std::list<NaturalLoop *> res;
+	for (auto block : *doms->getOrder()){
+		for (auto succ : *block->getSuccs()){
+			//An edge to a dominator is a back edge
+			if (!doms->dominates(succ, block)){ continue; }
+			NaturalLoop *& loop = byHeader[succ];
+			if (loop == nullptr){
+				loop = new NaturalLoop(succ);
+				res.push_back(loop);
+			}
+			loop->getLatches()->push_back(block);
+			std::list<BasicBlock *> work = {block};
+			while (!work.empty()){
+				BasicBlock * cur = work.front();
+				work.pop_front();
+				if (!loop->getBlocks()->insert(cur).second){ continue; }
+				for (auto pred : *cur->getPreds()){
+					if (doms->isReachable(pred)){ work.push_back(pred); }
+				}
+			}
+		}
+	}
+	res.sort([](NaturalLoop * a, NaturalLoop * b){
+		return a->getBlocks()->size() < b->getBlocks()->size();
+	});
+	return res;
+}
+
+//A block outside the loop whose only successor is the header,
+// and through which every entry into the loop passes
+static BasicBlock * findPreheader(ControlFlowGraph * cfg,
+	NaturalLoop * loop){
+	BasicBlock * header = loop->getHeader();
+	if (header == cfg->getEntry()){ return nullptr; }
+	BasicBlock * res = nullptr;
+	for (auto pred : *header->getPreds()){
+		if (loop->contains(pred)){ continue; }
+		if (res != nullptr){ return nullptr; }
+		res = pred;
+	}
+	if (res == nullptr || res->getSuccs()->size() != 1){ return nullptr; }
+	return res;
+}
+
+//A new preheader goes right before the header, so the block
+// laid out before the header must not fall into it from
+// inside the loop
+bool canPlacePreheader(ControlFlowGraph * cfg, NaturalLoop * loop){
+	if (findPreheader(cfg, loop) != nullptr){ return true; }
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	auto pos = std::find(blocks->begin(), blocks->end(), loop->getHeader());
+	if (pos == blocks->begin()){ return true; }
+	BasicBlock * prev = *(pos - 1);
+	return !loop->contains(prev) || !prev->getQuads()->back()->fallsThrough();
+}
+
+void placePreheader(Procedure * proc, ControlFlowGraph * cfg,
+	NaturalLoop * loop, std::list<Quad *> * quads){
+	BasicBlock * pre = findPreheader(cfg, loop);
+	if (pre != nullptr){
+		pre->append(quads);
+		return;
+	}
+	BasicBlock * header = loop->getHeader();
+	std::list<Label *> headerLabels;
+	if (!header->getQuads()->empty()){
+		headerLabels = header->getQuads()->front()->getLabels();
+	}
+	Label * preLabel = proc->makeLabel();
+	for (auto pred : *header->getPreds()){
+		if (loop->contains(pred)){ continue; }
+		Quad * last = pred->getQuads()->back();
+		Label * target = last->getTarget();
+		if (target == nullptr || std::find(headerLabels.begin(),
+			headerLabels.end(), target) == headerLabels.end()){
+			continue;
+		}
+		if (JmpQuad * jmp = last->asJmp()){ jmp->setTarget(preLabel); }
+		if (JmpIfQuad * jmpIf = last->asJmpIf()){ jmpIf->setTarget(preLabel); }
+	}
+	quads->front()->addLabel(preLabel);
+	header->getQuads()->splice(header->getQuads()->begin(), *quads);
+}
+
+bool isVar(Opd * opd){
+	if (opd == nullptr){ return false; }
+	if (opd->asSym() != nullptr){ return true; }
+	AuxOpd * aux = opd->asAux();
+	return aux != nullptr && aux->isTmp();
+}
+
+std::set<Opd *> quadUses(Procedure * proc, Quad * quad){
+	std::set<Opd *> res;
+	for (auto src : quad->getSrcs()){
+		if (isVar(src)){ res.insert(src); }
+	}
+	if (CallQuad * call = quad->asCall()){
+		ModRef * modRef = calleeModRef(proc, call);
+		if (modRef != nullptr){
+			res.insert(modRef->reads.begin(), modRef->reads.end());
+			return res;
+		}
+		for (auto global : proc->getProg()->getGlobals()){
+			res.insert(global);
+		}
+	}
+	return res;
+}
+
+std::set<Opd *> quadMayDefs(Procedure * proc, Quad * quad){
+	std::set<Opd *> res;
+	Opd * dst = quad->getDst();
+	if (isVar(dst)){ res.insert(dst); }
+	if (CallQuad * call = quad->asCall()){
+		ModRef * modRef = calleeModRef(proc, call);
+		if (modRef != nullptr){
+			res.insert(modRef->writes.begin(), modRef->writes.end());
+			return res;
+		}
+		for (auto global : proc->getProg()->getGlobals()){
+			res.insert(global);
+		}
+	}
+	return res;
+}
+
+bool mayFault(Quad * quad){
+	BinOpQuad * bin = quad->asBinOp();
+	if (bin == nullptr || bin->getOp() != DIV){ return false; }
+	LitOpd * divisor = bin->getSrc2()->asLit();
+	return divisor == nullptr || divisor->getVal() == 0
+		|| divisor->getVal() == -1;
+}
+
+std::list<Quad *>::iterator eraseQuad(std::list<Quad *> * quads,
+	std::list<Quad *>::iterator pos){
+	Quad * quad = *pos;
+	auto next = quads->erase(pos);
+	if (quad->hasLabels()){
+		if (next != quads->end()){
+			quad->moveLabelsTo(*next);
+		} else {
+			Quad * nop = new NopQuad();
+			quad->moveLabelsTo(nop);
+			quads->insert(next, nop);
+		}
+	}
+	return next;
+}
+
+void renameOpd(Procedure * proc, Opd * oldOpd, Opd * newOpd){
+	for (auto quad : *proc->getQuads()){
+		if (quad->getDst() == oldOpd){ quad->setDst(newOpd); }
+		quad->replaceSrc(oldOpd, newOpd);
+	}
+}
+
+bool removeUnusedTemps(Procedure * proc){
+	std::set<Opd *> used;
+	for (auto quad : *proc->getQuads()){
+		used.insert(quad->getDst());
+		for (auto src : quad->getSrcs()){
+			used.insert(src);
+		}
+	}
+	std::list<AuxOpd *> unused;
+	for (auto tmp : *proc->getTemps()){
+		if (!used.count(tmp)){ unused.push_back(tmp); }
+	}
+	for (auto tmp : unused){
+		proc->removeTmp(tmp);
+	}
+	return !unused.empty();
+}
+
+Liveness::Liveness(ControlFlowGraph * cfg, bool strong){
+	Procedure * proc = cfg->getProc();
+
+	//Globals may be read after the procedure returns
+	std::set<Opd *> * exitLive = &liveIn[cfg->getExit()];
+	for (auto global : proc->getProg()->getGlobals()){
+		exitLive->insert(global);
+	}
+
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	bool changed = true;
+	while (changed){
+		changed = false;
+		for (auto itr = blocks->rbegin() ; itr != blocks->rend() ; ++itr){
+			BasicBlock * block = *itr;
+			std::set<Opd *> live;
+			for (auto succ : *block->getSuccs()){
+				std::set<Opd *> * succLive = &liveIn[succ];
+				live.insert(succLive->begin(), succLive->end());
+			}
+			liveOut[block] = live;
+
+			std::list<Quad *> * quads = block->getQuads();
+			for (auto q = quads->rbegin() ; q != quads->rend() ; ++q){
+				Quad * quad = *q;
+				liveAfter[quad] = live;
+				Opd * dst = quad->getDst();
+				bool needed = !strong || quad->hasSideEffects()
+					|| mayFault(quad) || !isVar(dst) || live.count(dst) > 0;
+				if (isVar(dst)){ live.erase(dst); }
+				if (!needed){ continue; }
+				for (auto use : quadUses(proc, quad)){
+					live.insert(use);
+				}
+			}
+			if (live != liveIn[block]){
+				liveIn[block] = live;
+				changed = true;
+			}
+		}
+	}
+}
+
+std::set<Opd *> * Liveness::getLiveIn(BasicBlock * block){
+	return &liveIn[block];
+}
+
+std::set<Opd *> * Liveness::getLiveOut(BasicBlock * block){
+	return &liveOut[block];
+}
+
+std::set<Opd *> * Liveness::getLiveAfter(Quad * quad){
+	return &liveAfter[quad];
+}
+
+Dominators::Dominators(ControlFlowGraph * cfg){
+	//Depth-first search from the entry for a postorder
+	std::list<BasicBlock *> postorder;
+	std::set<BasicBlock *> seen;
+	std::list<std::pair<BasicBlock *, std::list<BasicBlock *>::iterator>> stack;
+	BasicBlock * entry = cfg->getEntry();
+	seen.insert(entry);
+	stack.push_back(std::make_pair(entry, entry->getSuccs()->begin()));
+	while (!stack.empty()){
+		BasicBlock * block = stack.back().first;
+		auto & next = stack.back().second;
+		if (next == block->getSuccs()->end()){
+			postorder.push_back(block);
+			stack.pop_back();
+			continue;
+		}
+		BasicBlock * succ = *next;
+		++next;
+		if (seen.insert(succ).second){
+			stack.push_back(std::make_pair(succ, succ->getSuccs()->begin()));
+		}
+	}
+	order.assign(postorder.rbegin(), postorder.rend());
+	for (size_t i = 0 ; i < order.size() ; i++){
+		orderIdx[order[i]] = i;
+	}
+
+	//Cooper, Harvey and Kennedy's iterative algorithm
+	idoms[entry] = entry;
+	bool changed = true;
+	while (changed){
+		changed = false;
+		for (auto block : order){
+			if (block == entry){ continue; }
+			BasicBlock * newIDom = nullptr;
+			for (auto pred : *block->getPreds()){
+				if (!idoms.count(pred)){ continue; }
+				if (newIDom == nullptr){
+					newIDom = pred;
+					continue;
+				}
+				BasicBlock * a = pred;
+				BasicBlock * b = newIDom;
+				while (a != b){
+					while (orderIdx[a] > orderIdx[b]){ a = idoms[a]; }
+					while (orderIdx[b] > orderIdx[a]){ b = idoms[b]; }
+				}
+				newIDom = a;
+			}
+			if (idoms[block] != newIDom){
+				idoms[block] = newIDom;
+				changed = true;
+			}
+		}
+	}
+	for (auto block : order){
+		if (block != entry){ children[idoms[block]].push_back(block); }
+	}
+}
+
+BasicBlock * Dominators::getIDom(BasicBlock * block){
+	auto found = idoms.find(block);
+	if (found == idoms.end() || found->second == block){ return nullptr; }
+	return found->second;
+}
+
+std::list<BasicBlock *> * Dominators::getChildren(BasicBlock * block){
+	return &children[block];
+}
+
+bool Dominators::isReachable(BasicBlock * block){
+	return orderIdx.count(block) > 0;
+}
+
+bool Dominators::dominates(BasicBlock * a, BasicBlock * b){
+	if (!isReachable(a) || !isReachable(b)){ return false; }
+	while (b != nullptr){
+		if (a == b){ return true; }
+		b = getIDom(b);
+	}
+	return false;
+}
+
+}
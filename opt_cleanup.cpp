@@ -0,0 +1,223 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+//Cleanup of the control flow left behind by lowering and by
+// the other passes. Each round looks for one kind of change,
+// and the rounds repeat until none finds anything:
+//
+// - labels that no jump targets are dropped, and nops go
+//   away, handing their labels on to the quad after them
+// - blocks that control cannot reach are deleted
+// - a jump to a block that holds only nops, or only a jump,
+//   goes on to where that block leads
+// - a jump to the next block is deleted, and a branch over a
+//   jump to the next block but one becomes the opposite
+//   branch to where that jump went
+// - a block that is only ever entered by a jump from one
+//   block is moved up in place of that jump
+//
+// Blocks that control falls from one into the next are merged
+// as soon as the labels between them are dropped.
+class ControlFlowCleanup{
+public:
+	ControlFlowCleanup(Procedure * procIn) : proc(procIn){ }
+	bool run();
+private:
+	bool dropLabels();
+	bool dropUnreachable(ControlFlowGraph * cfg);
+	bool forwardJumps(ControlFlowGraph * cfg);
+	bool dropJumpsToNext(ControlFlowGraph * cfg);
+	bool mergeBlocks(ControlFlowGraph * cfg);
+	void findLabels(ControlFlowGraph * cfg);
+	BasicBlock * next(ControlFlowGraph * cfg, BasicBlock * block);
+	BasicBlock * targetOf(ControlFlowGraph * cfg, BasicBlock * block);
+	void retarget(Quad * quad, Label * label);
+
+	Procedure * proc;
+	std::map<Label *, BasicBlock *> labelBlocks;
+	std::map<BasicBlock *, size_t> layoutIdx;
+};
+
+void ControlFlowCleanup::findLabels(ControlFlowGraph * cfg){
+	labelBlocks.clear();
+	layoutIdx.clear();
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	for (size_t i = 0 ; i < blocks->size() ; i++){
+		BasicBlock * block = (*blocks)[i];
+		layoutIdx[block] = i;
+		for (auto label : block->getQuads()->front()->getLabels()){
+			labelBlocks[label] = block;
+		}
+	}
+	labelBlocks[proc->getLeaveLabel()] = cfg->getExit();
+}
+
+//The block that falling out of the end of block leads to
+BasicBlock * ControlFlowCleanup::next(ControlFlowGraph * cfg,
+	BasicBlock * block){
+	size_t idx = layoutIdx[block] + 1;
+	if (idx < cfg->getBlocks()->size()){ return (*cfg->getBlocks())[idx]; }
+	return cfg->getExit();
+}
+
+//The block that the quad ending block jumps to, if any
+BasicBlock * ControlFlowCleanup::targetOf(ControlFlowGraph * cfg,
+	BasicBlock * block){
+	if (block == cfg->getExit()){ return nullptr; }
+	Label * tgt = block->getQuads()->back()->getTarget();
+	if (tgt == nullptr){ return nullptr; }
+	return labelBlocks[tgt];
+}
+
+void ControlFlowCleanup::retarget(Quad * quad, Label * label){
+	if (JmpQuad * jmp = quad->asJmp()){ jmp->setTarget(label); }
+	if (JmpIfQuad * jmpIf = quad->asJmpIf()){ jmpIf->setTarget(label); }
+}
+
+bool ControlFlowCleanup::dropLabels(){
+	std::list<Quad *> * quads = proc->getQuads();
+	std::set<Label *> targets;
+	for (auto quad : *quads){
+		if (quad->getTarget() != nullptr){ targets.insert(quad->getTarget()); }
+	}
+	bool changed = false;
+	for (auto itr = quads->begin() ; itr != quads->end() ; ){
+		Quad * quad = *itr;
+		for (auto label : quad->getLabels()){
+			if (targets.count(label)){ continue; }
+			quad->removeLabel(label);
+			changed = true;
+		}
+		if (quad->asNop() == nullptr
+			|| (quad->hasLabels() && std::next(itr) == quads->end())){
+			++itr;
+			continue;
+		}
+		itr = eraseQuad(quads, itr);
+		changed = true;
+	}
+	return changed;
+}
+
+bool ControlFlowCleanup::dropUnreachable(ControlFlowGraph * cfg){
+	Dominators doms(cfg);
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	size_t before = blocks->size();
+	blocks->erase(std::remove_if(blocks->begin(), blocks->end(),
+		[&](BasicBlock * block){ return !doms.isReachable(block); }),
+		blocks->end());
+	return blocks->size() != before;
+}
+
+bool ControlFlowCleanup::forwardJumps(ControlFlowGraph * cfg){
+	bool changed = false;
+	for (auto block : *cfg->getBlocks()){
+		BasicBlock * first = targetOf(cfg, block);
+		if (first == nullptr){ continue; }
+		BasicBlock * cur = first;
+		std::set<BasicBlock *> seen;
+		while (cur != cfg->getExit() && seen.insert(cur).second){
+			bool empty = true;
+			for (auto quad : *cur->getQuads()){
+				if (quad->asNop() == nullptr && quad->asJmp() == nullptr){
+					empty = false;
+				}
+			}
+			if (!empty){ break; }
+			BasicBlock * to = targetOf(cfg, cur);
+			cur = to == nullptr ? next(cfg, cur) : to;
+		}
+		if (cur == first){ continue; }
+		retarget(block->getQuads()->back(), cfg->getLabel(cur));
+		changed = true;
+	}
+	return changed;
+}
+
+bool ControlFlowCleanup::dropJumpsToNext(ControlFlowGraph * cfg){
+	bool changed = false;
+	for (auto block : *cfg->getBlocks()){
+		BasicBlock * to = targetOf(cfg, block);
+		if (to == nullptr){ continue; }
+		std::list<Quad *> * quads = block->getQuads();
+		BasicBlock * after = next(cfg, block);
+		if (to == after){
+			Quad * nop = new NopQuad();
+			quads->back()->moveLabelsTo(nop);
+			quads->back() = nop;
+			changed = true;
+			continue;
+		}
+
+		//if c goto L; goto M; L: becomes if not c goto M; L:
+		JmpIfQuad * branch = quads->back()->asJmpIf();
+		if (branch == nullptr || after == cfg->getExit()
+			|| after->getQuads()->size() != 1
+			|| after->getQuads()->front()->hasLabels()
+			|| after->getQuads()->front()->asJmp() == nullptr
+			|| next(cfg, after) != to){
+			continue;
+		}
+		JmpQuad * jmp = after->getQuads()->front()->asJmp();
+		branch->setTarget(jmp->getTarget());
+		branch->setInverted(!branch->isInverted());
+		after->getQuads()->clear();
+		after->getQuads()->push_back(new NopQuad());
+		changed = true;
+	}
+	return changed;
+}
+
+bool ControlFlowCleanup::mergeBlocks(ControlFlowGraph * cfg){
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	for (auto block : *blocks){
+		JmpQuad * jmp = block->getQuads()->back()->asJmp();
+		BasicBlock * to = targetOf(cfg, block);
+		if (jmp == nullptr || to == nullptr || to == block
+			|| to == cfg->getExit() || to == cfg->getEntry()
+			|| to->getPreds()->size() != 1){
+			continue;
+		}
+		std::list<Quad *> * quads = block->getQuads();
+		std::list<Quad *> * moved = to->getQuads();
+		for (auto label : moved->front()->getLabels()){
+			moved->front()->removeLabel(label);
+		}
+		if (moved->back()->fallsThrough()){
+			moved->push_back(new JmpQuad(cfg->getLabel(next(cfg, to))));
+		}
+		quads->pop_back();
+		if (quads->empty()){
+			jmp->moveLabelsTo(moved->front());
+		}
+		quads->splice(quads->end(), *moved);
+		blocks->erase(std::find(blocks->begin(), blocks->end(), to));
+		return true;
+	}
+	return false;
+}
+
+bool ControlFlowCleanup::run(){
+	bool changed = false;
+	while (true){
+		bool round = dropLabels();
+		ControlFlowGraph cfg(proc);
+		findLabels(&cfg);
+		round = round || dropUnreachable(&cfg);
+		round = round || forwardJumps(&cfg);
+		round = round || dropJumpsToNext(&cfg);
+		round = round || mergeBlocks(&cfg);
+		if (!round){ return changed; }
+		cfg.commit();
+		changed = true;
+	}
+}
+
+bool cleanUpControlFlow(Procedure * proc){
+	ControlFlowCleanup cleanup(proc);
+	return cleanup.run();
+}
+
+}
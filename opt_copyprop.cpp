@@ -0,0 +1,217 @@
+#include "opt.hpp"
+
+namespace lake{
+
+//A copy d := s that can be forwarded into later uses of d
+static bool isForwardable(Quad * quad){
+	AssignQuad * copy = quad->asAssign();
+	if (copy == nullptr){ return false; }
+	Opd * dst = copy->getDst();
+	Opd * src = copy->getSrc();
+	return isVar(dst) && dst != src;
+}
+
+//Update the set of available copies to account for quad
+static void copyTransfer(Procedure * proc, Quad * quad,
+	std::set<AssignQuad *> * avail){
+	std::set<Opd *> defs = quadMayDefs(proc, quad);
+	if (!defs.empty()){
+		for (auto itr = avail->begin() ; itr != avail->end() ; ){
+			AssignQuad * copy = *itr;
+			if (defs.count(copy->getDst()) || defs.count(copy->getSrc())){
+				itr = avail->erase(itr);
+			} else {
+				++itr;
+			}
+		}
+	}
+	if (isForwardable(quad)){
+		avail->insert(quad->asAssign());
+	}
+}
+
+bool propagateCopies(Procedure * proc){
+	ControlFlowGraph cfg(proc);
+	std::vector<BasicBlock *> * blocks = cfg.getBlocks();
+
+	std::set<AssignQuad *> allCopies;
+	for (auto quad : *proc->getQuads()){
+		if (isForwardable(quad)){ allCopies.insert(quad->asAssign()); }
+	}
+	if (allCopies.empty()){ return false; }
+
+	//Forward "available copies" analysis: a copy is available
+	// at a point if it executed on every path to that point
+	// and neither of its operands has changed since
+	std::map<BasicBlock *, std::set<AssignQuad *>> availIn;
+	std::map<BasicBlock *, std::set<AssignQuad *>> availOut;
+	for (auto block : *blocks){
+		availOut[block] = allCopies;
+	}
+	bool changed = true;
+	while (changed){
+		changed = false;
+		for (auto block : *blocks){
+			std::set<AssignQuad *> avail;
+			bool first = true;
+			for (auto pred : *block->getPreds()){
+				std::set<AssignQuad *> * predOut = &availOut[pred];
+				if (first){
+					avail = *predOut;
+					first = false;
+					continue;
+				}
+				for (auto itr = avail.begin() ; itr != avail.end() ; ){
+					if (predOut->count(*itr)){ ++itr; }
+					else { itr = avail.erase(itr); }
+				}
+			}
+			if (block == cfg.getEntry()){ avail.clear(); }
+			availIn[block] = avail;
+			for (auto quad : *block->getQuads()){
+				copyTransfer(proc, quad, &avail);
+			}
+			if (avail != availOut[block]){
+				availOut[block] = avail;
+				changed = true;
+			}
+		}
+	}
+
+	//Decide every replacement against the original program
+	// before rewriting anything, so that a rewritten copy is
+	// never mistaken for the copy the analysis saw
+	struct Rewrite{
+		Quad * quad;
+		Opd * oldSrc;
+		Opd * newSrc;
+	};
+	std::list<Rewrite> rewrites;
+	for (auto block : *blocks){
+		std::set<AssignQuad *> avail = availIn[block];
+		for (auto quad : *block->getQuads()){
+			for (auto src : quad->getSrcs()){
+				if (!isVar(src)){ continue; }
+				for (auto copy : avail){
+					if (copy->getDst() == src){
+						rewrites.push_back({quad, src, copy->getSrc()});
+						break;
+					}
+				}
+			}
+			copyTransfer(proc, quad, &avail);
+		}
+	}
+	for (auto rewrite : rewrites){
+		rewrite.quad->replaceSrc(rewrite.oldSrc, rewrite.newSrc);
+	}
+	return !rewrites.empty();
+}
+
+//Interference graph over the variables of a procedure. Two
+// variables interfere if one is written while the other
+// holds a value that may still be read.
+class Interference{
+public:
+	Interference(Procedure * proc, ControlFlowGraph * cfg){
+		Liveness liveness(cfg);
+		for (auto quad : *proc->getQuads()){
+			std::set<Opd *> * live = liveness.getLiveAfter(quad);
+			AssignQuad * copy = quad->asAssign();
+			for (auto def : quadMayDefs(proc, quad)){
+				for (auto other : *live){
+					//The source of a copy holds the same value
+					// as its destination, so they can share
+					if (copy != nullptr && copy->getSrc() == other){
+						continue;
+					}
+					addEdge(def, other);
+				}
+			}
+		}
+	}
+	bool interferes(Opd * a, Opd * b){
+		return a == b || edges[a].count(b) > 0;
+	}
+	//Fold b's edges into a, once b has been renamed to a
+	void merge(Opd * a, Opd * b){
+		for (auto other : edges[b]){
+			edges[other].erase(b);
+			addEdge(a, other);
+		}
+		edges.erase(b);
+	}
+private:
+	void addEdge(Opd * a, Opd * b){
+		if (a == b){ return; }
+		edges[a].insert(b);
+		edges[b].insert(a);
+	}
+	std::map<Opd *, std::set<Opd *>> edges;
+};
+
+static bool isTmp(Opd * opd){
+	return opd->asAux() != nullptr && opd->asAux()->isTmp();
+}
+
+bool coalesceTemps(Procedure * proc){
+	ControlFlowGraph cfg(proc);
+	Interference graph(proc, &cfg);
+	std::set<AuxOpd *> merged;
+
+	//Coalesce the operands of copies, so that the copy
+	// itself becomes x := x and can be dropped
+	for (auto quad : *proc->getQuads()){
+		AssignQuad * copy = quad->asAssign();
+		if (copy == nullptr){ continue; }
+		Opd * dst = copy->getDst();
+		Opd * src = copy->getSrc();
+		if (!isVar(src) || graph.interferes(dst, src)){ continue; }
+		if (isTmp(src)){
+			renameOpd(proc, src, dst);
+			graph.merge(dst, src);
+			merged.insert(src->asAux());
+		} else if (isTmp(dst)){
+			renameOpd(proc, dst, src);
+			graph.merge(src, dst);
+			merged.insert(dst->asAux());
+		}
+	}
+
+	//Let temps whose live ranges are disjoint share a slot
+	std::list<AuxOpd *> slots;
+	for (auto tmp : *proc->getTemps()){
+		if (merged.count(tmp)){ continue; }
+		AuxOpd * slot = nullptr;
+		for (auto candidate : slots){
+			if (!graph.interferes(candidate, tmp)){
+				slot = candidate;
+				break;
+			}
+		}
+		if (slot == nullptr){
+			slots.push_back(tmp);
+			continue;
+		}
+		renameOpd(proc, tmp, slot);
+		graph.merge(slot, tmp);
+		merged.insert(tmp);
+	}
+
+	for (auto tmp : merged){
+		proc->removeTmp(tmp);
+	}
+
+	std::list<Quad *> * quads = proc->getQuads();
+	for (auto itr = quads->begin() ; itr != quads->end() ; ){
+		AssignQuad * copy = (*itr)->asAssign();
+		if (copy != nullptr && copy->getDst() == copy->getSrc()){
+			itr = eraseQuad(quads, itr);
+		} else {
+			++itr;
+		}
+	}
+	return !merged.empty();
+}
+
+}
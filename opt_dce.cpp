@@ -0,0 +1,47 @@
+#include "opt.hpp"
+
+namespace lake{
+
+//Dead code and dead store elimination. A quad without side
+// effects is dead if the variable it writes is not strongly
+// live afterwards. For temps this removes unused computations
+// (including the getout of a call whose result is dropped),
+// and for locals and formals it removes stores that are
+// overwritten or never read. Globals stay live at the exit
+// and at every call that may read them, and a READ or call is
+// never removed here, so stores to globals are only dropped
+// when they are overwritten before anything could observe
+// them. Calls to pure procedures are left to removePureCalls.
+// A division that may fault is kept as well, since dropping it
+// would change whether the program traps.
+bool removeDeadCode(Procedure * proc){
+	ControlFlowGraph cfg(proc);
+	Liveness liveness(&cfg, true);
+	bool changed = false;
+	for (auto block : *cfg.getBlocks()){
+		std::list<Quad *> * quads = block->getQuads();
+		for (auto itr = quads->begin() ; itr != quads->end() ; ){
+			Quad * quad = *itr;
+			Opd * dst = quad->getDst();
+			bool dead = false;
+			if (!quad->hasSideEffects() && !mayFault(quad) && isVar(dst)){
+				dead = !liveness.getLiveAfter(quad)->count(dst);
+				AssignQuad * copy = quad->asAssign();
+				if (copy != nullptr && copy->getSrc() == dst){
+					dead = true;
+				}
+			}
+			if (dead){
+				itr = eraseQuad(quads, itr);
+				changed = true;
+			} else {
+				++itr;
+			}
+		}
+	}
+	cfg.commit();
+	removeUnusedTemps(proc);
+	return changed;
+}
+
+}
@@ -0,0 +1,110 @@
+#include "opt.hpp"
+
+namespace lake{
+
+bool OptOptions::set(const char * setting){
+	std::string text = setting;
+	size_t eq = text.find('=');
+	if (eq == std::string::npos){ return false; }
+	std::string name = text.substr(0, eq);
+	std::map<std::string, size_t *> knobs = {
+		{"unroll", &unrollFactor},
+		{"unroll-budget", &unrollBudget},
+		{"unswitch-budget", &unswitchBudget},
+		{"thread-budget", &threadBudget},
+		{"superblock-budget", &superblockBudget},
+		{"inline", &inlineBudget},
+		{"inline-growth", &inlineGrowth},
+		{"specialize", &specializeCopies},
+		{"specialize-budget", &specializeBudget},
+		{"eval-fuel", &evalFuel},
+		{"memo", &memoEntries},
+		{"precompute", &precomputeFuel},
+	};
+	auto found = knobs.find(name);
+	if (found == knobs.end()){ return false; }
+	try {
+		size_t used;
+		long int val = std::stol(text.substr(eq + 1), &used);
+		if (val < 0 || eq + 1 + used != text.size()){ return false; }
+		*found->second = static_cast<size_t>(val);
+	} catch (std::exception &){
+		return false;
+	}
+	return true;
+}
+
+//The scalar passes feed each other, so run them until
+// none of them finds anything more to do. Range analysis is
+// the costliest, so it only runs once the others have settled.
+static void simplify(Procedure * proc, OptOptions * opts){
+	bool changed = true;
+	while (changed){
+		changed = false;
+		changed = simplifyAlgebra(proc) || changed;
+		changed = reassociate(proc) || changed;
+		changed = propagateCopies(proc) || changed;
+		changed = numberValues(proc) || changed;
+		changed = removeDeadCode(proc) || changed;
+		changed = removePureCalls(proc) || changed;
+		changed = evaluateCalls(proc, opts) || changed;
+		changed = cleanUpControlFlow(proc) || changed;
+		if (!changed){ changed = propagateRanges(proc); }
+	}
+}
+
+void Procedure::optimize(OptOptions * opts){
+	accumulateRecursion(this);
+	removeTailRecursion(this);
+	simplify(this, opts);
+	if (threadJumps(this, opts)){ simplify(this, opts); }
+	bool moved = rotateLoops(this);
+	moved = eliminatePartialRedundancy(this) || moved;
+	moved = hoistInvariants(this) || moved;
+	moved = unswitchLoops(this, opts) || moved;
+	if (moved){ simplify(this, opts); }
+	if (replaceFinalValues(this)){ simplify(this, opts); }
+	if (reduceInductionVars(this)){ simplify(this, opts); }
+	if (unrollLoops(this, opts)){ simplify(this, opts); }
+	if (formSuperblocks(this, opts)){ simplify(this, opts); }
+	coalesceTemps(this);
+	removeUnusedTemps(this);
+}
+
+void IRProgram::optimize(OptOptions * opts){
+	specializeProcs(this, opts);
+
+	//Callees are optimized before their callers, so that
+	// what gets inlined has been optimized already
+	CallGraph calls(this);
+	summarizeProcs(&calls);
+	std::map<Procedure *, std::string> stats;
+	for (auto proc : *calls.getBottomUp()){
+		size_t quadsBefore = proc->getQuads()->size();
+		size_t frameBefore = 8 * (proc->numLocals() + proc->numTemps());
+
+		inlineCalls(proc, &calls, opts);
+		precompute(proc, opts);
+		proc->optimize(opts);
+		summarizeProc(proc, &calls);
+		memoize(proc, &calls, opts);
+		//Last, as memoization stores results after the calls
+		// that compute them, taking those out of tail position
+		markTailCalls(proc);
+
+		size_t quadsAfter = proc->getQuads()->size();
+		size_t frameAfter = 8 * (proc->numLocals() + proc->numTemps());
+		stats[proc] = proc->getName()
+			+ ": quads " + std::to_string(quadsBefore)
+			+ " -> " + std::to_string(quadsAfter)
+			+ ", frame " + std::to_string(frameBefore)
+			+ " -> " + std::to_string(frameAfter) + " bytes\n";
+	}
+	if (opts->stats != nullptr){
+		for (auto proc : procs){
+			*opts->stats << stats[proc];
+		}
+	}
+}
+
+}
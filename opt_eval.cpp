@@ -0,0 +1,371 @@
+#include "opt.hpp"
+
+namespace lake{
+
+//An interpreter for the 3AC of procedures that neither read
+// nor change anything but their own frame, so that calls to
+// them with constant arguments can be run at compile time.
+// Every quad run uses up one unit of fuel, and the run gives
+// up when the fuel is gone, or on anything it cannot do as the
+// generated code would (such as dividing by zero), leaving the
+// call for run time. With effects allowed, it may also use
+// globals and write output, though it still cannot read input.
+class Evaluator{
+public:
+	Evaluator(Procedure * callerIn, size_t fuelIn)
+	: caller(callerIn), fuel(fuelIn){ }
+	bool run(Procedure * proc, std::vector<long int> * args,
+		long int * result);
+	//Let what is run use the globals in globalsIn, and append
+	// what it writes to outputIn, as the text of a string
+	// literal with a newline after each write
+	void allowEffects(std::map<Opd *, long int> * globalsIn,
+		std::string * outputIn);
+
+	//Where a call has got to
+	struct Frame{
+		Procedure * proc;
+		size_t pc;
+		std::map<Opd *, long int> vars;
+		std::vector<long int> outArgs;
+		long int callResult;
+		bool hasResult;
+		long int result;
+	};
+	Frame start(Procedure * proc);
+	//The quad frame runs next, or nullptr once it has finished
+	Quad * next(Frame * frame);
+	//Run the next quad of frame. Returns false, having changed
+	// nothing in the frame, if that cannot be done.
+	bool step(Frame * frame, std::vector<long int> * args, size_t depth);
+private:
+	//A procedure's body laid out for jumping around in
+	struct Code{
+		std::vector<Quad *> quads;
+		std::map<Label *, size_t> targets;
+	};
+	Code * getCode(Procedure * proc);
+	bool value(Frame * frame, Opd * opd, long int * val);
+	void assign(Frame * frame, Opd * opd, long int val);
+	bool writeString(Opd * str);
+	bool call(Procedure * proc, std::vector<long int> * args,
+		long int * result, size_t depth);
+
+	Procedure * caller;
+	size_t fuel;
+	std::map<Procedure *, Code> code;
+	std::map<Opd *, long int> * globals = nullptr;
+	std::string * output = nullptr;
+};
+
+//How deep calls may nest while evaluating
+static const size_t MAX_DEPTH = 256;
+
+//Whether a call to proc can be evaluated: it may not touch
+// globals or do I/O, and neither may what it calls
+static bool evaluable(Procedure * proc){
+	ModRef * modRef = proc->getModRef();
+	return modRef != nullptr && modRef->isPure() && modRef->reads.empty();
+}
+
+void Evaluator::allowEffects(std::map<Opd *, long int> * globalsIn,
+	std::string * outputIn){
+	globals = globalsIn;
+	output = outputIn;
+}
+
+Evaluator::Code * Evaluator::getCode(Procedure * proc){
+	auto found = code.find(proc);
+	if (found != code.end()){ return &found->second; }
+	Code * res = &code[proc];
+	for (auto quad : *proc->getQuads()){
+		for (auto label : quad->getLabels()){
+			res->targets[label] = res->quads.size();
+		}
+		res->quads.push_back(quad);
+	}
+	res->targets[proc->getLeaveLabel()] = res->quads.size();
+	return res;
+}
+
+Evaluator::Frame Evaluator::start(Procedure * proc){
+	Frame res;
+	res.proc = proc;
+	res.pc = 0;
+	res.callResult = 0;
+	res.hasResult = false;
+	res.result = 0;
+	return res;
+}
+
+Quad * Evaluator::next(Frame * frame){
+	Code * body = getCode(frame->proc);
+	if (frame->pc >= body->quads.size()){ return nullptr; }
+	return body->quads[frame->pc];
+}
+
+bool Evaluator::value(Frame * frame, Opd * opd, long int * val){
+	if (LitOpd * lit = opd->asLit()){
+		*val = lit->getVal();
+		return true;
+	}
+	auto found = frame->vars.find(opd);
+	if (found == frame->vars.end()){
+		if (globals == nullptr){ return false; }
+		found = globals->find(opd);
+		if (found == globals->end()){ return false; }
+	}
+	*val = found->second;
+	return true;
+}
+
+void Evaluator::assign(Frame * frame, Opd * opd, long int val){
+	if (globals != nullptr){
+		auto found = globals->find(opd);
+		if (found != globals->end()){
+			found->second = val;
+			return;
+		}
+	}
+	frame->vars[opd] = val;
+}
+
+//Append what writing the string str prints to the output
+bool Evaluator::writeString(Opd * str){
+	std::string text;
+	if (!caller->getProg()->getString(str, &text) || text.size() < 2){
+		return false;
+	}
+	*output += text.substr(1, text.size() - 2) + "\\n";
+	return true;
+}
+
+bool Evaluator::step(Frame * frame, std::vector<long int> * args,
+	size_t depth){
+	Quad * quad = next(frame);
+	if (quad == nullptr || fuel == 0){ return false; }
+	//Taken first, as a call may use up the rest of the fuel
+	fuel--;
+	Code * body = getCode(frame->proc);
+	size_t pc = frame->pc + 1;
+	long int a;
+	long int b;
+	if (BinOpQuad * bin = quad->asBinOp()){
+		long int res;
+		if (!value(frame, bin->getSrc1(), &a) || !value(frame, bin->getSrc2(), &b)
+			|| !foldBinOp(bin->getOp(), a, b, &res)){
+			return false;
+		}
+		assign(frame, bin->getDst(), res);
+	} else if (UnaryOpQuad * unary = quad->asUnaryOp()){
+		if (!value(frame, unary->getSrc(), &a)){ return false; }
+		assign(frame, unary->getDst(), foldUnaryOp(unary->getOp(), a));
+	} else if (AssignQuad * copy = quad->asAssign()){
+		if (!value(frame, copy->getSrc(), &a)){ return false; }
+		assign(frame, copy->getDst(), a);
+	} else if (JmpQuad * jmp = quad->asJmp()){
+		pc = body->targets.at(jmp->getTarget());
+	} else if (JmpIfQuad * jmpIf = quad->asJmpIf()){
+		if (!value(frame, jmpIf->getCnd(), &a)){ return false; }
+		if ((a != 0) == jmpIf->isInverted()){
+			pc = body->targets.at(jmpIf->getTarget());
+		}
+	} else if (GetInQuad * getIn = quad->asGetIn()){
+		if (getIn->getIndex() < 1 || getIn->getIndex() > args->size()){
+			return false;
+		}
+		assign(frame, getIn->getOpd(), (*args)[getIn->getIndex() - 1]);
+	} else if (SetInQuad * setIn = quad->asSetIn()){
+		//Arguments are pushed, as in the generated code, so the
+		// arguments of a call nested in another call's go on top
+		if (!value(frame, setIn->getOpd(), &a)){ return false; }
+		frame->outArgs.push_back(a);
+	} else if (CallQuad * inner = quad->asCall()){
+		Procedure * callee = findCallee(caller, inner);
+		if (callee == nullptr
+			|| frame->outArgs.size() < callee->getFormals()->size()){
+			return false;
+		}
+		auto first = frame->outArgs.end() - static_cast<std::ptrdiff_t>(
+			callee->getFormals()->size());
+		std::vector<long int> calleeArgs(first, frame->outArgs.end());
+		if (!call(callee, &calleeArgs, &frame->callResult, depth + 1)){
+			return false;
+		}
+		frame->outArgs.erase(first, frame->outArgs.end());
+	} else if (GetOutQuad * getOut = quad->asGetOut()){
+		assign(frame, getOut->getOpd(), frame->callResult);
+	} else if (SetOutQuad * setOut = quad->asSetOut()){
+		if (!value(frame, setOut->getOpd(), &frame->result)){ return false; }
+		frame->hasResult = true;
+	} else if (MemoQuad * memo = quad->asMemo()){
+		//Evaluation goes without the memo table
+		if (memo->getOp() == FETCH){ return false; }
+		if (memo->getOp() == PROBE){ assign(frame, memo->getDst(), 0); }
+	} else if (SyscallQuad * syscall = quad->asSyscall()){
+		if (output == nullptr || syscall->getSyscall() != WRITE){
+			return false;
+		}
+		Opd * arg = syscall->getArg();
+		if (arg->getType() == STRING){
+			if (!writeString(arg)){ return false; }
+		} else {
+			if (!value(frame, arg, &a)){ return false; }
+			*output += std::to_string(a) + "\\n";
+		}
+	} else if (quad->asNop() == nullptr){
+		return false;
+	}
+	frame->pc = pc;
+	return true;
+}
+
+bool Evaluator::run(Procedure * proc, std::vector<long int> * args,
+	long int * result){
+	return call(proc, args, result, 0);
+}
+
+bool Evaluator::call(Procedure * proc, std::vector<long int> * args,
+	long int * result, size_t depth){
+	if (depth > MAX_DEPTH || (output == nullptr && !evaluable(proc))){
+		return false;
+	}
+	Frame frame = start(proc);
+	while (next(&frame) != nullptr){
+		if (!step(&frame, args, depth)){ return false; }
+	}
+	*result = frame.result;
+	return frame.hasResult || output != nullptr;
+}
+
+//Replace calls to procedures that only compute a result from
+// their arguments, when those are all constants, by the result
+bool evaluateCalls(Procedure * proc, OptOptions * opts){
+	if (opts->evalFuel == 0){ return false; }
+	std::list<Quad *> * quads = proc->getQuads();
+	bool changed = false;
+	for (auto itr = quads->begin() ; itr != quads->end() ; ){
+		CallQuad * call = (*itr)->asCall();
+		Procedure * callee = call == nullptr ? nullptr : findCallee(proc, call);
+		auto next = std::next(itr);
+		std::vector<std::list<Quad *>::iterator> setIns;
+		if (callee == nullptr || !evaluable(callee) || next == quads->end()
+			|| (*next)->asGetOut() == nullptr
+			|| !findSetIns(quads, itr, callee->getFormals()->size(), &setIns)){
+			++itr;
+			continue;
+		}
+		std::vector<long int> args;
+		for (size_t i = 1 ; i < setIns.size() ; i++){
+			LitOpd * lit = (*setIns[i])->asSetIn()->getOpd()->asLit();
+			if (lit == nullptr){ break; }
+			args.push_back(lit->getVal());
+		}
+		Evaluator evaluator(proc, opts->evalFuel);
+		long int result;
+		if (args.size() + 1 != setIns.size()
+			|| !evaluator.run(callee, &args, &result)){
+			++itr;
+			continue;
+		}
+		Opd * dst = (*next)->asGetOut()->getOpd();
+		Quad * copy = new AssignQuad(dst, new LitOpd(std::to_string(result)));
+		itr = dropCall(quads, itr, &setIns, copy);
+		changed = true;
+	}
+	return changed;
+}
+
+//Where main had got to when precomputation stopped, kept so
+// that it can go back there if a call it is in the middle of
+// cannot be finished
+struct Checkpoint{
+	Evaluator::Frame frame;
+	std::map<Opd *, long int> globals;
+	size_t outputSize;
+};
+
+//Run main at compile time, up to its first read of input or
+// until the fuel runs out, and start it from there instead.
+// The globals get what they hold at that point as their
+// initial values, main's variables are set to theirs on entry,
+// and everything written so far is written as one string.
+// main only stops between call sequences, so that when a call
+// cannot be run through (it reads input, say) main goes back
+// to where the sequence began. A sequence is over once every
+// argument pushed has been taken by a call (an argument can
+// itself be a call, so the outer call's arguments may still be
+// waiting when an inner call returns) and the result of the
+// last call has been fetched.
+bool precompute(Procedure * proc, OptOptions * opts){
+	if (opts->precomputeFuel == 0 || proc->getName() != "main"){
+		return false;
+	}
+	IRProgram * prog = proc->getProg();
+	std::map<Opd *, long int> globals;
+	for (auto global : prog->getGlobals()){ globals[global] = 0; }
+	std::string output;
+	Evaluator evaluator(proc, opts->precomputeFuel);
+	evaluator.allowEffects(&globals, &output);
+	std::vector<long int> noArgs;
+	Evaluator::Frame frame = evaluator.start(proc);
+	Checkpoint checkpoint{frame, globals, 0};
+	bool afterCall = false;
+	while (Quad * quad = evaluator.next(&frame)){
+		size_t pending = frame.outArgs.size();
+		bool settled = pending == 0 && !afterCall;
+		SyscallQuad * syscall = quad->asSyscall();
+		if (settled && syscall != nullptr && syscall->getSyscall() == READ){
+			break;
+		}
+		if (settled && (quad->asSetIn() != nullptr || quad->asCall() != nullptr)){
+			checkpoint = Checkpoint{frame, globals, output.size()};
+		}
+		if (!evaluator.step(&frame, &noArgs, 0)){
+			if (!settled || quad->asCall() != nullptr){
+				frame = checkpoint.frame;
+				globals = checkpoint.globals;
+				output.resize(checkpoint.outputSize);
+			}
+			break;
+		}
+		afterCall = quad->asCall() != nullptr;
+	}
+	if (frame.pc == 0){ return false; }
+
+	for (auto global : prog->getGlobals()){
+		prog->setInitial(global, globals[global]);
+	}
+	std::list<Quad *> prefix;
+	for (auto var : frame.vars){
+		prefix.push_back(new AssignQuad(var.first,
+			new LitOpd(std::to_string(var.second))));
+	}
+	std::list<Quad *> * quads = proc->getQuads();
+	Quad * resume = evaluator.next(&frame);
+	if (resume == nullptr){
+		//main ran to the end, so all that is left is the output
+		prefix.clear();
+		quads->clear();
+	}
+	if (!output.empty()){
+		//The last newline is the one the write itself prints
+		output.resize(output.size() - 2);
+		prefix.push_back(new SyscallQuad(WRITE,
+			prog->makeString("\"" + output + "\"")));
+	}
+	if (resume == nullptr && frame.hasResult){
+		//What main returned is still the exit status
+		prefix.push_back(new SetOutQuad(1,
+			new LitOpd(std::to_string(frame.result))));
+	}
+	if (resume != nullptr){
+		Label * label = proc->makeLabel();
+		resume->addLabel(label);
+		prefix.push_back(new JmpQuad(label));
+	}
+	quads->splice(quads->begin(), prefix);
+	return true;
+}
+
+}
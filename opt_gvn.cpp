@@ -0,0 +1,174 @@
+#include "opt.hpp"
+
+namespace lake{
+
+//An expression over value numbers. Unary expressions leave
+// right unused.
+struct ExpKey{
+	bool unary;
+	int op;
+	size_t left;
+	size_t right;
+	bool operator==(const ExpKey & other) const{
+		return unary == other.unary && op == other.op
+			&& left == other.left && right == other.right;
+	}
+};
+
+struct ExpKeyHash{
+	size_t operator()(const ExpKey & key) const{
+		size_t res = std::hash<size_t>()(key.left);
+		res = res * 31 + std::hash<size_t>()(key.right);
+		res = res * 31 + std::hash<int>()(key.op);
+		return res * 2 + (key.unary ? 1 : 0);
+	}
+};
+
+//Hash-based value numbering over the dominator tree. Each
+// value computed gets a number, and each variable maps to the
+// number of the value it currently holds. A quad that computes
+// an expression whose value some variable already holds is
+// replaced by a copy from that variable (which copy
+// propagation then forwards). Entering a block, variables that
+// may be redefined on some path from its immediate dominator
+// forget their value, so both local numbering within a block
+// and global numbering across dominated blocks respect
+// redefinitions, including globals written by calls.
+class ValueNumbering{
+public:
+	ValueNumbering(Procedure * procIn)
+	: proc(procIn), cfg(procIn), doms(&cfg), nextVN(0), changed(false){ }
+	bool run(){
+		visit(cfg.getEntry(), std::map<Opd *, size_t>());
+		cfg.commit();
+		return changed;
+	}
+private:
+	size_t fresh(){ return nextVN++; }
+
+	size_t numberOf(Opd * opd, std::map<Opd *, size_t> * vars){
+		if (opd->asLit() != nullptr){
+			auto found = litVNs.find(opd->toString());
+			if (found != litVNs.end()){ return found->second; }
+			return litVNs[opd->toString()] = fresh();
+		}
+		auto found = vars->find(opd);
+		if (found != vars->end()){ return found->second; }
+		return (*vars)[opd] = fresh();
+	}
+
+	Opd * holderOf(size_t vn, std::map<Opd *, size_t> * vars){
+		for (auto var : *vars){
+			if (var.second == vn && isVar(var.first)){ return var.first; }
+		}
+		return nullptr;
+	}
+
+	//Variables that may be written on a path from the
+	// immediate dominator of block to block
+	std::set<Opd *> regionDefs(BasicBlock * block){
+		std::set<Opd *> res;
+		BasicBlock * idom = doms.getIDom(block);
+		if (idom == nullptr){ return res; }
+		std::set<BasicBlock *> seen;
+		std::list<BasicBlock *> work(block->getPreds()->begin(),
+			block->getPreds()->end());
+		while (!work.empty()){
+			BasicBlock * cur = work.front();
+			work.pop_front();
+			if (cur == idom || !seen.insert(cur).second){ continue; }
+			for (auto quad : *cur->getQuads()){
+				for (auto def : quadMayDefs(proc, quad)){
+					res.insert(def);
+				}
+			}
+			for (auto pred : *cur->getPreds()){
+				work.push_back(pred);
+			}
+		}
+		return res;
+	}
+
+	//The value number of the expression computed by quad, or
+	// false if quad does not compute a pure expression
+	bool keyOf(Quad * quad, std::map<Opd *, size_t> * vars, ExpKey * key){
+		if (BinOpQuad * bin = quad->asBinOp()){
+			BinOp op = bin->getOp();
+			size_t left = numberOf(bin->getSrc1(), vars);
+			size_t right = numberOf(bin->getSrc2(), vars);
+			//a > b is b < a, and a >= b is b <= a
+			if (op == GT || op == GTE){
+				op = (op == GT) ? LT : LTE;
+				std::swap(left, right);
+			}
+			bool commutes = op == ADD || op == MULT || op == AND
+				|| op == OR || op == EQ || op == NEQ;
+			if (commutes && right < left){ std::swap(left, right); }
+			*key = {false, static_cast<int>(op), left, right};
+			return true;
+		}
+		if (UnaryOpQuad * unary = quad->asUnaryOp()){
+			size_t src = numberOf(unary->getSrc(), vars);
+			*key = {true, static_cast<int>(unary->getOp()), src, 0};
+			return true;
+		}
+		return false;
+	}
+
+	void visit(BasicBlock * block, std::map<Opd *, size_t> vars){
+		for (auto def : regionDefs(block)){
+			vars.erase(def);
+		}
+		std::list<Quad *> * quads = block->getQuads();
+		for (auto itr = quads->begin() ; itr != quads->end() ; ++itr){
+			Quad * quad = *itr;
+			ExpKey key;
+			if (keyOf(quad, &vars, &key)){
+				Opd * dst = quad->getDst();
+				size_t vn;
+				auto found = exprs.find(key);
+				if (found == exprs.end()){
+					vn = fresh();
+					exprs[key] = vn;
+				} else {
+					vn = found->second;
+					Opd * holder = holderOf(vn, &vars);
+					if (holder != nullptr){
+						Quad * copy = new AssignQuad(dst, holder);
+						quad->moveLabelsTo(copy);
+						*itr = copy;
+						changed = true;
+					}
+				}
+				vars[dst] = vn;
+			} else if (AssignQuad * copy = quad->asAssign()){
+				//Number the source before making room for the
+				// destination, which may be the same variable
+				size_t vn = numberOf(copy->getSrc(), &vars);
+				vars[copy->getDst()] = vn;
+			} else {
+				for (auto def : quadMayDefs(proc, quad)){
+					vars.erase(def);
+				}
+			}
+		}
+		for (auto child : *doms.getChildren(block)){
+			visit(child, vars);
+		}
+	}
+
+	Procedure * proc;
+	ControlFlowGraph cfg;
+	Dominators doms;
+	size_t nextVN;
+	bool changed;
+	std::map<std::string, size_t> litVNs;
+	std::unordered_map<ExpKey, size_t, ExpKeyHash> exprs;
+};
+
+bool numberValues(Procedure * proc){
+	ValueNumbering numbering(proc);
+	return numbering.run();
+}
+
+}
@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <climits>
+#include "opt.hpp"
+
+namespace lake{
+
+//A derived induction variable counter * factor, plus or minus
+// base if op is ADD or SUB, kept in var by adding the counter's
+// step times factor whenever the counter is stepped
+struct Derived{
+	Opd * factor;
+	BinOp op;
+	Opd * base;
+	AuxOpd * var;
+};
+
+static bool sameOpd(Opd * a, Opd * b){
+	if (a == b){ return true; }
+	if (a == nullptr || b == nullptr){ return false; }
+	LitOpd * litA = a->asLit();
+	LitOpd * litB = b->asLit();
+	return litA != nullptr && litB != nullptr
+		&& litA->getVal() == litB->getVal();
+}
+
+//val * factor + base, if it does not overflow
+static bool scaleFits(long int val, long int factor, long int base,
+	long int * res){
+	if (factor <= 0 || val > LONG_MAX / factor || val < LONG_MIN / factor){
+		return false;
+	}
+	long int prod = val * factor;
+	if ((base > 0 && prod > LONG_MAX - base)
+		|| (base < 0 && prod < LONG_MIN - base)){
+		return false;
+	}
+	*res = prod + base;
+	return true;
+}
+
+//Strength reduction of the derived induction variables of a
+// counted loop. Each product of the counter with an invariant,
+// and each such product whose only use adds or subtracts an
+// invariant, becomes a variable of its own that is set up
+// before the loop and stepped alongside the counter, so the
+// multiplication leaves the loop. When the loop test can be
+// rewritten to compare one of those variables instead (which
+// needs constant bounds, so that the scaled comparison cannot
+// overflow), the counter is left for dead code elimination.
+class InductionReduction{
+public:
+	InductionReduction(Procedure * procIn, ControlFlowGraph * cfgIn,
+		Liveness * livenessIn, NaturalLoop * naturalIn, CountedLoop * loopIn)
+	: proc(procIn), cfg(cfgIn), liveness(livenessIn), natural(naturalIn),
+	  loop(loopIn){ }
+	bool run();
+private:
+	bool isInvariant(Opd * opd);
+	BinOpQuad * fusedUse(BasicBlock * block, BinOpQuad * mult,
+		Opd ** base);
+	Derived * getDerived(Opd * factor, BinOp op, Opd * base);
+	bool replaceTest(Quad * step);
+
+	Procedure * proc;
+	ControlFlowGraph * cfg;
+	Liveness * liveness;
+	NaturalLoop * natural;
+	CountedLoop * loop;
+	std::map<Opd *, size_t> defCounts;
+	std::map<Opd *, size_t> useCounts;
+	std::map<Opd *, Quad *> defs;
+	std::list<Derived *> derived;
+};
+
+bool InductionReduction::isInvariant(Opd * opd){
+	return !isVar(opd) || defCounts[opd] == 0;
+}
+
+//The quad d ADD base, base ADD d or d SUB base that is the only
+// use of the product d := counter MULT factor, if it comes later
+// in the same block with no step of the counter in between
+BinOpQuad * InductionReduction::fusedUse(BasicBlock * block,
+	BinOpQuad * mult, Opd ** base){
+	Opd * dst = mult->getDst();
+	if (defCounts[dst] != 1 || useCounts[dst] != 1
+		|| liveness->getLiveIn(natural->getHeader())->count(dst)){
+		return nullptr;
+	}
+	for (auto exit : natural->getExits()){
+		if (liveness->getLiveIn(exit)->count(dst)){ return nullptr; }
+	}
+	std::list<Quad *> * quads = block->getQuads();
+	auto pos = std::find(quads->begin(), quads->end(), mult);
+	for (auto itr = std::next(pos) ; itr != quads->end() ; ++itr){
+		if ((*itr)->getDst() == loop->getCounter()){ return nullptr; }
+		BinOpQuad * use = (*itr)->asBinOp();
+		if (use == nullptr){ continue; }
+		Opd * other = nullptr;
+		if (use->getSrc1() == dst){ other = use->getSrc2(); }
+		else if (use->getSrc2() == dst && use->getOp() == ADD){
+			other = use->getSrc1();
+		}
+		if (other == nullptr){ continue; }
+		if ((use->getOp() != ADD && use->getOp() != SUB)
+			|| !isInvariant(other)){
+			return nullptr;
+		}
+		*base = other;
+		return use;
+	}
+	return nullptr;
+}
+
+Derived * InductionReduction::getDerived(Opd * factor, BinOp op,
+	Opd * base){
+	for (auto var : derived){
+		if (sameOpd(var->factor, factor) && var->op == op
+			&& sameOpd(var->base, base)){
+			return var;
+		}
+	}
+	Derived * res = new Derived{factor, op, base, proc->makeTmp()};
+	derived.push_back(res);
+	return res;
+}
+
+//Make the loop test compare a derived variable with the bound
+// scaled the same way. With a constant start and bound, every
+// value the counter takes lies between them (give or take a
+// step), so if those scale without overflow, so does the rest.
+bool InductionReduction::replaceTest(Quad * step){
+	long int init;
+	LitOpd * boundLit = loop->getBound()->asLit();
+	if (!loop->getInit(&init) || boundLit == nullptr){ return false; }
+	long int bound = boundLit->getVal();
+	long int delta = loop->getStep();
+	BinOp cmp = loop->getCmp();
+	bool up = delta > 0 && (cmp == LT || cmp == LTE);
+	bool down = delta < 0 && (cmp == GT || cmp == GTE);
+	if (!up && !down){ return false; }
+	if ((up && (init > LONG_MAX - delta || bound > LONG_MAX - delta))
+		|| (down && (init < LONG_MIN - delta || bound < LONG_MIN - delta))){
+		return false;
+	}
+
+	//The test must come after the counter is stepped, which is
+	// where the derived variables are stepped too
+	std::list<Quad *> * latch = loop->getBody()->back()->getQuads();
+	BinOpQuad * test = loop->getTest();
+	auto stepPos = std::find(latch->begin(), latch->end(), step);
+	auto testPos = std::find(stepPos, latch->end(), test);
+	if (stepPos == latch->end() || testPos == latch->end()){ return false; }
+
+	for (auto var : derived){
+		LitOpd * factor = var->factor->asLit();
+		long int base = 0;
+		if (var->base != nullptr){
+			if (var->base->asLit() == nullptr){ continue; }
+			base = var->base->asLit()->getVal();
+			if (var->op == SUB){
+				if (base == LONG_MIN){ continue; }
+				base = -base;
+			}
+		}
+		if (factor == nullptr){ continue; }
+		long int scaled;
+		long int unused;
+		if (!scaleFits(init, factor->getVal(), base, &unused)
+			|| !scaleFits(init + delta, factor->getVal(), base, &unused)
+			|| !scaleFits(bound + delta, factor->getVal(), base, &unused)
+			|| !scaleFits(bound, factor->getVal(), base, &scaled)){
+			continue;
+		}
+		LitOpd * newBound = new LitOpd(std::to_string(scaled));
+		BinOpQuad * newTest;
+		if (test->getSrc2() == loop->getBound()){
+			newTest = new BinOpQuad(test->getDst(), test->getOp(), var->var,
+				newBound);
+		} else {
+			newTest = new BinOpQuad(test->getDst(), test->getOp(), newBound,
+				var->var);
+		}
+		test->moveLabelsTo(newTest);
+		*testPos = newTest;
+		return true;
+	}
+	return false;
+}
+
+bool InductionReduction::run(){
+	Opd * counter = loop->getCounter();
+	for (auto block : *loop->getBody()){
+		for (auto quad : *block->getQuads()){
+			for (auto def : quadMayDefs(proc, quad)){
+				defCounts[def]++;
+				defs[def] = quad;
+			}
+			for (auto use : quadUses(proc, quad)){ useCounts[use]++; }
+		}
+	}
+
+	//Products of the counter with invariants, and the uses
+	// they fuse with
+	std::list<std::pair<BasicBlock *, BinOpQuad *>> products;
+	for (auto block : *loop->getBody()){
+		for (auto quad : *block->getQuads()){
+			BinOpQuad * mult = quad->asBinOp();
+			if (mult == nullptr || mult->getOp() != MULT){ continue; }
+			Opd * factor = mult->getSrc2();
+			if (mult->getSrc1() != counter){
+				if (mult->getSrc2() != counter){ continue; }
+				factor = mult->getSrc1();
+			}
+			if (!isInvariant(factor)){ continue; }
+			LitOpd * lit = factor->asLit();
+			if (lit != nullptr && (lit->getVal() == 0 || lit->getVal() == 1)){
+				continue;
+			}
+			products.push_back(std::make_pair(block, mult));
+		}
+	}
+	if (products.empty() || !canPlacePreheader(cfg, natural)){ return false; }
+
+	for (auto product : products){
+		BasicBlock * block = product.first;
+		BinOpQuad * mult = product.second;
+		Opd * factor = mult->getSrc1() == counter ? mult->getSrc2()
+			: mult->getSrc1();
+		std::list<Quad *> * quads = block->getQuads();
+		auto pos = std::find(quads->begin(), quads->end(), mult);
+		Opd * base = nullptr;
+		BinOpQuad * use = fusedUse(block, mult, &base);
+		if (use == nullptr){
+			Derived * var = getDerived(factor, MULT, nullptr);
+			Quad * copy = new AssignQuad(mult->getDst(), var->var);
+			mult->moveLabelsTo(copy);
+			*pos = copy;
+			continue;
+		}
+		Derived * var = getDerived(factor, use->getOp(), base);
+		eraseQuad(quads, pos);
+		auto usePos = std::find(quads->begin(), quads->end(), use);
+		Quad * copy = new AssignQuad(use->getDst(), var->var);
+		use->moveLabelsTo(copy);
+		*usePos = copy;
+	}
+
+	//Set each variable up before the loop, and step it right
+	// after the counter
+	std::list<Quad *> setup;
+	std::list<Quad *> stepping;
+	for (auto var : derived){
+		setup.push_back(new BinOpQuad(var->var, MULT, counter, var->factor));
+		if (var->base != nullptr){
+			setup.push_back(new BinOpQuad(var->var, var->op, var->var,
+				var->base));
+		}
+		Opd * amount;
+		LitOpd * lit = var->factor->asLit();
+		if (lit != nullptr){
+			unsigned long int prod = static_cast<unsigned long int>(lit->getVal())
+				* static_cast<unsigned long int>(loop->getStep());
+			amount = new LitOpd(std::to_string(static_cast<long int>(prod)));
+		} else {
+			AuxOpd * tmp = proc->makeTmp();
+			setup.push_back(new BinOpQuad(tmp, MULT, var->factor,
+				new LitOpd(std::to_string(loop->getStep()))));
+			amount = tmp;
+		}
+		stepping.push_back(new BinOpQuad(var->var, ADD, var->var, amount));
+	}
+	Quad * step = defs[counter];
+	replaceTest(step);
+	for (auto block : *loop->getBody()){
+		std::list<Quad *> * quads = block->getQuads();
+		auto pos = std::find(quads->begin(), quads->end(), step);
+		if (pos != quads->end()){
+			quads->splice(std::next(pos), stepping);
+			break;
+		}
+	}
+	placePreheader(proc, cfg, natural, &setup);
+	return true;
+}
+
+bool reduceInductionVars(Procedure * proc){
+	bool changed = false;
+	bool again = true;
+	while (again){
+		again = false;
+		ControlFlowGraph cfg(proc);
+		Dominators doms(&cfg);
+		Liveness liveness(&cfg);
+		for (auto loop : findLoops(&cfg, &doms)){
+			CountedLoop * counted = CountedLoop::analyze(&cfg, loop);
+			if (counted == nullptr){ continue; }
+			InductionReduction reduction(proc, &cfg, &liveness, loop, counted);
+			if (reduction.run()){
+				cfg.commit();
+				changed = again = true;
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+}
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+static size_t bodySize(Procedure * proc){
+	size_t res = 0;
+	for (auto quad : *proc->getQuads()){
+		if (quad->asNop() == nullptr){ res++; }
+	}
+	return res;
+}
+
+//Replace the call at callPos by a copy of the callee's body.
+// The callee's formals, locals and temps become fresh temps of
+// the caller and its labels fresh labels. Each setin for the
+// call becomes a copy into an argument temp, which the getins
+// of the copied body read, and each setout becomes a copy into
+// a result temp that the call's getout then reads. Jumps to the
+// callee's leave label go to the end of the copy instead. Sets
+// *resume to the position after the copied body.
+static bool inlineCall(Procedure * caller, Procedure * callee,
+	std::list<Quad *> * quads, std::list<Quad *>::iterator callPos,
+	std::list<Quad *>::iterator * resume){
+	size_t numArgs = callee->getFormals()->size();
+	std::vector<std::list<Quad *>::iterator> setIns;
+	if (!findSetIns(quads, callPos, numArgs, &setIns)){ return false; }
+	for (auto quad : *callee->getQuads()){
+		GetInQuad * getIn = quad->asGetIn();
+		if (getIn != nullptr
+			&& (getIn->getIndex() < 1 || getIn->getIndex() > numArgs)){
+			return false;
+		}
+	}
+	auto getOutPos = std::next(callPos);
+	GetOutQuad * getOut = nullptr;
+	if (getOutPos != quads->end()){ getOut = (*getOutPos)->asGetOut(); }
+
+	std::map<Opd *, Opd *> renamed;
+	for (auto formal : *callee->getFormals()){
+		renamed[formal] = caller->makeTmp();
+	}
+	for (auto local : callee->getLocals()){
+		renamed[local] = caller->makeTmp();
+	}
+	for (auto tmp : *callee->getTemps()){
+		renamed[tmp] = caller->makeTmp();
+	}
+	std::vector<AuxOpd *> args(numArgs + 1, nullptr);
+	for (size_t i = 1 ; i <= numArgs ; i++){ args[i] = caller->makeTmp(); }
+	AuxOpd * result = caller->makeTmp();
+	auto rename = [&](Opd * opd){
+		auto found = renamed.find(opd);
+		return found == renamed.end() ? opd : found->second;
+	};
+
+	Label * end = caller->makeLabel();
+	std::map<Label *, Label *> labels;
+	labels[callee->getLeaveLabel()] = end;
+	std::list<Quad *> body;
+	for (auto quad : *callee->getQuads()){
+		Quad * dup;
+		if (GetInQuad * getIn = quad->asGetIn()){
+			dup = new AssignQuad(rename(getIn->getOpd()), args[getIn->getIndex()]);
+		} else if (SetOutQuad * setOut = quad->asSetOut()){
+			dup = new AssignQuad(result, rename(setOut->getOpd()));
+		} else {
+			dup = quad->clone();
+			Opd * dst = dup->getDst();
+			if (dst != nullptr && rename(dst) != dst){ dup->setDst(rename(dst)); }
+			for (auto src : quad->getSrcs()){
+				if (rename(src) != src){ dup->replaceSrc(src, rename(src)); }
+			}
+		}
+		for (auto label : quad->getLabels()){
+			Label * fresh = caller->makeLabel();
+			labels[label] = fresh;
+			dup->addLabel(fresh);
+		}
+		body.push_back(dup);
+	}
+	for (auto quad : body){
+		auto found = labels.find(quad->getTarget());
+		if (found == labels.end()){ continue; }
+		if (JmpQuad * jmp = quad->asJmp()){ jmp->setTarget(found->second); }
+		if (JmpIfQuad * jmpIf = quad->asJmpIf()){
+			jmpIf->setTarget(found->second);
+		}
+	}
+
+	for (size_t i = 1 ; i <= numArgs ; i++){
+		SetInQuad * setIn = (*setIns[i])->asSetIn();
+		Quad * copy = new AssignQuad(args[i], setIn->getOpd());
+		setIn->moveLabelsTo(copy);
+		*setIns[i] = copy;
+	}
+	Quad * last;
+	if (getOut != nullptr){
+		last = new AssignQuad(getOut->getOpd(), result);
+		getOut->moveLabelsTo(last);
+		*getOutPos = last;
+	} else {
+		last = new NopQuad();
+		quads->insert(std::next(callPos), last);
+	}
+	last->addLabel(end);
+	*resume = std::next(std::find(callPos, quads->end(), last));
+	quads->splice(callPos, body);
+	quads->erase(callPos);
+	return true;
+}
+
+//Inline calls to procedures that are not in a cycle of
+// recursion with the caller. A callee is inlined if its body
+// is no larger than the inline budget and the caller stays
+// within the inline growth limit. Code that was just inlined
+// is not looked at again: its calls were already considered
+// when the callee itself was optimized.
+bool inlineCalls(Procedure * caller, CallGraph * calls, OptOptions * opts){
+	std::list<Quad *> * quads = caller->getQuads();
+	size_t size = bodySize(caller);
+	bool changed = false;
+	for (auto itr = quads->begin() ; itr != quads->end() ; ){
+		CallQuad * call = (*itr)->asCall();
+		Procedure * callee = call == nullptr ? nullptr : calls->getProc(call);
+		if (callee == nullptr || opts->inlineBudget == 0
+			|| calls->isRecursive(caller, callee)){
+			++itr;
+			continue;
+		}
+		size_t calleeSize = bodySize(callee);
+		std::list<Quad *>::iterator resume;
+		if (calleeSize > opts->inlineBudget
+			|| size + calleeSize > opts->inlineGrowth
+			|| !inlineCall(caller, callee, quads, itr, &resume)){
+			++itr;
+			continue;
+		}
+		size += calleeSize;
+		changed = true;
+		itr = resume;
+	}
+	return changed;
+}
+
+}
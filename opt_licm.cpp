@@ -0,0 +1,122 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+//Loop-invariant code motion for a single natural loop. A
+// computation or copy is invariant if each of its operands is
+// a literal, is not written anywhere in the loop (counting
+// globals a call may write and variables a READ fills in), or
+// is written only by another invariant quad. It can move to
+// the preheader when it is the only write to its destination
+// in the loop, the destination's old value is never read in
+// the loop, and either the destination is dead once the loop
+// exits or the quad runs on every iteration that can exit.
+class InvariantMotion{
+public:
+	InvariantMotion(Procedure * procIn, ControlFlowGraph * cfgIn,
+		Dominators * domsIn, Liveness * livenessIn, NaturalLoop * loopIn)
+	: proc(procIn), cfg(cfgIn), doms(domsIn), liveness(livenessIn),
+	  loop(loopIn){ }
+	bool run();
+private:
+	bool isInvariant(Quad * quad, BasicBlock * block);
+
+	Procedure * proc;
+	ControlFlowGraph * cfg;
+	Dominators * doms;
+	Liveness * liveness;
+	NaturalLoop * loop;
+	std::map<Opd *, size_t> defCounts;
+	std::map<Opd *, Quad *> defs;
+	std::set<Quad *> invariant;
+};
+
+bool InvariantMotion::isInvariant(Quad * quad, BasicBlock * block){
+	if (quad->asBinOp() == nullptr && quad->asUnaryOp() == nullptr
+		&& quad->asAssign() == nullptr){
+		return false;
+	}
+	if (mayFault(quad)){ return false; }
+	Opd * dst = quad->getDst();
+	if (!isVar(dst) || defCounts[dst] != 1){ return false; }
+	if (liveness->getLiveIn(loop->getHeader())->count(dst)){ return false; }
+	for (auto src : quad->getSrcs()){
+		if (!isVar(src) || defCounts[src] == 0){ continue; }
+		if (defCounts[src] != 1 || !invariant.count(defs[src])){
+			return false;
+		}
+	}
+	for (auto exit : loop->getExits()){
+		if (!liveness->getLiveIn(exit)->count(dst)){ continue; }
+		for (auto exiting : loop->getExiting()){
+			if (!doms->dominates(block, exiting)){ return false; }
+		}
+	}
+	return true;
+}
+
+bool InvariantMotion::run(){
+	for (auto block : *loop->getBlocks()){
+		for (auto quad : *block->getQuads()){
+			for (auto def : quadMayDefs(proc, quad)){
+				defCounts[def]++;
+				defs[def] = quad;
+			}
+		}
+	}
+
+	//Find invariants in layout order until no more turn up,
+	// so a quad is always found after the invariants it reads
+	std::list<std::pair<BasicBlock *, Quad *>> found;
+	bool changed = true;
+	while (changed){
+		changed = false;
+		for (auto block : *cfg->getBlocks()){
+			if (!loop->contains(block)){ continue; }
+			for (auto quad : *block->getQuads()){
+				if (invariant.count(quad) || !isInvariant(quad, block)){
+					continue;
+				}
+				invariant.insert(quad);
+				found.push_back(std::make_pair(block, quad));
+				changed = true;
+			}
+		}
+	}
+	if (found.empty()){ return false; }
+	if (!canPlacePreheader(cfg, loop)){ return false; }
+
+	std::list<Quad *> hoisted;
+	for (auto entry : found){
+		std::list<Quad *> * quads = entry.first->getQuads();
+		eraseQuad(quads, std::find(quads->begin(), quads->end(), entry.second));
+		hoisted.push_back(entry.second);
+	}
+	placePreheader(proc, cfg, loop, &hoisted);
+	return true;
+}
+
+bool hoistInvariants(Procedure * proc){
+	bool changed = false;
+	bool again = true;
+	//Hoisting out of an inner loop can make code invariant in
+	// the loop around it, so start over after every change
+	while (again){
+		again = false;
+		ControlFlowGraph cfg(proc);
+		Dominators doms(&cfg);
+		Liveness liveness(&cfg);
+		for (auto loop : findLoops(&cfg, &doms)){
+			InvariantMotion motion(proc, &cfg, &doms, &liveness, loop);
+			if (motion.run()){
+				cfg.commit();
+				changed = again = true;
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+}
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+static BinOp swapCmp(BinOp op){
+	switch (op){
+	case LT: return GT;
+	case GT: return LT;
+	case LTE: return GTE;
+	case GTE: return LTE;
+	default: return op;
+	}
+}
+
+static BinOp negateCmp(BinOp op){
+	switch (op){
+	case LT: return GTE;
+	case GTE: return LT;
+	case GT: return LTE;
+	case LTE: return GT;
+	case EQ: return NEQ;
+	case NEQ: return EQ;
+	default: return op;
+	}
+}
+
+static bool isCmp(BinOp op){
+	return op == EQ || op == NEQ || op == LT || op == GT
+		|| op == LTE || op == GTE;
+}
+
+bool evalCmp(BinOp op, long int a, long int b){
+	switch (op){
+	case EQ: return a == b;
+	case NEQ: return a != b;
+	case LT: return a < b;
+	case GT: return a > b;
+	case LTE: return a <= b;
+	case GTE: return a >= b;
+	default: break;
+	}
+	throw new InternalError("Not a comparison");
+}
+
+CountedLoop * CountedLoop::analyze(ControlFlowGraph * cfg,
+	NaturalLoop * loop){
+	BasicBlock * header = loop->getHeader();
+	if (loop->getLatches()->size() != 1){ return nullptr; }
+	BasicBlock * latch = loop->getLatches()->front();
+	std::list<Quad *> * latchQuads = latch->getQuads();
+	JmpIfQuad * branch = latchQuads->back()->asJmpIf();
+	if (branch == nullptr || latchQuads->size() < 3){ return nullptr; }
+	std::list<Label *> headerLabels = header->getQuads()->front()->getLabels();
+	if (std::find(headerLabels.begin(), headerLabels.end(),
+		branch->getTarget()) == headerLabels.end()){
+		return nullptr;
+	}
+
+	//The body must be laid out from the header down to the
+	// latch, with nothing else in between
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	auto first = std::find(blocks->begin(), blocks->end(), header);
+	auto last = std::find(blocks->begin(), blocks->end(), latch);
+	if (last < first
+		|| static_cast<size_t>(last - first) + 1 != loop->getBlocks()->size()){
+		return nullptr;
+	}
+	CountedLoop * res = new CountedLoop();
+	res->body.assign(first, last + 1);
+	res->branch = branch;
+	for (auto succ : *latch->getSuccs()){
+		if (!loop->contains(succ)){ res->exit = succ; }
+	}
+	if (res->exit == nullptr){ return nullptr; }
+
+	Procedure * proc = cfg->getProc();
+	std::map<Opd *, size_t> defCounts;
+	std::map<Opd *, Quad *> defs;
+	for (auto block : res->body){
+		for (auto quad : *block->getQuads()){
+			for (auto def : quadMayDefs(proc, quad)){
+				defCounts[def]++;
+				defs[def] = quad;
+			}
+		}
+	}
+
+	//The test right before the branch compares the counter
+	// with the bound
+	auto testPos = std::prev(latchQuads->end(), 2);
+	res->test = (*testPos)->asBinOp();
+	if (res->test == nullptr || res->test->getDst() != branch->getCnd()
+		|| !isCmp(res->test->getOp())){
+		return nullptr;
+	}
+	BinOp cmp = res->test->getOp();
+	Opd * counter = res->test->getSrc1();
+	Opd * bound = res->test->getSrc2();
+	if (!isVar(counter) || defCounts[counter] != 1){
+		std::swap(counter, bound);
+		cmp = swapCmp(cmp);
+	}
+	if (!isVar(counter) || defCounts[counter] != 1 || counter == bound){
+		return nullptr;
+	}
+	if (isVar(bound) && defCounts[bound] != 0){ return nullptr; }
+
+	//The test may read the stepped value through the temp that
+	// is copied back into the counter: t := c ADD k; c := t
+	Opd * stepped = counter;
+	if (BinOpQuad * def = defs[counter]->asBinOp()){
+		Opd * src = def->getSrc1();
+		if (def->getOp() == ADD && !isVar(src)){ src = def->getSrc2(); }
+		AssignQuad * copy = isVar(src) && defCounts[src] == 1
+			? defs[src]->asAssign() : nullptr;
+		auto defPos = std::find(latchQuads->begin(), testPos, def);
+		if (copy != nullptr && copy->getSrc() == counter && defPos != testPos
+			&& std::find(defPos, latchQuads->end(), copy) != latchQuads->end()){
+			counter = src;
+		}
+	}
+	res->counter = counter;
+	res->bound = bound;
+	res->cmp = branch->isInverted() ? cmp : negateCmp(cmp);
+
+	//The counter is stepped by a constant in the latch, before
+	// the test
+	for (auto itr = latchQuads->begin() ; itr != testPos ; ++itr){
+		BinOpQuad * step = (*itr)->asBinOp();
+		if (step == nullptr || step->getDst() != stepped){ continue; }
+		LitOpd * lit = nullptr;
+		if (step->getSrc1() == counter){ lit = step->getSrc2()->asLit(); }
+		else if (step->getOp() == ADD && step->getSrc2() == counter){
+			lit = step->getSrc1()->asLit();
+		}
+		if (lit == nullptr){ continue; }
+		if (step->getOp() == ADD){ res->step = lit->getVal(); }
+		else if (step->getOp() == SUB){ res->step = -lit->getVal(); }
+		else { continue; }
+		res->stepQuad = step;
+	}
+	if (res->stepQuad == nullptr || res->step == 0){ return nullptr; }
+
+	//The counter's value on entry, if a literal is copied into
+	// it on the straight-line path into the loop
+	BasicBlock * pred = nullptr;
+	for (auto block : *header->getPreds()){
+		if (loop->contains(block)){ continue; }
+		if (pred != nullptr){ return res; }
+		pred = block;
+	}
+	std::set<BasicBlock *> seen;
+	while (pred != nullptr && seen.insert(pred).second){
+		std::list<Quad *> * quads = pred->getQuads();
+		for (auto itr = quads->rbegin() ; itr != quads->rend() ; ++itr){
+			if (!quadMayDefs(proc, *itr).count(counter)){ continue; }
+			AssignQuad * init = (*itr)->asAssign();
+			if (init != nullptr && init->getSrc()->asLit() != nullptr){
+				res->hasInit = true;
+				res->init = init->getSrc()->asLit()->getVal();
+			}
+			return res;
+		}
+		if (pred->getPreds()->size() != 1){ break; }
+		pred = pred->getPreds()->front();
+	}
+	return res;
+}
+
+bool CountedLoop::tripCount(size_t limit, size_t * count){
+	LitOpd * lit = bound->asLit();
+	if (!hasInit || lit == nullptr){ return false; }
+	long int boundVal = lit->getVal();
+	unsigned long int val = static_cast<unsigned long int>(init);
+	unsigned long int delta = static_cast<unsigned long int>(step);
+	if (!evalCmp(cmp, init, boundVal)){ return false; }
+	size_t trips = 0;
+	do {
+		trips++;
+		val += delta;
+		if (trips > limit){ return false; }
+	} while (evalCmp(cmp, static_cast<long int>(val), boundVal));
+	*count = trips;
+	return true;
+}
+
+size_t CountedLoop::size(){
+	size_t res = 0;
+	for (auto block : body){
+		for (auto quad : *block->getQuads()){
+			if (quad->asNop() == nullptr){ res++; }
+		}
+	}
+	return res;
+}
+
+std::list<Quad *> CountedLoop::cloneBody(Procedure * proc){
+	std::map<Label *, Label *> renamed;
+	std::list<Quad *> res;
+	for (auto block : body){
+		for (auto quad : *block->getQuads()){
+			if (quad == branch){ continue; }
+			Quad * copy = quad->clone();
+			for (auto label : quad->getLabels()){
+				Label * fresh = proc->makeLabel();
+				renamed[label] = fresh;
+				copy->addLabel(fresh);
+			}
+			res.push_back(copy);
+		}
+	}
+	for (auto quad : res){
+		auto found = renamed.find(quad->getTarget());
+		if (found == renamed.end()){ continue; }
+		if (JmpQuad * jmp = quad->asJmp()){ jmp->setTarget(found->second); }
+		if (JmpIfQuad * jmpIf = quad->asJmpIf()){
+			jmpIf->setTarget(found->second);
+		}
+	}
+	return res;
+}
+
+}
@@ -0,0 +1,90 @@
+#include "opt.hpp"
+
+namespace lake{
+
+//Memoization of procedures that compute their result from their
+// arguments alone and call themselves more than once, which
+// tends to mean computing the same results over and over. On
+// entry the procedure looks its arguments up in a table of
+// earlier results, and it adds each result it computes:
+//
+//   getin 1 n                     getin 1 n
+//   ...                           k := n
+//   setout 1 r          ==>       hit := memoprobe f k
+//                                 iffalse hit goto L
+//                                 r' := memofetch f k
+//                                 setout 1 r'
+//                                 goto leave
+//                                 L: ...
+//                                 memostore f k r
+//                                 setout 1 r
+//
+// The table is direct-mapped with the given number of entries
+// (rounded down to a power of two), keyed by up to two
+// arguments, and lives in static memory, so it also serves
+// later calls from outside.
+bool memoize(Procedure * proc, CallGraph * calls, OptOptions * opts){
+	if (opts->memoEntries == 0 || proc->getName() == "main"){ return false; }
+	ModRef * modRef = proc->getModRef();
+	size_t numArgs = proc->getFormals()->size();
+	if (modRef == nullptr || !modRef->isPure() || !modRef->reads.empty()
+		|| numArgs == 0 || numArgs > 2){
+		return false;
+	}
+	std::list<Quad *> * quads = proc->getQuads();
+	size_t selfCalls = 0;
+	bool returns = false;
+	std::vector<Opd *> formals(numArgs, nullptr);
+	auto start = quads->begin();
+	for (auto quad : *quads){
+		CallQuad * call = quad->asCall();
+		if (call != nullptr && calls->getProc(call) == proc){ selfCalls++; }
+		if (quad->asSetOut() != nullptr){ returns = true; }
+		GetInQuad * getIn = quad->asGetIn();
+		if (getIn != nullptr && getIn->getIndex() >= 1
+			&& getIn->getIndex() <= numArgs && *start == quad){
+			formals[getIn->getIndex() - 1] = getIn->getOpd();
+			++start;
+		}
+	}
+	if (selfCalls < 2 || !returns){ return false; }
+	for (auto formal : formals){
+		if (formal == nullptr){ return false; }
+	}
+
+	size_t entries = 1;
+	while (entries <= opts->memoEntries / 2){ entries *= 2; }
+	std::string table = "memo_" + proc->getName();
+	proc->getProg()->addMemoTable(table, MemoQuad::tableSize(entries, numArgs));
+
+	//The formals may change before the result is known, so the
+	// keys are kept apart
+	std::vector<Opd *> keys;
+	for (auto formal : formals){
+		AuxOpd * key = proc->makeTmp();
+		quads->insert(start, new AssignQuad(key, formal));
+		keys.push_back(key);
+	}
+	for (auto itr = start ; itr != quads->end() ; ++itr){
+		SetOutQuad * setOut = (*itr)->asSetOut();
+		if (setOut == nullptr){ continue; }
+		Quad * store = new MemoQuad(STORE, table, entries, keys,
+			setOut->getOpd());
+		setOut->moveLabelsTo(store);
+		quads->insert(itr, store);
+	}
+	AuxOpd * hit = proc->makeTmp();
+	AuxOpd * val = proc->makeTmp();
+	Label * compute = proc->makeLabel();
+	Quad * nop = new NopQuad();
+	nop->addLabel(compute);
+	quads->insert(start, new MemoQuad(PROBE, table, entries, keys, hit));
+	quads->insert(start, new JmpIfQuad(hit, false, compute));
+	quads->insert(start, new MemoQuad(FETCH, table, entries, keys, val));
+	quads->insert(start, new SetOutQuad(1, val));
+	quads->insert(start, new JmpQuad(proc->getLeaveLabel()));
+	quads->insert(start, nop);
+	return true;
+}
+
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+Procedure * findCallee(Procedure * caller, CallQuad * call){
+	for (auto proc : *caller->getProg()->getProcs()){
+		if (proc->getName() == call->getCallee()->getName()){ return proc; }
+	}
+	return nullptr;
+}
+
+ModRef * calleeModRef(Procedure * caller, CallQuad * call){
+	Procedure * callee = findCallee(caller, call);
+	return callee == nullptr ? nullptr : callee->getModRef();
+}
+
+//The effects of proc's own quads, plus those of the current
+// summaries of what it calls
+static ModRef * computeModRef(Procedure * proc, CallGraph * calls){
+	IRProgram * prog = proc->getProg();
+	ModRef * res = new ModRef();
+	res->halts = !calls->isRecursive(proc, proc);
+	std::map<Label *, size_t> positions;
+	size_t pos = 0;
+	for (auto quad : *proc->getQuads()){
+		for (auto label : quad->getLabels()){ positions[label] = pos; }
+		pos++;
+	}
+	pos = 0;
+	for (auto quad : *proc->getQuads()){
+		for (auto src : quad->getSrcs()){
+			if (prog->isGlobal(src)){ res->reads.insert(src); }
+		}
+		if (prog->isGlobal(quad->getDst())){ res->writes.insert(quad->getDst()); }
+		if (quad->asSyscall() != nullptr){ res->io = true; }
+		if (mayFault(quad)){ res->halts = false; }
+		auto target = positions.find(quad->getTarget());
+		if (target != positions.end() && target->second <= pos){
+			res->halts = false;
+		}
+		if (CallQuad * call = quad->asCall()){
+			Procedure * callee = calls->getProc(call);
+			ModRef * other = callee == nullptr ? nullptr : callee->getModRef();
+			if (other == nullptr){
+				for (auto global : prog->getGlobals()){
+					res->reads.insert(global);
+					res->writes.insert(global);
+				}
+				res->io = true;
+				res->halts = false;
+			} else {
+				res->reads.insert(other->reads.begin(), other->reads.end());
+				res->writes.insert(other->writes.begin(), other->writes.end());
+				res->io = res->io || other->io;
+				res->halts = res->halts && other->halts;
+			}
+		}
+		pos++;
+	}
+	return res;
+}
+
+static bool sameModRef(ModRef * a, ModRef * b){
+	return a->reads == b->reads && a->writes == b->writes && a->io == b->io
+		&& a->halts == b->halts;
+}
+
+//Summaries start out empty and grow until they cover every
+// procedure's own effects and those of its callees, which
+// takes more than one round only for cycles of recursion
+void summarizeProcs(CallGraph * calls){
+	for (auto proc : *calls->getBottomUp()){ proc->setModRef(new ModRef()); }
+	bool changed = true;
+	while (changed){
+		changed = false;
+		for (auto proc : *calls->getBottomUp()){
+			ModRef * modRef = computeModRef(proc, calls);
+			if (!sameModRef(modRef, proc->getModRef())){
+				proc->setModRef(modRef);
+				changed = true;
+			}
+		}
+	}
+}
+
+//Since the callees' summaries already cover every effect they
+// may have (this procedure's included, if they call back into
+// it), recomputing from them stays safe
+bool summarizeProc(Procedure * proc, CallGraph * calls){
+	ModRef * modRef = computeModRef(proc, calls);
+	if (proc->getModRef() != nullptr && sameModRef(modRef, proc->getModRef())){
+		return false;
+	}
+	proc->setModRef(modRef);
+	return true;
+}
+
+static bool sameArg(Opd * a, Opd * b){
+	if (a == b){ return true; }
+	LitOpd * litA = a->asLit();
+	LitOpd * litB = b->asLit();
+	return litA != nullptr && litB != nullptr
+		&& litA->getVal() == litB->getVal();
+}
+
+//A call to a pure procedure whose result is at hand in result
+struct PureCall{
+	std::string callee;
+	std::vector<Opd *> args;
+	Opd * result;
+	ModRef * modRef;
+};
+
+//Forget the calls whose result or arguments def overwrites, or
+// whose callee reads def
+static void forget(std::list<PureCall> * available, Opd * def){
+	available->remove_if([&](PureCall& prev){
+		return prev.result == def
+			|| std::find(prev.args.begin(), prev.args.end(), def)
+				!= prev.args.end()
+			|| prev.modRef->reads.count(def);
+	});
+}
+
+//Calls to pure procedures. Those whose result is unused go
+// away if the callee surely returns, and those repeating an
+// earlier call in the same block with the same arguments (none
+// of them, nor any global the callee reads, changed since)
+// reuse its result.
+bool removePureCalls(Procedure * proc){
+	ControlFlowGraph cfg(proc);
+	Liveness liveness(&cfg, true);
+	bool changed = false;
+	for (auto block : *cfg.getBlocks()){
+		std::list<Quad *> * quads = block->getQuads();
+		std::list<PureCall> available;
+		for (auto itr = quads->begin() ; itr != quads->end() ; ){
+			Quad * quad = *itr;
+			CallQuad * call = quad->asCall();
+			ModRef * modRef = call == nullptr ? nullptr
+				: calleeModRef(proc, call);
+			std::vector<std::list<Quad *>::iterator> setIns;
+			size_t numArgs = call == nullptr ? 0
+				: call->getCallee()->getType()->asFn()->getFormalTypes()
+					->getElts()->size();
+			if (modRef == nullptr || !modRef->isPure()
+				|| !findSetIns(quads, itr, numArgs, &setIns)){
+				for (auto def : quadMayDefs(proc, quad)){
+					forget(&available, def);
+				}
+				++itr;
+				continue;
+			}
+
+			auto next = std::next(itr);
+			GetOutQuad * getOut = next == quads->end() ? nullptr
+				: (*next)->asGetOut();
+			Opd * result = getOut == nullptr ? nullptr : getOut->getOpd();
+			if (modRef->halts && (result == nullptr
+				|| (isVar(result) && !liveness.getLiveAfter(getOut)->count(result)))){
+				itr = dropCall(quads, itr, &setIns, nullptr);
+				changed = true;
+				continue;
+			}
+			if (result == nullptr){
+				++itr;
+				continue;
+			}
+
+			std::vector<Opd *> args;
+			for (size_t i = 1 ; i <= numArgs ; i++){
+				args.push_back((*setIns[i])->asSetIn()->getOpd());
+			}
+			auto found = std::find_if(available.begin(), available.end(),
+				[&](PureCall& prev){
+					return prev.callee == call->getCallee()->getName()
+						&& std::equal(args.begin(), args.end(),
+							prev.args.begin(), sameArg);
+				});
+			Opd * reuse = found == available.end() ? nullptr : found->result;
+			if (reuse != nullptr){
+				itr = dropCall(quads, itr, &setIns, new AssignQuad(result, reuse));
+				changed = true;
+			} else {
+				itr = std::next(next);
+			}
+			forget(&available, result);
+			if (reuse == nullptr
+				&& std::find(args.begin(), args.end(), result) == args.end()){
+				available.push_back(PureCall{call->getCallee()->getName(), args,
+					result, modRef});
+			}
+		}
+	}
+	cfg.commit();
+	return changed;
+}
+
+}
@@ -0,0 +1,446 @@
+#include "opt.hpp"
+
+namespace lake{
+
+//A set of expression indices, a bit per expression, so that
+// the dataflow equations combine whole sets a word at a time
+class ExpSet{
+public:
+	ExpSet(){ }
+	ExpSet(size_t size, bool full)
+	: words((size + 63) / 64, full ? ~0UL : 0UL){
+		if (full && size % 64 != 0){
+			words.back() = (1UL << (size % 64)) - 1;
+		}
+	}
+	bool test(size_t e) const{
+		return ((words[e / 64] >> (e % 64)) & 1) != 0;
+	}
+	void set(size_t e){ words[e / 64] |= 1UL << (e % 64); }
+	void reset(size_t e){ words[e / 64] &= ~(1UL << (e % 64)); }
+	bool any() const{
+		for (auto word : words){
+			if (word != 0){ return true; }
+		}
+		return false;
+	}
+	ExpSet & operator&=(const ExpSet & other){
+		for (size_t i = 0 ; i < words.size() ; i++){
+			words[i] &= other.words[i];
+		}
+		return *this;
+	}
+	ExpSet & operator|=(const ExpSet & other){
+		for (size_t i = 0 ; i < words.size() ; i++){
+			words[i] |= other.words[i];
+		}
+		return *this;
+	}
+	//Remove the members of other
+	ExpSet & operator-=(const ExpSet & other){
+		for (size_t i = 0 ; i < words.size() ; i++){
+			words[i] &= ~other.words[i];
+		}
+		return *this;
+	}
+	bool operator==(const ExpSet & other) const{
+		return words == other.words;
+	}
+	bool operator!=(const ExpSet & other) const{
+		return words != other.words;
+	}
+private:
+	std::vector<unsigned long int> words;
+};
+
+//A lexical expression: the operator and the operands, with
+// literals compared by value and variables by identity
+struct LexExp{
+	bool unary;
+	int op;
+	Opd * src1;
+	Opd * src2;
+};
+
+static std::pair<Opd *, std::string> lexKey(Opd * opd){
+	if (opd == nullptr){ return std::make_pair(nullptr, ""); }
+	if (opd->asLit() != nullptr){
+		return std::make_pair(nullptr, opd->toString());
+	}
+	return std::make_pair(opd, "");
+}
+
+static bool isCommutative(BinOp op){
+	return op == ADD || op == MULT || op == AND || op == OR
+		|| op == EQ || op == NEQ;
+}
+
+//Partial redundancy elimination by lazy code motion (Knoop,
+// Ruthing and Steffen), in its edge-based form. Computations
+// are inserted on the edges where an expression is anticipated
+// but not yet available, as late as possible, and the
+// occurrences that become redundant read the saved value
+// instead. An expression is only ever inserted where every
+// path onward would compute it anyway, so no path gets longer.
+// Loop-invariant tests of a while loop are hoisted this way,
+// since the header runs at least once; invariants in the body
+// are not anticipated until the loop is rotated.
+class LazyCodeMotion{
+public:
+	LazyCodeMotion(Procedure * procIn) : proc(procIn), cfg(procIn){ }
+	bool run();
+private:
+	//Index of the expression computed by quad, or -1
+	int expOf(Quad * quad);
+	bool isJumpEdge(BasicBlock * from, BasicBlock * to);
+	void localProperties();
+	void globalProperties();
+	void transform();
+	Quad * makeComputation(size_t exp);
+
+	Procedure * proc;
+	ControlFlowGraph cfg;
+	std::vector<LexExp> exps;
+	std::map<std::pair<std::pair<int, int>,
+		std::pair<std::pair<Opd *, std::string>,
+		std::pair<Opd *, std::string>>>, size_t> expIdx;
+	std::vector<AuxOpd *> saved;
+	size_t numExps = 0;
+
+	//The blocks are numbered in layout order, with the exit
+	// last, and the sets are kept by number
+	std::vector<BasicBlock *> blocks;
+	std::map<BasicBlock *, size_t> blockIdx;
+	std::vector<std::vector<size_t>> preds, succs;
+	std::vector<ExpSet> antloc, comp, transp;
+	std::vector<ExpSet> avOut, antIn, antOut, laterIn;
+	//Edges (pred, succ). The edge into the entry block from
+	// outside the procedure has a null pred.
+	std::vector<std::pair<BasicBlock *, BasicBlock *>> edges;
+	std::vector<ExpSet> earliest, later, insert;
+	std::vector<ExpSet> del;
+};
+
+int LazyCodeMotion::expOf(Quad * quad){
+	LexExp exp;
+	if (BinOpQuad * bin = quad->asBinOp()){
+		if (mayFault(bin)){ return -1; }
+		exp = {false, static_cast<int>(bin->getOp()),
+			bin->getSrc1(), bin->getSrc2()};
+		if (isCommutative(bin->getOp())
+			&& lexKey(exp.src2) < lexKey(exp.src1)){
+			std::swap(exp.src1, exp.src2);
+		}
+	} else if (UnaryOpQuad * unary = quad->asUnaryOp()){
+		exp = {true, static_cast<int>(unary->getOp()),
+			unary->getSrc(), nullptr};
+	} else {
+		return -1;
+	}
+	auto key = std::make_pair(std::make_pair(exp.unary ? 1 : 0, exp.op),
+		std::make_pair(lexKey(exp.src1), lexKey(exp.src2)));
+	auto found = expIdx.find(key);
+	if (found != expIdx.end()){ return static_cast<int>(found->second); }
+	expIdx[key] = exps.size();
+	exps.push_back(exp);
+	return static_cast<int>(exps.size() - 1);
+}
+
+//Whether control goes from one block to the other by the
+// jump at the end of from, rather than by falling through
+bool LazyCodeMotion::isJumpEdge(BasicBlock * from, BasicBlock * to){
+	Label * target = from->getQuads()->back()->getTarget();
+	if (target == nullptr){ return false; }
+	if (to == cfg.getExit()){ return target == proc->getLeaveLabel(); }
+	for (auto label : to->getQuads()->front()->getLabels()){
+		if (label == target){ return true; }
+	}
+	return false;
+}
+
+void LazyCodeMotion::localProperties(){
+	blocks = *cfg.getBlocks();
+	blocks.push_back(cfg.getExit());
+	for (size_t i = 0 ; i < blocks.size() ; i++){ blockIdx[blocks[i]] = i; }
+	preds.resize(blocks.size());
+	succs.resize(blocks.size());
+	for (size_t i = 0 ; i < blocks.size() ; i++){
+		for (auto pred : *blocks[i]->getPreds()){
+			preds[i].push_back(blockIdx[pred]);
+		}
+		for (auto succ : *blocks[i]->getSuccs()){
+			succs[i].push_back(blockIdx[succ]);
+		}
+	}
+
+	//The expressions that a definition of each variable kills
+	std::map<Opd *, std::vector<size_t>> killedBy;
+	for (size_t e = 0 ; e < numExps ; e++){
+		killedBy[exps[e].src1].push_back(e);
+		if (exps[e].src2 != nullptr && exps[e].src2 != exps[e].src1){
+			killedBy[exps[e].src2].push_back(e);
+		}
+	}
+
+	size_t exitIdx = blocks.size() - 1;
+	antloc.assign(blocks.size(), ExpSet(numExps, false));
+	comp.assign(blocks.size(), ExpSet(numExps, false));
+	transp.assign(blocks.size(), ExpSet(numExps, true));
+	transp[exitIdx] = ExpSet(numExps, false);
+	for (size_t b = 0 ; b < exitIdx ; b++){
+		ExpSet killed(numExps, false);
+		for (auto quad : *blocks[b]->getQuads()){
+			int exp = expOf(quad);
+			if (exp >= 0){
+				size_t idx = static_cast<size_t>(exp);
+				if (!killed.test(idx)){ antloc[b].set(idx); }
+				comp[b].set(idx);
+			}
+			for (auto def : quadMayDefs(proc, quad)){
+				auto found = killedBy.find(def);
+				if (found == killedBy.end()){ continue; }
+				for (auto e : found->second){
+					killed.set(e);
+					transp[b].reset(e);
+					comp[b].reset(e);
+				}
+			}
+		}
+	}
+}
+
+void LazyCodeMotion::globalProperties(){
+	size_t numBlocks = blocks.size();
+	size_t entryIdx = blockIdx[cfg.getEntry()];
+	size_t exitIdx = numBlocks - 1;
+
+	//Availability (forward, intersection)
+	avOut.assign(numBlocks, ExpSet(numExps, true));
+	bool changed = true;
+	while (changed){
+		changed = false;
+		for (size_t b = 0 ; b < exitIdx ; b++){
+			ExpSet in(numExps, !preds[b].empty() && b != entryIdx);
+			for (auto pred : preds[b]){ in &= avOut[pred]; }
+			in &= transp[b];
+			in |= comp[b];
+			if (in != avOut[b]){
+				avOut[b] = in;
+				changed = true;
+			}
+		}
+	}
+
+	//Anticipability (backward, intersection)
+	antIn.assign(numBlocks, ExpSet(numExps, true));
+	antIn[exitIdx] = ExpSet(numExps, false);
+	antOut.assign(numBlocks, ExpSet(numExps, false));
+	changed = true;
+	while (changed){
+		changed = false;
+		for (size_t b = exitIdx ; b-- > 0 ; ){
+			ExpSet & out = antOut[b] = ExpSet(numExps, !succs[b].empty());
+			for (auto succ : succs[b]){ out &= antIn[succ]; }
+			ExpSet in = out;
+			in &= transp[b];
+			in |= antloc[b];
+			if (in != antIn[b]){
+				antIn[b] = in;
+				changed = true;
+			}
+		}
+	}
+
+	//Earliest placement on each edge
+	std::vector<std::pair<size_t, size_t>> edgeIdx;
+	edges.push_back(std::make_pair(nullptr, cfg.getEntry()));
+	edgeIdx.push_back(std::make_pair(numBlocks, entryIdx));
+	for (size_t b = 0 ; b < exitIdx ; b++){
+		for (auto succ : succs[b]){
+			edges.push_back(std::make_pair(blocks[b], blocks[succ]));
+			edgeIdx.push_back(std::make_pair(b, succ));
+		}
+	}
+	for (auto edge : edgeIdx){
+		size_t from = edge.first;
+		ExpSet early = antIn[edge.second];
+		if (from != numBlocks){
+			early -= avOut[from];
+			ExpSet passes = transp[from];
+			passes &= antOut[from];
+			early -= passes;
+		}
+		earliest.push_back(early);
+	}
+
+	//Delay each placement for as long as every path allows
+	later.assign(edges.size(), ExpSet(numExps, true));
+	laterIn.assign(numBlocks, ExpSet(numExps, false));
+	for (auto edge : edgeIdx){
+		laterIn[edge.second] = ExpSet(numExps, true);
+	}
+	changed = true;
+	while (changed){
+		changed = false;
+		for (size_t i = 0 ; i < edges.size() ; i++){
+			size_t from = edgeIdx[i].first;
+			ExpSet lat = earliest[i];
+			if (from != numBlocks){
+				ExpSet passed = laterIn[from];
+				passed -= antloc[from];
+				lat |= passed;
+			}
+			if (lat != later[i]){
+				later[i] = lat;
+				changed = true;
+			}
+		}
+		std::vector<ExpSet> newIn(numBlocks);
+		std::vector<bool> entered(numBlocks, false);
+		for (size_t i = 0 ; i < edges.size() ; i++){
+			size_t to = edgeIdx[i].second;
+			if (!entered[to]){
+				newIn[to] = later[i];
+				entered[to] = true;
+				continue;
+			}
+			newIn[to] &= later[i];
+		}
+		for (size_t b = 0 ; b < numBlocks ; b++){
+			if (entered[b] && laterIn[b] != newIn[b]){
+				laterIn[b] = newIn[b];
+				changed = true;
+			}
+		}
+	}
+
+	for (size_t i = 0 ; i < edges.size() ; i++){
+		ExpSet ins = later[i];
+		ins -= laterIn[edgeIdx[i].second];
+		insert.push_back(ins);
+	}
+	del.assign(numBlocks, ExpSet(numExps, false));
+	for (size_t b = 0 ; b < exitIdx ; b++){
+		del[b] = antloc[b];
+		del[b] -= laterIn[b];
+	}
+}
+
+Quad * LazyCodeMotion::makeComputation(size_t exp){
+	LexExp & lex = exps[exp];
+	if (lex.unary){
+		return new UnaryOpQuad(saved[exp],
+			static_cast<UnaryOp>(lex.op), lex.src1);
+	}
+	return new BinOpQuad(saved[exp], static_cast<BinOp>(lex.op),
+		lex.src1, lex.src2);
+}
+
+void LazyCodeMotion::transform(){
+	saved.assign(numExps, nullptr);
+	ExpSet moved(numExps, false);
+	for (auto & ins : insert){ moved |= ins; }
+	for (auto & d : del){ moved |= d; }
+	for (size_t e = 0 ; e < numExps ; e++){
+		if (moved.test(e)){ saved[e] = proc->makeTmp(); }
+	}
+
+	//Redundant occurrences read the saved value, and every
+	// other occurrence saves its value for them
+	for (auto block : *cfg.getBlocks()){
+		std::list<Quad *> * quads = block->getQuads();
+		ExpSet first = del[blockIdx[block]];
+		for (auto itr = quads->begin() ; itr != quads->end() ; ++itr){
+			Quad * quad = *itr;
+			int exp = expOf(quad);
+			if (exp < 0 || !moved.test(static_cast<size_t>(exp))){ continue; }
+			size_t idx = static_cast<size_t>(exp);
+			Quad * copy = new AssignQuad(quad->getDst(), saved[idx]);
+			if (first.test(idx)){
+				first.reset(idx);
+				quad->moveLabelsTo(copy);
+				*itr = copy;
+				continue;
+			}
+			quad->setDst(saved[idx]);
+			itr = quads->insert(std::next(itr), copy);
+		}
+	}
+
+	//Insert the computations on their edges, splitting the
+	// edges that need it
+	std::list<Quad *> * body = proc->getQuads();
+	std::list<Quad *> prologue;
+	std::map<BasicBlock *, std::list<Quad *>> fallSplits;
+	std::list<Quad *> jumpSplits;
+	for (size_t i = 0 ; i < edges.size() ; i++){
+		std::list<Quad *> code;
+		for (size_t e = 0 ; e < numExps ; e++){
+			if (insert[i].test(e)){ code.push_back(makeComputation(e)); }
+		}
+		if (code.empty()){ continue; }
+		BasicBlock * from = edges[i].first;
+		BasicBlock * to = edges[i].second;
+		if (from == nullptr){
+			prologue.splice(prologue.end(), code);
+		} else if (from->getSuccs()->size() == 1){
+			from->append(&code);
+		} else if (to->getPreds()->size() == 1 && to != cfg.getExit()
+			&& to != cfg.getEntry()){
+			Quad * oldFirst = to->getQuads()->front();
+			oldFirst->moveLabelsTo(code.front());
+			to->getQuads()->splice(to->getQuads()->begin(), code);
+		} else if (!isJumpEdge(from, to)){
+			std::list<Quad *> & split = fallSplits[from];
+			split.splice(split.end(), code);
+		} else {
+			JmpIfQuad * branch = from->getQuads()->back()->asJmpIf();
+			Label * target = branch->getTarget();
+			Label * splitLabel = proc->makeLabel();
+			code.front()->addLabel(splitLabel);
+			code.push_back(new JmpQuad(target));
+			branch->setTarget(splitLabel);
+			jumpSplits.splice(jumpSplits.end(), code);
+		}
+	}
+
+	body->clear();
+	body->splice(body->end(), prologue);
+	for (auto block : *cfg.getBlocks()){
+		body->insert(body->end(), block->getQuads()->begin(),
+			block->getQuads()->end());
+		auto split = fallSplits.find(block);
+		if (split != fallSplits.end()){
+			body->splice(body->end(), split->second);
+		}
+	}
+	if (!jumpSplits.empty()){
+		if (!body->empty() && body->back()->fallsThrough()){
+			body->push_back(new JmpQuad(proc->getLeaveLabel()));
+		}
+		body->splice(body->end(), jumpSplits);
+	}
+}
+
+bool LazyCodeMotion::run(){
+	for (auto quad : *proc->getQuads()){
+		expOf(quad);
+	}
+	numExps = exps.size();
+	if (numExps == 0){ return false; }
+	localProperties();
+	globalProperties();
+
+	bool any = false;
+	for (auto & d : del){ any = any || d.any(); }
+	if (!any){ return false; }
+	transform();
+	return true;
+}
+
+bool eliminatePartialRedundancy(Procedure * proc){
+	LazyCodeMotion motion(proc);
+	return motion.run();
+}
+
+}
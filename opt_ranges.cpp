@@ -0,0 +1,575 @@
+#include <algorithm>
+#include <climits>
+#include "opt.hpp"
+
+namespace lake{
+
+static const Range FULL_RANGE = {LONG_MIN, LONG_MAX};
+
+//How many times the ranges on entry to a loop header may grow
+// before the ones still growing are widened
+static const size_t WIDEN_AFTER = 2;
+//How many passes narrow the widened ranges again
+static const size_t NARROW_PASSES = 2;
+
+static bool isFull(Range r){
+	return r.lo == LONG_MIN && r.hi == LONG_MAX;
+}
+
+static Range hull(Range a, Range b){
+	return Range{std::min(a.lo, b.lo), std::max(a.hi, b.hi)};
+}
+
+//a + b, if it does not overflow
+static bool addFits(long int a, long int b, long int * res){
+	if ((b > 0 && a > LONG_MAX - b) || (b < 0 && a < LONG_MIN - b)){
+		return false;
+	}
+	*res = a + b;
+	return true;
+}
+
+//a - b, if it does not overflow
+static bool subFits(long int a, long int b, long int * res){
+	if ((b < 0 && a > LONG_MAX + b) || (b > 0 && a < LONG_MIN + b)){
+		return false;
+	}
+	*res = a - b;
+	return true;
+}
+
+//a * b, if it does not overflow
+static bool multFits(long int a, long int b, long int * res){
+	if (a > 0 ? (b > 0 ? a > LONG_MAX / b : b < LONG_MIN / a)
+		: (b > 0 ? a < LONG_MIN / b : (a != 0 && b < LONG_MAX / a))){
+		return false;
+	}
+	*res = a * b;
+	return true;
+}
+
+//The quotients of a divided by a divisor range that does not
+// contain 0, which lie between those of the corners
+static Range divRange(Range a, Range b){
+	if (a.lo == LONG_MIN && b.lo <= -1 && b.hi >= -1){ return FULL_RANGE; }
+	long int corners[] = {a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi};
+	return Range{*std::min_element(corners, corners + 4),
+		*std::max_element(corners, corners + 4)};
+}
+
+//Whether the ranges decide the comparison a op b, and if so
+// which way
+static bool decideCmp(BinOp op, Range a, Range b, bool * res){
+	switch (op){
+	case LT:
+		if (a.hi < b.lo){ *res = true; return true; }
+		if (a.lo >= b.hi){ *res = false; return true; }
+		return false;
+	case LTE:
+		if (a.hi <= b.lo){ *res = true; return true; }
+		if (a.lo > b.hi){ *res = false; return true; }
+		return false;
+	case GT: return decideCmp(LT, b, a, res);
+	case GTE: return decideCmp(LTE, b, a, res);
+	case EQ:
+	case NEQ:
+		if (a.hi < b.lo || b.hi < a.lo){
+			*res = op == NEQ;
+			return true;
+		}
+		if (a.isConst() && b.isConst()){
+			*res = op == EQ;
+			return true;
+		}
+		return false;
+	default:
+		return false;
+	}
+}
+
+static bool isCmp(BinOp op){
+	return op == LT || op == LTE || op == GT || op == GTE
+		|| op == EQ || op == NEQ;
+}
+
+static BinOp negateCmp(BinOp op){
+	switch (op){
+	case LT: return GTE;
+	case LTE: return GT;
+	case GT: return LTE;
+	case GTE: return LT;
+	case EQ: return NEQ;
+	default: return EQ;
+	}
+}
+
+static Range binRange(BinOp op, Range a, Range b){
+	long int lo;
+	long int hi;
+	if (a.isConst() && b.isConst() && foldBinOp(op, a.lo, b.lo, &lo)){
+		return Range{lo, lo};
+	}
+	switch (op){
+	case ADD:
+		if (addFits(a.lo, b.lo, &lo) && addFits(a.hi, b.hi, &hi)){
+			return Range{lo, hi};
+		}
+		return FULL_RANGE;
+	case SUB:
+		if (subFits(a.lo, b.hi, &lo) && subFits(a.hi, b.lo, &hi)){
+			return Range{lo, hi};
+		}
+		return FULL_RANGE;
+	case MULT: {
+		long int corners[4];
+		if (!multFits(a.lo, b.lo, &corners[0])
+			|| !multFits(a.lo, b.hi, &corners[1])
+			|| !multFits(a.hi, b.lo, &corners[2])
+			|| !multFits(a.hi, b.hi, &corners[3])){
+			return FULL_RANGE;
+		}
+		return Range{*std::min_element(corners, corners + 4),
+			*std::max_element(corners, corners + 4)};
+	}
+	case DIV: {
+		//Split the divisor into its negative and positive parts,
+		// since a quotient by 0 is never produced
+		bool any = false;
+		Range res = FULL_RANGE;
+		if (b.lo < 0){
+			res = divRange(a, Range{b.lo, std::min(b.hi, -1L)});
+			any = true;
+		}
+		if (b.hi > 0){
+			Range pos = divRange(a, Range{std::max(b.lo, 1L), b.hi});
+			res = any ? hull(res, pos) : pos;
+			any = true;
+		}
+		return any ? res : FULL_RANGE;
+	}
+	case AND:
+	case OR:
+		if (a.lo < 0 || a.hi > 1 || b.lo < 0 || b.hi > 1){ return FULL_RANGE; }
+		if (op == AND){ return Range{a.lo & b.lo, a.hi & b.hi}; }
+		return Range{a.lo | b.lo, a.hi | b.hi};
+	default: {
+		bool res;
+		if (decideCmp(op, a, b, &res)){ return Range{res, res}; }
+		return Range{0, 1};
+	}
+	}
+}
+
+static Range unaryRange(UnaryOp op, Range a){
+	if (op == NEG){
+		if (a.lo == LONG_MIN){ return FULL_RANGE; }
+		return Range{-a.hi, -a.lo};
+	}
+	//NOT flips the low bit, which is a logical not only on 0 and 1
+	if (a.lo >= 0 && a.hi <= 1){ return Range{1 - a.hi, 1 - a.lo}; }
+	return Range{a.lo == LONG_MIN ? a.lo : a.lo - 1,
+		a.hi == LONG_MAX ? a.hi : a.hi + 1};
+}
+
+//Narrow the ranges of x and y to the values for which x op y
+// holds. Returns false if there are none.
+static bool narrowCmp(BinOp op, Range * x, Range * y){
+	Range a = *x;
+	Range b = *y;
+	switch (op){
+	case LT:
+		if (b.hi == LONG_MIN || a.lo == LONG_MAX){ return false; }
+		x->hi = std::min(a.hi, b.hi - 1);
+		y->lo = std::max(b.lo, a.lo + 1);
+		break;
+	case LTE:
+		x->hi = std::min(a.hi, b.hi);
+		y->lo = std::max(b.lo, a.lo);
+		break;
+	case GT: return narrowCmp(LT, y, x);
+	case GTE: return narrowCmp(LTE, y, x);
+	case EQ:
+		x->lo = y->lo = std::max(a.lo, b.lo);
+		x->hi = y->hi = std::min(a.hi, b.hi);
+		break;
+	case NEQ:
+		if (a.isConst() && b.isConst()){ return a.lo != b.lo; }
+		if (b.isConst()){
+			if (a.lo == b.lo){ x->lo++; }
+			if (a.hi == b.lo){ x->hi--; }
+		}
+		if (a.isConst()){
+			if (b.lo == a.lo){ y->lo++; }
+			if (b.hi == a.lo){ y->hi--; }
+		}
+		break;
+	default:
+		break;
+	}
+	return x->lo <= x->hi && y->lo <= y->hi;
+}
+
+bool ValueRanges::State::operator==(const State & other) const{
+	if (reached != other.reached || ranges.size() != other.ranges.size()){
+		return false;
+	}
+	auto itr = other.ranges.begin();
+	for (auto entry : ranges){
+		if (entry.first != itr->first || entry.second.lo != itr->second.lo
+			|| entry.second.hi != itr->second.hi){
+			return false;
+		}
+		++itr;
+	}
+	return true;
+}
+
+Range ValueRanges::get(State * state, Opd * opd){
+	if (LitOpd * lit = opd->asLit()){
+		long int val = lit->getVal();
+		return Range{val, val};
+	}
+	auto found = state->ranges.find(opd);
+	if (found == state->ranges.end()){ return FULL_RANGE; }
+	return found->second;
+}
+
+void ValueRanges::transfer(State * state, Quad * quad){
+	if (!state->reached){ return; }
+	bool known = true;
+	Range res = FULL_RANGE;
+	if (BinOpQuad * bin = quad->asBinOp()){
+		res = binRange(bin->getOp(), get(state, bin->getSrc1()),
+			get(state, bin->getSrc2()));
+	} else if (UnaryOpQuad * unary = quad->asUnaryOp()){
+		res = unaryRange(unary->getOp(), get(state, unary->getSrc()));
+	} else if (AssignQuad * assign = quad->asAssign()){
+		res = get(state, assign->getSrc());
+	} else {
+		known = false;
+	}
+	for (auto def : quadMayDefs(proc, quad)){ state->ranges.erase(def); }
+	Opd * dst = quad->getDst();
+	if (known && isVar(dst) && !isFull(res)){ state->ranges[dst] = res; }
+}
+
+//Narrow the ranges at the end of block, which ends in branch,
+// to those that send control the given way
+void ValueRanges::refine(State * state, JmpIfQuad * branch,
+	BasicBlock * block, bool taken){
+	bool truth = taken == branch->isInverted();
+	Opd * cnd = branch->getCnd();
+	if (!isVar(cnd)){ return; }
+
+	//The comparison that computed the condition, if what it
+	// compared has not changed since
+	std::list<Quad *> * quads = block->getQuads();
+	std::set<Opd *> changed;
+	BinOpQuad * cmp = nullptr;
+	for (auto itr = std::next(quads->rbegin()) ; itr != quads->rend() ; ++itr){
+		std::set<Opd *> defs = quadMayDefs(proc, *itr);
+		if (defs.count(cnd)){
+			cmp = (*itr)->asBinOp();
+			break;
+		}
+		changed.insert(defs.begin(), defs.end());
+	}
+	if (cmp != nullptr && isCmp(cmp->getOp())){
+		Opd * x = cmp->getSrc1();
+		Opd * y = cmp->getSrc2();
+		if (x != cnd && y != cnd && !changed.count(x) && !changed.count(y)){
+			Range rx = get(state, x);
+			Range ry = get(state, y);
+			BinOp op = truth ? cmp->getOp() : negateCmp(cmp->getOp());
+			if (!narrowCmp(op, &rx, &ry)){
+				state->reached = false;
+				return;
+			}
+			if (isVar(x)){ state->ranges[x] = rx; }
+			if (isVar(y)){ state->ranges[y] = ry; }
+
+			//Copies of what was compared that still hold the
+			// same value are narrowed the same way (a loop
+			// counter is often copied from its stepped value
+			// just before the test)
+			changed.clear();
+			for (auto itr = quads->rbegin() ; itr != quads->rend() ; ++itr){
+				AssignQuad * copy = (*itr)->asAssign();
+				if (copy != nullptr && !changed.count(copy->getDst())
+					&& !changed.count(copy->getSrc())){
+					Opd * src = copy->getSrc();
+					if (src == x && isVar(x)){ state->ranges[copy->getDst()] = rx; }
+					if (src == y && isVar(y)){ state->ranges[copy->getDst()] = ry; }
+				}
+				std::set<Opd *> defs = quadMayDefs(proc, *itr);
+				changed.insert(defs.begin(), defs.end());
+			}
+		}
+	}
+
+	Range rc = get(state, cnd);
+	if (truth){
+		if (rc.isConst() && rc.lo == 0){
+			state->reached = false;
+			return;
+		}
+		if (rc.lo == 0){ rc.lo = 1; }
+		if (rc.hi == 0){ rc.hi = -1; }
+	} else {
+		if (rc.lo > 0 || rc.hi < 0){
+			state->reached = false;
+			return;
+		}
+		rc = Range{0, 0};
+	}
+	state->ranges[cnd] = rc;
+}
+
+//The ranges at the end of from, as they are when control goes
+// on to to
+ValueRanges::State ValueRanges::edgeState(BasicBlock * from,
+	BasicBlock * to){
+	State res = out[from];
+	JmpIfQuad * branch = from->getQuads()->back()->asJmpIf();
+	if (branch == nullptr || from->getSuccs()->size() != 2){ return res; }
+	refine(&res, branch, from, to != layoutNext[from]);
+	return res;
+}
+
+//Recompute the ranges at the end of block from those on entry
+void ValueRanges::update(BasicBlock * block){
+	State & res = out[block] = in[block];
+	for (auto quad : *block->getQuads()){ transfer(&res, quad); }
+}
+
+//The ranges on entry to block: whatever any edge into it brings
+ValueRanges::State ValueRanges::join(BasicBlock * block){
+	State res;
+	if (block == cfg->getEntry()){
+		res.reached = true;
+		return res;
+	}
+	for (auto pred : *block->getPreds()){
+		State edge = edgeState(pred, block);
+		if (!edge.reached){ continue; }
+		if (!res.reached){
+			res = edge;
+			continue;
+		}
+		for (auto itr = res.ranges.begin() ; itr != res.ranges.end() ; ){
+			auto found = edge.ranges.find(itr->first);
+			if (found == edge.ranges.end()){
+				itr = res.ranges.erase(itr);
+				continue;
+			}
+			itr->second = hull(itr->second, found->second);
+			++itr;
+		}
+	}
+	return res;
+}
+
+//Widen the ranges in next that have grown since old. They
+// grow to the constants that the loop compares with (give or
+// take one) before they are given up on, since those are the
+// likely bounds of the loop.
+void ValueRanges::widen(State * old, State * next,
+	const std::set<long int> & thresholds){
+	if (!old->reached){ return; }
+	for (auto itr = next->ranges.begin() ; itr != next->ranges.end() ; ){
+		auto found = old->ranges.find(itr->first);
+		if (found == old->ranges.end()){
+			itr = next->ranges.erase(itr);
+			continue;
+		}
+		Range & r = itr->second;
+		if (r.lo < found->second.lo){
+			auto below = thresholds.upper_bound(r.lo);
+			r.lo = below == thresholds.begin() ? LONG_MIN : *std::prev(below);
+		} else {
+			r.lo = found->second.lo;
+		}
+		if (r.hi > found->second.hi){
+			auto above = thresholds.lower_bound(r.hi);
+			r.hi = above == thresholds.end() ? LONG_MAX : *above;
+		} else {
+			r.hi = found->second.hi;
+		}
+		if (isFull(r)){
+			itr = next->ranges.erase(itr);
+			continue;
+		}
+		++itr;
+	}
+}
+
+ValueRanges::ValueRanges(Procedure * procIn, ControlFlowGraph * cfgIn)
+: proc(procIn), cfg(cfgIn){
+	Dominators doms(cfg);
+	std::vector<BasicBlock *> * order = doms.getOrder();
+
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	for (size_t i = 0 ; i < blocks->size() ; i++){
+		layoutNext[(*blocks)[i]] = i + 1 < blocks->size()
+			? (*blocks)[i + 1] : cfg->getExit();
+	}
+
+	//Every cycle goes back against the order somewhere, and
+	// widening where it does so is enough to reach a fixpoint
+	std::map<BasicBlock *, size_t> orderIdx;
+	for (size_t i = 0 ; i < order->size() ; i++){ orderIdx[(*order)[i]] = i; }
+	std::set<BasicBlock *> headers;
+	for (auto block : *order){
+		for (auto pred : *block->getPreds()){
+			auto found = orderIdx.find(pred);
+			if (found != orderIdx.end() && found->second >= orderIdx[block]){
+				headers.insert(block);
+			}
+		}
+	}
+
+	//The thresholds of a loop come from the comparisons in it.
+	// A header of no natural loop has none, and its ranges are
+	// widened all the way.
+	std::map<BasicBlock *, std::set<long int>> thresholds;
+	for (auto loop : findLoops(cfg, &doms)){
+		std::set<long int> & bounds = thresholds[loop->getHeader()];
+		for (auto block : *loop->getBlocks()){
+			for (auto quad : *block->getQuads()){
+				BinOpQuad * bin = quad->asBinOp();
+				if (bin == nullptr || !isCmp(bin->getOp())){ continue; }
+				for (auto src : bin->getSrcs()){
+					LitOpd * lit = src->asLit();
+					if (lit == nullptr){ continue; }
+					long int val = lit->getVal();
+					bounds.insert(val);
+					if (val > LONG_MIN){ bounds.insert(val - 1); }
+					if (val < LONG_MAX){ bounds.insert(val + 1); }
+				}
+			}
+		}
+	}
+
+	//Visit the blocks in order from a worklist. A block goes
+	// back on it when the ranges at the end of a predecessor
+	// change.
+	std::set<size_t> work;
+	for (size_t i = 0 ; i < order->size() ; i++){ work.insert(i); }
+	std::map<BasicBlock *, size_t> visits;
+	while (!work.empty()){
+		BasicBlock * block = (*order)[*work.begin()];
+		work.erase(work.begin());
+		State next = join(block);
+		State & old = in[block];
+		if (headers.count(block) && ++visits[block] > WIDEN_AFTER){
+			widen(&old, &next, thresholds[block]);
+		}
+		if (next == old){ continue; }
+		old = next;
+		update(block);
+		for (auto succ : *block->getSuccs()){
+			auto found = orderIdx.find(succ);
+			if (found != orderIdx.end()){ work.insert(found->second); }
+		}
+	}
+	for (size_t i = 0 ; i < NARROW_PASSES ; i++){
+		for (auto block : *order){
+			in[block] = join(block);
+			update(block);
+		}
+	}
+
+	for (auto block : *cfg->getBlocks()){
+		State state = in[block];
+		for (auto quad : *block->getQuads()){
+			before[quad] = state;
+			transfer(&state, quad);
+		}
+	}
+}
+
+bool ValueRanges::isReachable(Quad * quad){
+	auto found = before.find(quad);
+	return found == before.end() || found->second.reached;
+}
+
+Range ValueRanges::getRange(Quad * quad, Opd * opd){
+	auto found = before.find(quad);
+	if (found == before.end()){
+		if (LitOpd * lit = opd->asLit()){
+			return Range{lit->getVal(), lit->getVal()};
+		}
+		return FULL_RANGE;
+	}
+	return get(&found->second, opd);
+}
+
+bool ValueRanges::decideBranch(BasicBlock * pred, BasicBlock * block,
+	bool * jumps){
+	JmpIfQuad * branch = block->getQuads()->back()->asJmpIf();
+	if (branch == nullptr){ return false; }
+	State state = edgeState(pred, block);
+	if (!state.reached){ return false; }
+	for (auto quad : *block->getQuads()){
+		if (quad != branch){ transfer(&state, quad); }
+	}
+	Range cnd = get(&state, branch->getCnd());
+	if (!cnd.isConst()){ return false; }
+	*jumps = (cnd.lo != 0) == branch->isInverted();
+	return true;
+}
+
+//Use what range analysis knows: variables that can only hold
+// one value become that value, comparisons whose outcome is
+// decided become constants (and so do the branches on them,
+// once the simplifier has been at them), and divisions whose
+// operands are known to be small or non-negative are marked
+// so that code generation can pick a cheaper instruction
+bool propagateRanges(Procedure * proc){
+	ControlFlowGraph cfg(proc);
+	ValueRanges ranges(proc, &cfg);
+	bool changed = false;
+	for (auto block : *cfg.getBlocks()){
+		std::list<Quad *> * quads = block->getQuads();
+		for (auto itr = quads->begin() ; itr != quads->end() ; ++itr){
+			Quad * quad = *itr;
+			if (!ranges.isReachable(quad)){ continue; }
+			for (auto src : quad->getSrcs()){
+				if (!isVar(src)){ continue; }
+				Range r = ranges.getRange(quad, src);
+				if (!r.isConst()){ continue; }
+				quad->replaceSrc(src, new LitOpd(std::to_string(r.lo)));
+				changed = true;
+			}
+
+			BinOpQuad * bin = quad->asBinOp();
+			if (bin == nullptr){ continue; }
+			Range a = ranges.getRange(quad, bin->getSrc1());
+			Range b = ranges.getRange(quad, bin->getSrc2());
+			bool res;
+			if (isCmp(bin->getOp()) && !(a.isConst() && b.isConst())
+				&& decideCmp(bin->getOp(), a, b, &res)){
+				Quad * copy = new AssignQuad(bin->getDst(),
+					new LitOpd(res ? "1" : "0"));
+				bin->moveLabelsTo(copy);
+				*itr = copy;
+				changed = true;
+			} else if (bin->getOp() == DIV){
+				bool nonNeg = a.lo >= 0 && b.lo >= 0;
+				bool narrow;
+				if (nonNeg){
+					long int max = static_cast<long int>(UINT_MAX);
+					narrow = a.hi <= max && b.hi <= max;
+				} else {
+					narrow = a.lo > INT_MIN && a.hi <= INT_MAX
+						&& b.lo >= INT_MIN && b.hi <= INT_MAX;
+				}
+				bin->setDivFacts(nonNeg, narrow);
+			}
+		}
+	}
+	cfg.commit();
+	return changed;
+}
+
+}
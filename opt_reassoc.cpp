@@ -0,0 +1,319 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+static bool isAssociative(BinOp op){
+	return op == ADD || op == MULT || op == AND || op == OR;
+}
+
+//Reassociation of chains of one associative and commutative
+// operator (ADD, MULT, AND or OR) within a block. A chain is a
+// tree of quads joined by temps that are written once and read
+// once, by a later quad of the chain. Its literal leaves are
+// folded into one constant, and its other leaves are ordered
+// by rank: the number of surrounding loops they vary in.
+// Leaves of the lowest rank (and the constant) are combined
+// first, so the part of the chain that a loop does not change
+// is computed on its own and can be hoisted. Leaves of the same
+// rank are combined as a balanced tree rather than one after
+// the other, which shortens the chain of dependences.
+class Reassociator{
+public:
+	Reassociator(Procedure * procIn) : proc(procIn), cfg(procIn){ }
+	bool run();
+private:
+	//A chain as it is, or as it is to be rebuilt: either a
+	// leaf operand or the operator applied to two subtrees
+	struct OpTree{
+		Opd * leaf;
+		OpTree * left;
+		OpTree * right;
+	};
+	//A chain found in a block, rooted at the quad that writes
+	// its result
+	struct Chain{
+		BinOpQuad * root;
+		OpTree * shape;
+		std::vector<Opd *> leaves;
+		std::set<Quad *> inner;
+	};
+
+	OpTree * makeTree(Opd * leaf, OpTree * left, OpTree * right);
+	bool gather(BinOpQuad * quad, size_t rootPos, Chain * chain,
+		OpTree ** shape);
+	void findVariant(NaturalLoop * loop);
+	size_t rank(Opd * opd, BasicBlock * block);
+	OpTree * balance(std::vector<Opd *> * leaves, size_t lo, size_t hi);
+	OpTree * rebuild(Chain * chain, BasicBlock * block);
+	bool sameTree(OpTree * a, OpTree * b);
+	Opd * emit(OpTree * tree, BinOp op, Opd * dst, std::list<Quad *> * out);
+	void replace(Chain * chain, OpTree * shape, BasicBlock * block);
+
+	Procedure * proc;
+	ControlFlowGraph cfg;
+	std::list<OpTree> trees;
+	std::map<Opd *, size_t> defCounts;
+	std::map<Opd *, size_t> useCounts;
+	std::map<NaturalLoop *, std::set<Opd *>> variant;
+	//Per block being looked at: where each quad is, what it
+	// may write, and the chain quad that reads each temp
+	std::map<Quad *, size_t> pos;
+	std::vector<std::set<Opd *>> mayDefs;
+	std::map<Opd *, BinOpQuad *> parents;
+	std::map<Opd *, BinOpQuad *> defs;
+};
+
+Reassociator::OpTree * Reassociator::makeTree(Opd * leaf, OpTree * left,
+	OpTree * right){
+	trees.push_back(OpTree{leaf, left, right});
+	return &trees.back();
+}
+
+//Collect the leaves of the part of a chain computed by quad,
+// in order, along with its shape. Fails if a leaf may change
+// between the quad that reads it and the root at rootPos.
+bool Reassociator::gather(BinOpQuad * quad, size_t rootPos, Chain * chain,
+	OpTree ** shape){
+	OpTree * sides[2];
+	Opd * srcs[2] = {quad->getSrc1(), quad->getSrc2()};
+	for (size_t i = 0 ; i < 2 ; i++){
+		Opd * src = srcs[i];
+		auto parent = parents.find(src);
+		if (parent != parents.end() && parent->second == quad){
+			BinOpQuad * def = defs[src];
+			chain->inner.insert(def);
+			if (!gather(def, rootPos, chain, &sides[i])){ return false; }
+			continue;
+		}
+		if (isVar(src)){
+			for (size_t p = pos[quad] + 1 ; p < rootPos ; p++){
+				if (mayDefs[p].count(src)){ return false; }
+			}
+		}
+		chain->leaves.push_back(src);
+		sides[i] = makeTree(src, nullptr, nullptr);
+	}
+	*shape = makeTree(nullptr, sides[0], sides[1]);
+	return true;
+}
+
+//Find the variables that may change from one iteration of
+// loop to the next: those written in it, except by a single
+// computation or copy of operands that do not change
+void Reassociator::findVariant(NaturalLoop * loop){
+	std::map<Opd *, size_t> counts;
+	std::map<Opd *, Quad *> loopDefs;
+	for (auto block : *loop->getBlocks()){
+		for (auto quad : *block->getQuads()){
+			for (auto def : quadMayDefs(proc, quad)){
+				counts[def]++;
+				loopDefs[def] = quad;
+			}
+		}
+	}
+	std::set<Opd *> * res = &variant[loop];
+	for (auto & count : counts){ res->insert(count.first); }
+	bool changed = true;
+	while (changed){
+		changed = false;
+		for (auto & count : counts){
+			Quad * def = loopDefs[count.first];
+			if (!res->count(count.first) || count.second != 1 || mayFault(def)
+				|| (def->asBinOp() == nullptr && def->asUnaryOp() == nullptr
+				&& def->asAssign() == nullptr)){
+				continue;
+			}
+			bool fixed = true;
+			for (auto src : def->getSrcs()){
+				if (res->count(src)){ fixed = false; }
+			}
+			if (fixed){
+				res->erase(count.first);
+				changed = true;
+			}
+		}
+	}
+}
+
+size_t Reassociator::rank(Opd * opd, BasicBlock * block){
+	size_t res = 0;
+	for (auto & loop : variant){
+		if (loop.first->contains(block) && loop.second.count(opd)){ res++; }
+	}
+	return res;
+}
+
+Reassociator::OpTree * Reassociator::balance(std::vector<Opd *> * leaves,
+	size_t lo, size_t hi){
+	if (hi - lo == 1){ return makeTree((*leaves)[lo], nullptr, nullptr); }
+	size_t mid = lo + (hi - lo + 1) / 2;
+	return makeTree(nullptr, balance(leaves, lo, mid),
+		balance(leaves, mid, hi));
+}
+
+//The shape a chain should have: the literals folded into one
+// constant that joins the lowest rank, and each rank built as
+// a balanced tree and combined with the ranks below it
+Reassociator::OpTree * Reassociator::rebuild(Chain * chain,
+	BasicBlock * block){
+	BinOp op = chain->root->getOp();
+	std::vector<std::pair<size_t, Opd *>> ranked;
+	bool hasConst = false;
+	long int constant = 0;
+	for (auto leaf : chain->leaves){
+		LitOpd * lit = leaf->asLit();
+		if (lit == nullptr){
+			ranked.push_back(std::make_pair(rank(leaf, block), leaf));
+		} else if (!hasConst){
+			hasConst = true;
+			constant = lit->getVal();
+		} else {
+			foldBinOp(op, constant, lit->getVal(), &constant);
+		}
+	}
+	if (ranked.empty()){
+		return makeTree(new LitOpd(std::to_string(constant)), nullptr, nullptr);
+	}
+	std::stable_sort(ranked.begin(), ranked.end(),
+		[](const std::pair<size_t, Opd *> & a,
+			const std::pair<size_t, Opd *> & b){
+			return a.first < b.first;
+		});
+	std::vector<Opd *> order;
+	OpTree * res = nullptr;
+	for (size_t i = 0 ; i < ranked.size() ; ){
+		order.clear();
+		size_t r = ranked[i].first;
+		for ( ; i < ranked.size() && ranked[i].first == r ; i++){
+			order.push_back(ranked[i].second);
+		}
+		if (res == nullptr && hasConst){
+			order.push_back(new LitOpd(std::to_string(constant)));
+		}
+		OpTree * group = balance(&order, 0, order.size());
+		res = res == nullptr ? group : makeTree(nullptr, res, group);
+	}
+	return res;
+}
+
+bool Reassociator::sameTree(OpTree * a, OpTree * b){
+	if ((a->leaf == nullptr) != (b->leaf == nullptr)){ return false; }
+	if (a->leaf == nullptr){
+		return sameTree(a->left, b->left) && sameTree(a->right, b->right);
+	}
+	if (a->leaf == b->leaf){ return true; }
+	LitOpd * aLit = a->leaf->asLit();
+	LitOpd * bLit = b->leaf->asLit();
+	return aLit != nullptr && bLit != nullptr
+		&& aLit->getVal() == bLit->getVal();
+}
+
+Opd * Reassociator::emit(OpTree * tree, BinOp op, Opd * dst,
+	std::list<Quad *> * out){
+	if (tree->leaf != nullptr){ return tree->leaf; }
+	Opd * left = emit(tree->left, op, nullptr, out);
+	Opd * right = emit(tree->right, op, nullptr, out);
+	Opd * res = dst == nullptr ? proc->makeTmp() : dst;
+	out->push_back(new BinOpQuad(res, op, left, right));
+	return res;
+}
+
+//Put the quads computing shape where the root of chain is,
+// and drop the old quads of the chain
+void Reassociator::replace(Chain * chain, OpTree * shape,
+	BasicBlock * block){
+	BinOpQuad * root = chain->root;
+	std::list<Quad *> code;
+	if (shape->leaf != nullptr){
+		code.push_back(new AssignQuad(root->getDst(), shape->leaf));
+	} else {
+		emit(shape, root->getOp(), root->getDst(), &code);
+	}
+	std::list<Quad *> * quads = block->getQuads();
+	auto at = std::find(quads->begin(), quads->end(), root);
+	root->moveLabelsTo(code.front());
+	quads->splice(at, code);
+	quads->erase(at);
+	for (auto itr = quads->begin() ; itr != quads->end() ; ){
+		if (chain->inner.count(*itr)){
+			itr = eraseQuad(quads, itr);
+		} else {
+			++itr;
+		}
+	}
+}
+
+bool Reassociator::run(){
+	Dominators doms(&cfg);
+	for (auto loop : findLoops(&cfg, &doms)){ findVariant(loop); }
+	for (auto block : *cfg.getBlocks()){
+		for (auto quad : *block->getQuads()){
+			for (auto def : quadMayDefs(proc, quad)){ defCounts[def]++; }
+			for (auto src : quad->getSrcs()){ useCounts[src]++; }
+		}
+	}
+
+	bool changed = false;
+	for (auto block : *cfg.getBlocks()){
+		pos.clear();
+		mayDefs.clear();
+		parents.clear();
+		defs.clear();
+		std::vector<BinOpQuad *> ops;
+		for (auto quad : *block->getQuads()){
+			pos[quad] = mayDefs.size();
+			mayDefs.push_back(quadMayDefs(proc, quad));
+			BinOpQuad * bin = quad->asBinOp();
+			if (bin != nullptr && isAssociative(bin->getOp())){
+				ops.push_back(bin);
+			}
+		}
+
+		//A quad is inside a chain if its result is a temp that
+		// only a later quad with the same operator reads
+		for (auto bin : ops){
+			Opd * dst = bin->getDst();
+			if (isVar(dst) && dst->asSym() == nullptr
+				&& defCounts[dst] == 1 && useCounts[dst] == 1){
+				defs[dst] = bin;
+			}
+		}
+		for (auto bin : ops){
+			for (auto src : bin->getSrcs()){
+				auto def = defs.find(src);
+				if (def != defs.end() && def->second->getOp() == bin->getOp()
+					&& pos[def->second] < pos[bin]){
+					parents[src] = bin;
+				}
+			}
+		}
+
+		std::list<std::pair<Chain, OpTree *>> rewrites;
+		for (auto bin : ops){
+			if (parents.count(bin->getDst())){ continue; }
+			Chain chain;
+			chain.root = bin;
+			if (!gather(bin, pos[bin], &chain, &chain.shape)
+				|| chain.leaves.size() < 3){
+				continue;
+			}
+			OpTree * shape = rebuild(&chain, block);
+			if (sameTree(shape, chain.shape)){ continue; }
+			rewrites.push_back(std::make_pair(chain, shape));
+		}
+		for (auto & rewrite : rewrites){
+			replace(&rewrite.first, rewrite.second, block);
+			changed = true;
+		}
+	}
+	if (changed){ cfg.commit(); }
+	return changed;
+}
+
+bool reassociate(Procedure * proc){
+	Reassociator reassociator(proc);
+	return reassociator.run();
+}
+
+}
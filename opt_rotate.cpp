@@ -0,0 +1,89 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+//Largest loop test (in quads) worth duplicating
+static const size_t rotateBudget = 8;
+
+//Rotate a top-tested loop (as WhileStmtNode produces it)
+//
+//   H: test; if not c goto E; body; goto H; E:
+//
+// into a guarded bottom-tested one
+//
+//   H: test; if not c goto E; B: body; test; if c goto B; E:
+//
+// so that each iteration takes one conditional branch instead
+// of a conditional and an unconditional one. The test at H
+// becomes the guard, run only on entry. The test is copied to
+// the latch, which is only done when it is small.
+static bool rotate(ControlFlowGraph * cfg, NaturalLoop * loop){
+	BasicBlock * header = loop->getHeader();
+	JmpIfQuad * test = header->getQuads()->back()->asJmpIf();
+	if (test == nullptr || loop->getLatches()->size() != 1){ return false; }
+	BasicBlock * latch = loop->getLatches()->front();
+	if (latch == header || latch->getQuads()->back()->asJmp() == nullptr){
+		return false;
+	}
+	if (header->getSuccs()->size() != 2){ return false; }
+	BasicBlock * body = nullptr;
+	BasicBlock * exit = nullptr;
+	for (auto succ : *header->getSuccs()){
+		if (loop->contains(succ)){ body = succ; }
+		else { exit = succ; }
+	}
+	if (body == nullptr || exit == nullptr){ return false; }
+
+	std::list<Quad *> cond;
+	for (auto quad : *header->getQuads()){
+		if (quad == test || quad->asNop() != nullptr){ continue; }
+		cond.push_back(quad);
+	}
+	if (cond.size() > rotateBudget){ return false; }
+
+	//The copy of the test branches back to the body when the
+	// original would have fallen into (or jumped to) it
+	Label * bodyLabel = cfg->getLabel(body);
+	Label * exitLabel = cfg->getLabel(exit);
+	bool jumpsToBody = false;
+	for (auto label : body->getQuads()->front()->getLabels()){
+		if (label == test->getTarget()){ jumpsToBody = true; }
+	}
+	bool invert = jumpsToBody ? test->isInverted() : !test->isInverted();
+
+	std::list<Quad *> * quads = latch->getQuads();
+	eraseQuad(quads, std::prev(quads->end()));
+	for (auto quad : cond){
+		quads->push_back(quad->clone());
+	}
+	quads->push_back(new JmpIfQuad(test->getCnd(), invert, bodyLabel));
+
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	auto next = std::find(blocks->begin(), blocks->end(), latch) + 1;
+	BasicBlock * layoutNext = next == blocks->end() ? cfg->getExit() : *next;
+	if (layoutNext != exit){
+		quads->push_back(new JmpQuad(exitLabel));
+	}
+	return true;
+}
+
+bool rotateLoops(Procedure * proc){
+	bool changed = false;
+	bool again = true;
+	while (again){
+		again = false;
+		ControlFlowGraph cfg(proc);
+		Dominators doms(&cfg);
+		for (auto loop : findLoops(&cfg, &doms)){
+			if (rotate(&cfg, loop)){
+				cfg.commit();
+				changed = again = true;
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+}
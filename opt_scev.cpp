@@ -0,0 +1,365 @@
+#include "opt.hpp"
+
+namespace lake{
+
+//A chain of recurrences {c0, +, c1, +, c2}: the value
+// c0 + c1 * k + c2 * k * (k - 1) / 2 in iteration k. Each
+// coefficient is an operand that holds the same value
+// throughout the loop. While the recurrence of a variable
+// carried around the loop is being worked out, a chain may
+// also add that variable's value at the start of the
+// iteration (self). A chain without coefficients is unknown.
+struct Chrec{
+	Opd * self;
+	std::vector<Opd *> coeffs;
+};
+
+static Chrec unknown(){
+	return Chrec{nullptr, {}};
+}
+
+static Chrec invariant(Opd * opd){
+	return Chrec{nullptr, {opd}};
+}
+
+//Scalar evolution of a single-block counted loop with no side
+// effects. The body runs straight through on every iteration,
+// so (much as in SSA form) a variable that carries its value
+// around the loop is a recurrence, and one that does not is an
+// expression of the recurrences. Recurrences that add a
+// constant or affine amount each time round are affine or
+// quadratic in the iteration number, and their values once the
+// loop exits follow from the trip count.
+class ScalarEvolution{
+public:
+	ScalarEvolution(Procedure * procIn, Liveness * livenessIn,
+		CountedLoop * loopIn)
+	: proc(procIn), liveness(livenessIn), loop(loopIn){ }
+	//Replace the loop by the final values of the variables
+	// it writes, if they all have closed forms
+	bool replaceLoop();
+private:
+	Opd * emit(BinOp op, Opd * a, Opd * b);
+	Opd * coeff(Chrec & chrec, size_t i);
+	Chrec add(Chrec a, Chrec b, BinOp op);
+	Chrec scale(Chrec a, Opd * factor);
+	Chrec multiply(Chrec a, Chrec b);
+	Chrec shift(Chrec a);
+	Chrec valueOf(Opd * opd);
+	Chrec evaluate(Quad * quad);
+	bool evaluateBody(bool final);
+	Opd * valueAt(Chrec chrec, Opd * iteration);
+	Opd * tripCount();
+
+	Procedure * proc;
+	Liveness * liveness;
+	CountedLoop * loop;
+	//Invariant code that computes the coefficients, run in
+	// place of the loop
+	std::list<Quad *> code;
+	std::map<Opd *, size_t> defCounts;
+	std::set<Opd *> carried;
+	//The recurrence of each carried variable, in terms of its
+	// value at the start of each iteration
+	std::map<Opd *, Chrec> recurrences;
+	//The current value of each variable written in the loop,
+	// while evaluating the body
+	std::map<Opd *, Chrec> current;
+	//The value of each variable not carried around the loop,
+	// the last time it is written
+	std::map<Opd *, Chrec> locals;
+};
+
+static bool isLit(Opd * opd, long int val){
+	return opd->asLit() != nullptr && opd->asLit()->getVal() == val;
+}
+
+//Emit a = b op c for invariant operands, folding what it can
+Opd * ScalarEvolution::emit(BinOp op, Opd * a, Opd * b){
+	LitOpd * litA = a->asLit();
+	LitOpd * litB = b->asLit();
+	if (litA != nullptr && litB != nullptr && op != DIV){
+		unsigned long int x = static_cast<unsigned long int>(litA->getVal());
+		unsigned long int y = static_cast<unsigned long int>(litB->getVal());
+		unsigned long int res = 0;
+		if (op == ADD){ res = x + y; }
+		else if (op == SUB){ res = x - y; }
+		else if (op == MULT){ res = x * y; }
+		else if (op == AND){ res = x != 0 && y != 0; }
+		else if (op == OR){ res = x != 0 || y != 0; }
+		else { res = evalCmp(op, litA->getVal(), litB->getVal()) ? 1 : 0; }
+		return new LitOpd(std::to_string(static_cast<long int>(res)));
+	}
+	if (op == ADD && isLit(a, 0)){ return b; }
+	if ((op == ADD || op == SUB) && isLit(b, 0)){ return a; }
+	if (op == MULT && (isLit(a, 0) || isLit(b, 0))){ return new LitOpd("0"); }
+	if (op == MULT && isLit(a, 1)){ return b; }
+	if (op == MULT && isLit(b, 1)){ return a; }
+	AuxOpd * res = proc->makeTmp();
+	code.push_back(new BinOpQuad(res, op, a, b));
+	return res;
+}
+
+Opd * ScalarEvolution::coeff(Chrec & chrec, size_t i){
+	if (i < chrec.coeffs.size()){ return chrec.coeffs[i]; }
+	return new LitOpd("0");
+}
+
+Chrec ScalarEvolution::add(Chrec a, Chrec b, BinOp op){
+	if (a.coeffs.empty() || b.coeffs.empty()){ return unknown(); }
+	if (b.self != nullptr && (a.self != nullptr || op == SUB)){
+		return unknown();
+	}
+	Chrec res{a.self != nullptr ? a.self : b.self, {}};
+	size_t size = std::max(a.coeffs.size(), b.coeffs.size());
+	for (size_t i = 0 ; i < size ; i++){
+		res.coeffs.push_back(emit(op, coeff(a, i), coeff(b, i)));
+	}
+	return res;
+}
+
+Chrec ScalarEvolution::scale(Chrec a, Opd * factor){
+	if (a.self != nullptr){ return unknown(); }
+	Chrec res{nullptr, {}};
+	for (auto c : a.coeffs){
+		res.coeffs.push_back(emit(MULT, c, factor));
+	}
+	return res;
+}
+
+//(a + b k)(c + d k) = ac + (ad + bc + bd) k + 2bd k(k-1)/2
+Chrec ScalarEvolution::multiply(Chrec a, Chrec b){
+	if (a.coeffs.empty() || b.coeffs.empty()){ return unknown(); }
+	if (a.self != nullptr || b.self != nullptr){ return unknown(); }
+	if (a.coeffs.size() == 1){ return scale(b, a.coeffs[0]); }
+	if (b.coeffs.size() == 1){ return scale(a, b.coeffs[0]); }
+	if (a.coeffs.size() > 2 || b.coeffs.size() > 2){ return unknown(); }
+	Opd * bd = emit(MULT, a.coeffs[1], b.coeffs[1]);
+	Opd * mid = emit(ADD, emit(ADD, emit(MULT, a.coeffs[0], b.coeffs[1]),
+		emit(MULT, a.coeffs[1], b.coeffs[0])), bd);
+	return Chrec{nullptr, {emit(MULT, a.coeffs[0], b.coeffs[0]), mid,
+		emit(ADD, bd, bd)}};
+}
+
+//The chain one iteration later
+Chrec ScalarEvolution::shift(Chrec a){
+	Chrec res{nullptr, {}};
+	std::vector<Opd *> & coeffs = a.coeffs;
+	for (size_t i = 0 ; i < coeffs.size() ; i++){
+		if (i + 1 < coeffs.size()){
+			res.coeffs.push_back(emit(ADD, coeffs[i], coeffs[i + 1]));
+		} else {
+			res.coeffs.push_back(coeffs[i]);
+		}
+	}
+	return res;
+}
+
+Chrec ScalarEvolution::valueOf(Opd * opd){
+	if (!isVar(opd) || defCounts[opd] == 0){ return invariant(opd); }
+	auto found = current.find(opd);
+	if (found != current.end()){ return found->second; }
+	if (carried.count(opd)){ return Chrec{opd, {new LitOpd("0")}}; }
+	return unknown();
+}
+
+Chrec ScalarEvolution::evaluate(Quad * quad){
+	if (AssignQuad * copy = quad->asAssign()){
+		return valueOf(copy->getSrc());
+	}
+	if (UnaryOpQuad * unary = quad->asUnaryOp()){
+		Chrec src = valueOf(unary->getSrc());
+		if (unary->getOp() == NEG){
+			return add(invariant(new LitOpd("0")), src, SUB);
+		}
+		return unknown();
+	}
+	BinOpQuad * bin = quad->asBinOp();
+	if (bin == nullptr){ return unknown(); }
+	Chrec a = valueOf(bin->getSrc1());
+	Chrec b = valueOf(bin->getSrc2());
+	switch (bin->getOp()){
+	case ADD: return add(a, b, ADD);
+	case SUB: return add(a, b, SUB);
+	case MULT: return multiply(a, b);
+	default: break;
+	}
+	//Anything else only has a closed form if it is invariant
+	if (a.self != nullptr || b.self != nullptr || a.coeffs.size() != 1
+		|| b.coeffs.size() != 1 || bin->getOp() == DIV){
+		return unknown();
+	}
+	return invariant(emit(bin->getOp(), a.coeffs[0], b.coeffs[0]));
+}
+
+//Evaluate the body once symbolically. A carried variable whose
+// recurrence is not yet known reads as itself until written,
+// so if the iteration leaves it holding its own value plus an
+// amount that is at most affine, that gives its recurrence.
+// Returns true if a new recurrence was found.
+bool ScalarEvolution::evaluateBody(bool final){
+	current.clear();
+	for (auto rec : recurrences){
+		current[rec.first] = rec.second;
+	}
+	for (auto quad : *loop->getBody()->front()->getQuads()){
+		Opd * dst = quad->getDst();
+		if (!isVar(dst) || quad == loop->getBranch()){ continue; }
+		current[dst] = evaluate(quad);
+		if (final && !carried.count(dst)){ locals[dst] = current[dst]; }
+	}
+	bool found = false;
+	for (auto var : carried){
+		if (recurrences.count(var)){ continue; }
+		Chrec val = current[var];
+		if (val.self != var || val.coeffs.size() > 2){ continue; }
+		Chrec rec{nullptr, {var}};
+		rec.coeffs.insert(rec.coeffs.end(), val.coeffs.begin(),
+			val.coeffs.end());
+		recurrences[var] = rec;
+		found = true;
+	}
+	return found;
+}
+
+//c0 + c1 * k + c2 * k(k-1)/2, with k(k-1)/2 computed as
+// h * (k - 1 + r) for h = k / 2 and r = k - 2h, so that the
+// division is exact
+Opd * ScalarEvolution::valueAt(Chrec chrec, Opd * iteration){
+	std::vector<Opd *> & coeffs = chrec.coeffs;
+	Opd * res = coeffs[0];
+	if (coeffs.size() > 1){
+		res = emit(ADD, res, emit(MULT, coeffs[1], iteration));
+	}
+	if (coeffs.size() > 2){
+		Opd * half = emit(DIV, iteration, new LitOpd("2"));
+		Opd * odd = emit(SUB, iteration, emit(ADD, half, half));
+		Opd * pairs = emit(MULT, half,
+			emit(ADD, emit(SUB, iteration, new LitOpd("1")), odd));
+		res = emit(ADD, res, emit(MULT, coeffs[2], pairs));
+	}
+	return res;
+}
+
+//How many times the body runs. A bottom-tested loop runs once
+// even if its test fails on entry, so the count is
+// ok * (n - 1) + 1, where ok is the test on entry and n counts
+// the steps of the counter needed to fail the test. A counter
+// that would wrap before failing the test runs for more than
+// 2^62 iterations, which is taken never to happen; the same
+// goes for counts that do not fit in a signed word.
+Opd * ScalarEvolution::tripCount(){
+	Opd * counter = loop->getCounter();
+	Opd * bound = loop->getBound();
+	long int step = loop->getStep();
+	BinOp cmp = loop->getCmp();
+	unsigned long int magnitude = static_cast<unsigned long int>(
+		step > 0 ? step : -step);
+	Opd * distance;
+	if (step > 0 && (cmp == LT || cmp == LTE)){
+		distance = emit(SUB, bound, counter);
+	} else if (step < 0 && (cmp == GT || cmp == GTE)){
+		distance = emit(SUB, counter, bound);
+	} else if (cmp == NEQ && magnitude == 1){
+		distance = step > 0 ? emit(SUB, bound, counter)
+			: emit(SUB, counter, bound);
+	} else {
+		return nullptr;
+	}
+	if (cmp == LTE || cmp == GTE){
+		distance = emit(ADD, distance, new LitOpd("1"));
+	}
+	Opd * steps = distance;
+	if (magnitude != 1){
+		std::string up = std::to_string(magnitude - 1);
+		steps = emit(DIV, emit(ADD, distance, new LitOpd(up)),
+			new LitOpd(std::to_string(magnitude)));
+	}
+	Opd * ok = emit(cmp, counter, bound);
+	Opd * extra = emit(MULT, ok, emit(SUB, steps, new LitOpd("1")));
+	return emit(ADD, extra, new LitOpd("1"));
+}
+
+bool ScalarEvolution::replaceLoop(){
+	BasicBlock * block = loop->getBody()->front();
+	if (loop->getBody()->size() != 1){ return false; }
+	std::set<Opd *> * liveIn = liveness->getLiveIn(block);
+	for (auto quad : *block->getQuads()){
+		if (quad == loop->getBranch() || quad->asNop() != nullptr){ continue; }
+		if (quad->asBinOp() == nullptr && quad->asUnaryOp() == nullptr
+			&& quad->asAssign() == nullptr){
+			return false;
+		}
+		if (mayFault(quad)){ return false; }
+		Opd * dst = quad->getDst();
+		if (!isVar(dst)){ return false; }
+		defCounts[dst]++;
+		if (liveIn->count(dst)){ carried.insert(dst); }
+	}
+
+	Opd * trips = tripCount();
+	if (trips == nullptr){ return false; }
+	while (evaluateBody(false)){ }
+	evaluateBody(true);
+
+	//Work out every final value before assigning any of them,
+	// since they are computed from the values on entry
+	std::list<std::pair<Opd *, Opd *>> finals;
+	Opd * last = nullptr;
+	for (auto var : *liveness->getLiveIn(loop->getExit())){
+		if (!defCounts.count(var)){ continue; }
+		Opd * val;
+		if (carried.count(var)){
+			auto rec = recurrences.find(var);
+			if (rec == recurrences.end()){ return false; }
+			val = valueAt(rec->second, trips);
+		} else {
+			Chrec chrec = locals[var];
+			if (chrec.self != nullptr || chrec.coeffs.empty()){ return false; }
+			if (last == nullptr){ last = emit(SUB, trips, new LitOpd("1")); }
+			val = valueAt(chrec, last);
+		}
+		if (val->asLit() == nullptr && val != var && isVar(val)
+			&& defCounts.count(val)){
+			//Keep the entry value of another loop variable
+			AuxOpd * tmp = proc->makeTmp();
+			code.push_back(new AssignQuad(tmp, val));
+			val = tmp;
+		}
+		finals.push_back(std::make_pair(var, val));
+	}
+	for (auto final : finals){
+		code.push_back(new AssignQuad(final.first, final.second));
+	}
+	if (code.empty()){ code.push_back(new NopQuad()); }
+
+	std::list<Quad *> * quads = block->getQuads();
+	quads->front()->moveLabelsTo(code.front());
+	quads->clear();
+	quads->splice(quads->end(), code);
+	return true;
+}
+
+bool replaceFinalValues(Procedure * proc){
+	bool changed = false;
+	bool again = true;
+	while (again){
+		again = false;
+		ControlFlowGraph cfg(proc);
+		Dominators doms(&cfg);
+		Liveness liveness(&cfg);
+		for (auto loop : findLoops(&cfg, &doms)){
+			CountedLoop * counted = CountedLoop::analyze(&cfg, loop);
+			if (counted == nullptr){ continue; }
+			ScalarEvolution scev(proc, &liveness, counted);
+			if (scev.replaceLoop()){
+				cfg.commit();
+				changed = again = true;
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+}
@@ -0,0 +1,562 @@
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <sstream>
+#include "opt.hpp"
+
+namespace lake{
+
+//The rewrite rules of the algebraic simplifier, one per line:
+//
+//   pattern => replacement [if guard]
+//
+// A pattern is a binary or unary expression over lowercase
+// variables (which bind any operand, and must bind the same
+// operand each time they appear), integer literals (which
+// match only that literal, so true is 1 and false is 0) and
+// parenthesized subexpressions (which match an operand whose
+// single definition has that shape). The replacement is an
+// operand or an expression over the bound variables. A
+// commutative operator also matches with its operands swapped.
+// The only guard is "bool v", which holds when v is known to
+// be 0 or 1. AND and OR are logical, so they always give 0 or 1,
+// but NOT only flips the low bit, and a bool variable may hold
+// anything READ gave it.
+static const char * rewriteRules[] = {
+	"x ADD 0 => x",
+	"x SUB 0 => x",
+	"x SUB x => 0",
+	"0 SUB x => NEG x",
+	"x MULT 1 => x",
+	"x MULT 0 => 0",
+	"x MULT -1 => NEG x",
+	"x DIV 1 => x",
+	"x DIV -1 => NEG x",
+	"x AND 1 => x if bool x",
+	"x AND 0 => 0",
+	"x AND x => x if bool x",
+	"x OR 0 => x if bool x",
+	"x OR 1 => 1",
+	"x OR x => x if bool x",
+	"x EQ x => 1",
+	"x NEQ x => 0",
+	"x LT x => 0",
+	"x GT x => 0",
+	"x LTE x => 1",
+	"x GTE x => 1",
+	"x EQ 1 => x if bool x",
+	"x NEQ 0 => x if bool x",
+	"x EQ 0 => NOT x if bool x",
+	"x NEQ 1 => NOT x if bool x",
+	"NOT (NOT x) => x",
+	"NEG (NEG x) => x",
+	"NOT (x LT y) => x GTE y",
+	"NOT (x LTE y) => x GT y",
+	"NOT (x GT y) => x LTE y",
+	"NOT (x GTE y) => x LT y",
+	"NOT (x EQ y) => x NEQ y",
+	"NOT (x NEQ y) => x EQ y",
+};
+
+//One side of a rule: a variable, a literal or an expression
+struct RuleTerm{
+	enum Kind { VAR, LIT, EXP } kind;
+	std::string var;
+	long int lit;
+	bool unary;
+	int op;
+	RuleTerm * left;
+	RuleTerm * right;
+};
+
+struct RewriteRule{
+	RuleTerm * pattern;
+	RuleTerm * replacement;
+	std::string boolGuard;
+};
+
+static bool parseBinOp(const std::string & name, BinOp * op){
+	static const std::map<std::string, BinOp> ops = {
+		{"ADD", ADD}, {"SUB", SUB}, {"DIV", DIV}, {"MULT", MULT},
+		{"OR", OR}, {"AND", AND}, {"EQ", EQ}, {"NEQ", NEQ},
+		{"LT", LT}, {"GT", GT}, {"LTE", LTE}, {"GTE", GTE},
+	};
+	auto found = ops.find(name);
+	if (found == ops.end()){ return false; }
+	*op = found->second;
+	return true;
+}
+
+static bool parseUnaryOp(const std::string & name, UnaryOp * op){
+	if (name == "NEG"){ *op = NEG; return true; }
+	if (name == "NOT"){ *op = NOT; return true; }
+	return false;
+}
+
+static bool isCommutative(int op){
+	return op == ADD || op == MULT || op == AND || op == OR
+		|| op == EQ || op == NEQ;
+}
+
+//A small recursive-descent parser for the rule language
+class RuleParser{
+public:
+	RuleParser(const std::string & text) : rule(text){
+		std::string spaced;
+		for (char c : text){
+			if (c == '(' || c == ')'){
+				spaced += std::string(" ") + c + " ";
+			} else {
+				spaced += c;
+			}
+		}
+		std::istringstream in(spaced);
+		std::string tok;
+		while (in >> tok){ toks.push_back(tok); }
+	}
+	RewriteRule parse(){
+		RewriteRule res;
+		res.pattern = parseExp();
+		expect("=>");
+		res.replacement = parseExp();
+		if (pos < toks.size()){
+			expect("if");
+			expect("bool");
+			res.boolGuard = next();
+		}
+		if (pos != toks.size() || res.pattern->kind != RuleTerm::EXP){
+			fail();
+		}
+		std::set<std::string> bound;
+		collectVars(res.pattern, &bound);
+		std::set<std::string> used;
+		collectVars(res.replacement, &used);
+		if (!res.boolGuard.empty()){ used.insert(res.boolGuard); }
+		for (auto var : used){
+			if (!bound.count(var)){ fail(); }
+		}
+		return res;
+	}
+private:
+	[[noreturn]] void fail(){
+		std::string msg = "Bad rewrite rule: " + rule;
+		throw new InternalError(msg.c_str());
+	}
+	void collectVars(RuleTerm * term, std::set<std::string> * vars){
+		if (term == nullptr){ return; }
+		if (term->kind == RuleTerm::VAR){ vars->insert(term->var); }
+		collectVars(term->left, vars);
+		collectVars(term->right, vars);
+	}
+	std::string next(){
+		if (pos >= toks.size()){ fail(); }
+		return toks[pos++];
+	}
+	void expect(const std::string & tok){
+		if (next() != tok){ fail(); }
+	}
+	RuleTerm * parseExp(){
+		UnaryOp unary;
+		if (pos < toks.size() && parseUnaryOp(toks[pos], &unary)){
+			pos++;
+			return new RuleTerm{RuleTerm::EXP, "", 0, true,
+				static_cast<int>(unary), parseAtom(), nullptr};
+		}
+		RuleTerm * left = parseAtom();
+		BinOp bin;
+		if (pos < toks.size() && parseBinOp(toks[pos], &bin)){
+			pos++;
+			return new RuleTerm{RuleTerm::EXP, "", 0, false,
+				static_cast<int>(bin), left, parseAtom()};
+		}
+		return left;
+	}
+	RuleTerm * parseAtom(){
+		std::string tok = next();
+		if (tok == "("){
+			RuleTerm * res = parseExp();
+			expect(")");
+			return res;
+		}
+		if (std::islower(tok[0])){
+			return new RuleTerm{RuleTerm::VAR, tok, 0, false, 0,
+				nullptr, nullptr};
+		}
+		try {
+			return new RuleTerm{RuleTerm::LIT, "", std::stol(tok), false, 0,
+				nullptr, nullptr};
+		} catch (std::exception &){
+			fail();
+		}
+	}
+
+	std::string rule;
+	std::vector<std::string> toks;
+	size_t pos = 0;
+};
+
+static std::vector<RewriteRule> * getRules(){
+	static std::vector<RewriteRule> * rules = nullptr;
+	if (rules == nullptr){
+		rules = new std::vector<RewriteRule>();
+		for (auto text : rewriteRules){
+			rules->push_back(RuleParser(text).parse());
+		}
+	}
+	return rules;
+}
+
+static bool litValue(Opd * opd, long int * val){
+	LitOpd * lit = opd->asLit();
+	if (lit == nullptr){ return false; }
+	*val = lit->getVal();
+	return true;
+}
+
+bool foldBinOp(BinOp op, long int a, long int b, long int * res){
+	unsigned long int ua = static_cast<unsigned long int>(a);
+	unsigned long int ub = static_cast<unsigned long int>(b);
+	switch (op){
+	case ADD: *res = static_cast<long int>(ua + ub); return true;
+	case SUB: *res = static_cast<long int>(ua - ub); return true;
+	case MULT: *res = static_cast<long int>(ua * ub); return true;
+	case DIV:
+		if (b == 0 || (b == -1 && a == LONG_MIN)){ return false; }
+		*res = a / b;
+		return true;
+	case AND: *res = a != 0 && b != 0; return true;
+	case OR: *res = a != 0 || b != 0; return true;
+	case EQ: *res = a == b; return true;
+	case NEQ: *res = a != b; return true;
+	case LT: *res = a < b; return true;
+	case GT: *res = a > b; return true;
+	case LTE: *res = a <= b; return true;
+	case GTE: *res = a >= b; return true;
+	}
+	return false;
+}
+
+long int foldUnaryOp(UnaryOp op, long int a){
+	if (op == NEG){
+		return static_cast<long int>(0 - static_cast<unsigned long int>(a));
+	}
+	return a ^ 1;
+}
+
+//Instcombine-style simplification of BinOpQuads and
+// UnaryOpQuads. Constant operands are folded, and every other
+// quad is matched against the rule table. A rewritten quad and
+// the readers of the temp it defines go back on the worklist,
+// so the pass reaches a fixpoint touching each quad a bounded
+// number of times. Subexpression patterns only look through
+// temps with a single definition, and an operand taken from
+// that definition must still hold the same value at the quad
+// being rewritten. Each quad keeps its place in its block and
+// its index there, and the index of every definition is listed
+// per block and variable, so that neither a rewrite nor a
+// stability test has to walk the block.
+class Simplifier{
+public:
+	Simplifier(Procedure * procIn) : proc(procIn), cfg(procIn){ }
+	bool run();
+private:
+	typedef std::map<std::string, Opd *> Bindings;
+
+	bool match(RuleTerm * pattern, Opd * opd, Quad * user,
+		Bindings * binds);
+	bool matchQuad(RuleTerm * pattern, Quad * quad, Quad * user,
+		Bindings * binds);
+	bool bind(const std::string & var, Opd * opd, Quad * from,
+		Quad * user, Bindings * binds);
+	bool sameOpd(Opd * a, Opd * b);
+	bool isStable(Opd * opd, Quad * from, Quad * to);
+	bool isBool(Opd * opd);
+	Quad * definition(Opd * opd);
+	Opd * build(RuleTerm * term, Bindings * binds);
+	Quad * rewrite(Quad * quad);
+	Quad * fold(Quad * quad);
+	void replace(Quad * oldQuad, Quad * newQuad);
+
+	Procedure * proc;
+	ControlFlowGraph cfg;
+	std::map<Quad *, BasicBlock *> blockOf;
+	std::map<Quad *, std::list<Quad *>::iterator> placeOf;
+	std::map<Quad *, size_t> indexOf;
+	std::map<std::pair<BasicBlock *, Opd *>, std::vector<size_t>> defIndices;
+	std::map<Opd *, size_t> defCounts;
+	std::map<Opd *, Quad *> defs;
+	std::map<Opd *, std::set<Quad *>> users;
+	std::set<Opd *> boolVars;
+	std::list<Quad *> work;
+	std::set<Quad *> queued;
+};
+
+Quad * Simplifier::definition(Opd * opd){
+	if (!isVar(opd) || opd->asSym() != nullptr){ return nullptr; }
+	if (defCounts[opd] != 1){ return nullptr; }
+	return defs[opd];
+}
+
+bool Simplifier::sameOpd(Opd * a, Opd * b){
+	if (a == b){ return true; }
+	long int aVal, bVal;
+	return litValue(a, &aVal) && litValue(b, &bVal) && aVal == bVal;
+}
+
+//Whether opd, as read by from, holds the same value when to
+// executes: from comes first in the same block, and neither it
+// nor anything between them may define opd
+bool Simplifier::isStable(Opd * opd, Quad * from, Quad * to){
+	if (!isVar(opd) || definition(opd) != nullptr){ return true; }
+	BasicBlock * block = blockOf[from];
+	if (block != blockOf[to]){ return false; }
+	size_t first = indexOf[from];
+	size_t last = indexOf[to];
+	if (first >= last){ return false; }
+	auto found = defIndices.find(std::make_pair(block, opd));
+	if (found == defIndices.end()){ return true; }
+	const std::vector<size_t> & indices = found->second;
+	auto def = std::lower_bound(indices.begin(), indices.end(), first);
+	return def == indices.end() || *def >= last;
+}
+
+//Whether quad gives its destination a value of 0 or 1
+static bool definesBool(Quad * quad){
+	if (BinOpQuad * bin = quad->asBinOp()){
+		BinOp op = bin->getOp();
+		return op != ADD && op != SUB && op != MULT && op != DIV;
+	}
+	if (AssignQuad * assign = quad->asAssign()){
+		long int val;
+		return litValue(assign->getSrc(), &val) && (val == 0 || val == 1);
+	}
+	return false;
+}
+
+//Whether opd is 0 or 1. The type of a variable does not tell,
+// since READ into a bool stores whatever was read, so every
+// definition of it in the procedure has to.
+bool Simplifier::isBool(Opd * opd){
+	long int val;
+	if (litValue(opd, &val)){ return val == 0 || val == 1; }
+	return boolVars.count(opd) > 0;
+}
+
+bool Simplifier::bind(const std::string & var, Opd * opd, Quad * from,
+	Quad * user, Bindings * binds){
+	if (from != user && !isStable(opd, from, user)){ return false; }
+	auto found = binds->find(var);
+	if (found != binds->end()){ return sameOpd(found->second, opd); }
+	(*binds)[var] = opd;
+	return true;
+}
+
+//Match an operand read by user against pattern
+bool Simplifier::match(RuleTerm * pattern, Opd * opd, Quad * user,
+	Bindings * binds){
+	if (pattern->kind == RuleTerm::LIT){
+		long int val;
+		return litValue(opd, &val) && val == pattern->lit;
+	}
+	if (pattern->kind == RuleTerm::VAR){
+		return bind(pattern->var, opd, user, user, binds);
+	}
+	Quad * def = definition(opd);
+	return def != nullptr && matchQuad(pattern, def, user, binds);
+}
+
+//Match the expression computed by quad against pattern, for
+// use by user
+bool Simplifier::matchQuad(RuleTerm * pattern, Quad * quad, Quad * user,
+	Bindings * binds){
+	auto matchOpd = [&](RuleTerm * term, Opd * opd){
+		if (term->kind == RuleTerm::VAR){
+			return bind(term->var, opd, quad, user, binds);
+		}
+		return match(term, opd, user, binds);
+	};
+	if (pattern->unary){
+		UnaryOpQuad * unary = quad->asUnaryOp();
+		return unary != nullptr && unary->getOp() == pattern->op
+			&& matchOpd(pattern->left, unary->getSrc());
+	}
+	BinOpQuad * bin = quad->asBinOp();
+	if (bin == nullptr || bin->getOp() != pattern->op){ return false; }
+	Bindings saved = *binds;
+	if (matchOpd(pattern->left, bin->getSrc1())
+		&& matchOpd(pattern->right, bin->getSrc2())){
+		return true;
+	}
+	if (!isCommutative(pattern->op)){ return false; }
+	*binds = saved;
+	return matchOpd(pattern->left, bin->getSrc2())
+		&& matchOpd(pattern->right, bin->getSrc1());
+}
+
+//The operand a replacement term stands for. Only called for
+// variables and literals.
+Opd * Simplifier::build(RuleTerm * term, Bindings * binds){
+	if (term->kind == RuleTerm::LIT){
+		return new LitOpd(std::to_string(term->lit));
+	}
+	return (*binds)[term->var];
+}
+
+Quad * Simplifier::fold(Quad * quad){
+	long int a, b;
+	if (BinOpQuad * bin = quad->asBinOp()){
+		long int res;
+		if (litValue(bin->getSrc1(), &a) && litValue(bin->getSrc2(), &b)
+			&& foldBinOp(bin->getOp(), a, b, &res)){
+			return new AssignQuad(bin->getDst(),
+				new LitOpd(std::to_string(res)));
+		}
+	} else if (UnaryOpQuad * unary = quad->asUnaryOp()){
+		if (litValue(unary->getSrc(), &a)){
+			return new AssignQuad(unary->getDst(),
+				new LitOpd(std::to_string(foldUnaryOp(unary->getOp(), a))));
+		}
+	}
+	return nullptr;
+}
+
+Quad * Simplifier::rewrite(Quad * quad){
+	Quad * folded = fold(quad);
+	if (folded != nullptr){ return folded; }
+	for (auto & rule : *getRules()){
+		Bindings binds;
+		if (!matchQuad(rule.pattern, quad, quad, &binds)){ continue; }
+		if (!rule.boolGuard.empty() && !isBool(binds[rule.boolGuard])){
+			continue;
+		}
+		RuleTerm * rep = rule.replacement;
+		Opd * dst = quad->getDst();
+		if (rep->kind != RuleTerm::EXP){
+			return new AssignQuad(dst, build(rep, &binds));
+		}
+		if (rep->unary){
+			return new UnaryOpQuad(dst, static_cast<UnaryOp>(rep->op),
+				build(rep->left, &binds));
+		}
+		return new BinOpQuad(dst, static_cast<BinOp>(rep->op),
+			build(rep->left, &binds), build(rep->right, &binds));
+	}
+	return nullptr;
+}
+
+void Simplifier::replace(Quad * oldQuad, Quad * newQuad){
+	auto place = placeOf[oldQuad];
+	*place = newQuad;
+	oldQuad->moveLabelsTo(newQuad);
+	blockOf[newQuad] = blockOf[oldQuad];
+	placeOf[newQuad] = place;
+	indexOf[newQuad] = indexOf[oldQuad];
+	Opd * dst = newQuad->getDst();
+	if (defs[dst] == oldQuad){ defs[dst] = newQuad; }
+	for (auto src : newQuad->getSrcs()){
+		users[src].insert(newQuad);
+	}
+	std::list<Quad *> again = {newQuad};
+	again.insert(again.end(), users[dst].begin(), users[dst].end());
+	for (auto quad : again){
+		if (queued.insert(quad).second){ work.push_back(quad); }
+	}
+}
+
+bool Simplifier::run(){
+	//Globals may be set elsewhere, or start out as anything
+	std::set<Opd *> notBool;
+	for (auto global : proc->getProg()->getGlobals()){
+		notBool.insert(global);
+	}
+	for (auto block : *cfg.getBlocks()){
+		std::list<Quad *> * quads = block->getQuads();
+		size_t index = 0;
+		for (auto itr = quads->begin() ; itr != quads->end() ; ++itr, ++index){
+			Quad * quad = *itr;
+			blockOf[quad] = block;
+			placeOf[quad] = itr;
+			indexOf[quad] = index;
+			Opd * dst = quad->getDst();
+			if (isVar(dst)){
+				defCounts[dst]++;
+				defs[dst] = quad;
+			}
+			for (auto def : quadMayDefs(proc, quad)){
+				defIndices[std::make_pair(block, def)].push_back(index);
+				if (def == dst && definesBool(quad)){
+					boolVars.insert(def);
+				} else {
+					notBool.insert(def);
+				}
+			}
+			for (auto src : quad->getSrcs()){
+				users[src].insert(quad);
+			}
+			if (quad->asBinOp() != nullptr || quad->asUnaryOp() != nullptr){
+				work.push_back(quad);
+				queued.insert(quad);
+			}
+		}
+	}
+	for (auto opd : notBool){ boolVars.erase(opd); }
+
+	bool changed = false;
+	std::set<Quad *> replaced;
+	while (!work.empty()){
+		Quad * quad = work.front();
+		work.pop_front();
+		queued.erase(quad);
+		if (replaced.count(quad)){ continue; }
+		Quad * newQuad = rewrite(quad);
+		if (newQuad == nullptr){ continue; }
+		replaced.insert(quad);
+		replace(quad, newQuad);
+		changed = true;
+	}
+
+	//A branch on a negation branches the other way on the
+	// negated value instead, if that is 0 or 1
+	for (auto block : *cfg.getBlocks()){
+		JmpIfQuad * branch = block->getQuads()->back()->asJmpIf();
+		if (branch == nullptr){ continue; }
+		Quad * def = definition(branch->getCnd());
+		if (def == nullptr || def->asUnaryOp() == nullptr
+			|| def->asUnaryOp()->getOp() != NOT){
+			continue;
+		}
+		Opd * negated = def->asUnaryOp()->getSrc();
+		if (!isBool(negated) || !isStable(negated, def, branch)){ continue; }
+		branch->replaceSrc(branch->getCnd(), negated);
+		branch->setInverted(!branch->isInverted());
+		changed = true;
+	}
+
+	//A branch on a constant always goes the same way
+	for (auto block : *cfg.getBlocks()){
+		JmpIfQuad * branch = block->getQuads()->back()->asJmpIf();
+		if (branch == nullptr || branch->getCnd()->asLit() == nullptr){
+			continue;
+		}
+		bool cnd = branch->getCnd()->asLit()->getVal() != 0;
+		Quad * res;
+		if (cnd == branch->isInverted()){
+			res = new JmpQuad(branch->getTarget());
+		} else {
+			res = new NopQuad();
+		}
+		branch->moveLabelsTo(res);
+		block->getQuads()->back() = res;
+		changed = true;
+	}
+
+	cfg.commit();
+	return changed;
+}
+
+bool simplifyAlgebra(Procedure * proc){
+	Simplifier simplifier(proc);
+	return simplifier.run();
+}
+
+}
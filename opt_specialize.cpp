@@ -0,0 +1,233 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+Procedure * Procedure::clone(std::string name){
+	Procedure * res = myProg->makeProc(name);
+	std::map<Opd *, Opd *> renamed;
+	for (auto formal : formals){
+		SymOpd * dup = new SymOpd(*formal);
+		res->formals.push_back(dup);
+		renamed[formal] = dup;
+	}
+	for (auto local : locals){
+		SymOpd * dup = new SymOpd(*local.second);
+		res->locals[local.first] = dup;
+		renamed[local.second] = dup;
+	}
+	for (auto tmp : temps){
+		AuxOpd * dup = new AuxOpd(*tmp);
+		res->temps.push_back(dup);
+		renamed[tmp] = dup;
+	}
+	res->maxTmp = maxTmp;
+	auto rename = [&](Opd * opd){
+		auto found = renamed.find(opd);
+		return found == renamed.end() ? opd : found->second;
+	};
+
+	std::map<Label *, Label *> labels;
+	labels[leaveLabel] = res->leaveLabel;
+	for (auto quad : bodyQuads){
+		Quad * dup;
+		if (GetInQuad * getIn = quad->asGetIn()){
+			dup = new GetInQuad(getIn->getIndex(), rename(getIn->getOpd()));
+		} else {
+			dup = quad->clone();
+			Opd * dst = dup->getDst();
+			if (dst != nullptr && rename(dst) != dst){ dup->setDst(rename(dst)); }
+			for (auto src : quad->getSrcs()){
+				if (rename(src) != src){ dup->replaceSrc(src, rename(src)); }
+			}
+		}
+		for (auto label : quad->getLabels()){
+			Label * fresh = makeLabel();
+			labels[label] = fresh;
+			dup->addLabel(fresh);
+		}
+		res->bodyQuads.push_back(dup);
+	}
+	for (auto quad : res->bodyQuads){
+		auto found = labels.find(quad->getTarget());
+		if (found == labels.end()){ continue; }
+		if (JmpQuad * jmp = quad->asJmp()){ jmp->setTarget(found->second); }
+		if (JmpIfQuad * jmpIf = quad->asJmpIf()){
+			jmpIf->setTarget(found->second);
+		}
+	}
+	return res;
+}
+
+//A call and what it passes for each argument
+struct CallSite{
+	Procedure * caller;
+	CallQuad * call;
+	std::vector<Opd *> args;
+};
+
+//The formal each getin reads into, by argument index
+static std::vector<Opd *> formalsByIndex(Procedure * proc){
+	std::vector<Opd *> res(proc->getFormals()->size() + 1, nullptr);
+	for (auto quad : *proc->getQuads()){
+		GetInQuad * getIn = quad->asGetIn();
+		if (getIn != nullptr && getIn->getIndex() < res.size()){
+			res[getIn->getIndex()] = getIn->getOpd();
+		}
+	}
+	return res;
+}
+
+//Give formals the constants they are known to hold, right
+// after the getins
+static void bindFormals(Procedure * proc, std::vector<LitOpd *> * vals){
+	std::list<Quad *> * quads = proc->getQuads();
+	auto pos = quads->begin();
+	while (pos != quads->end() && (*pos)->asGetIn() != nullptr){ ++pos; }
+	std::vector<Opd *> formals = formalsByIndex(proc);
+	for (size_t i = 1 ; i < vals->size() ; i++){
+		if ((*vals)[i] == nullptr || formals[i] == nullptr){ continue; }
+		quads->insert(pos, new AssignQuad(formals[i], (*vals)[i]));
+	}
+}
+
+//Whether anything but its getin writes formal in proc
+static bool isReassigned(Procedure * proc, Opd * formal){
+	for (auto quad : *proc->getQuads()){
+		if (quad->asGetIn() == nullptr && quadMayDefs(proc, quad).count(formal)){
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool sameLit(LitOpd * a, LitOpd * b){
+	if (a == nullptr || b == nullptr){ return a == b; }
+	return a->getVal() == b->getVal();
+}
+
+//Interprocedural constant propagation. A formal that every call
+// passes the same constant for (or, in a call the procedure
+// makes to itself, passes the formal's own value, which it
+// never assigns) holds that constant throughout. Calls that pass constants for other
+// formals get a copy of the callee specialized to them, as long
+// as the callee is small: calls passing the same constants share
+// a copy, and the copies serving the most calls are made first.
+// Either way the constants are copied into the formals on entry,
+// where the rest of the optimizer folds them.
+bool specializeProcs(IRProgram * prog, OptOptions * opts){
+	CallGraph calls(prog);
+	std::map<Procedure *, std::list<CallSite>> sites;
+	std::set<Procedure *> unknown;
+	for (auto proc : *prog->getProcs()){
+		std::list<Quad *> * quads = proc->getQuads();
+		for (auto itr = quads->begin() ; itr != quads->end() ; ++itr){
+			CallQuad * call = (*itr)->asCall();
+			Procedure * callee = call == nullptr ? nullptr : calls.getProc(call);
+			if (callee == nullptr){ continue; }
+			size_t numArgs = callee->getFormals()->size();
+			std::vector<std::list<Quad *>::iterator> setIns;
+			if (!findSetIns(quads, itr, numArgs, &setIns)){
+				unknown.insert(callee);
+				continue;
+			}
+			CallSite site{proc, call, std::vector<Opd *>(numArgs + 1, nullptr)};
+			for (size_t i = 1 ; i <= numArgs ; i++){
+				site.args[i] = (*setIns[i])->asSetIn()->getOpd();
+			}
+			sites[callee].push_back(site);
+		}
+	}
+
+	bool changed = false;
+	std::list<Procedure *> procs = *prog->getProcs();
+	for (auto callee : procs){
+		std::list<CallSite> * calleeSites = &sites[callee];
+		if (callee->getName() == "main" || calleeSites->empty()){ continue; }
+		size_t numArgs = callee->getFormals()->size();
+		std::vector<Opd *> formals = formalsByIndex(callee);
+
+		//Formals that hold the same constant on every call
+		std::vector<LitOpd *> always(numArgs + 1, nullptr);
+		if (!unknown.count(callee)){
+			for (size_t i = 1 ; i <= numArgs ; i++){
+				bool same = true;
+				bool fixed = formals[i] != nullptr
+					&& !isReassigned(callee, formals[i]);
+				for (auto site : *calleeSites){
+					//A formal the procedure never assigns, passed
+					// straight back to it, still holds what it did
+					if (fixed && site.caller == callee
+						&& site.args[i] == formals[i]){
+						continue;
+					}
+					LitOpd * arg = site.args[i]->asLit();
+					if (arg == nullptr){
+						same = false;
+						break;
+					}
+					if (always[i] == nullptr){ always[i] = arg; }
+					else if (!sameLit(always[i], arg)){ same = false; break; }
+				}
+				if (!same){ always[i] = nullptr; }
+			}
+			if (std::any_of(always.begin(), always.end(),
+				[](LitOpd * lit){ return lit != nullptr; })){
+				bindFormals(callee, &always);
+				changed = true;
+			}
+		}
+
+		//Group the remaining constants by the calls passing them
+		size_t size = 0;
+		for (auto quad : *callee->getQuads()){
+			if (quad->asNop() == nullptr){ size++; }
+		}
+		if (opts->specializeCopies == 0 || size > opts->specializeBudget){
+			continue;
+		}
+		std::map<std::vector<long int>, std::list<CallSite>> groups;
+		std::map<std::vector<long int>, std::vector<LitOpd *>> groupArgs;
+		for (auto site : *calleeSites){
+			std::vector<long int> key;
+			std::vector<LitOpd *> args(numArgs + 1, nullptr);
+			for (size_t i = 1 ; i <= numArgs ; i++){
+				LitOpd * arg = site.args[i]->asLit();
+				if (arg == nullptr || always[i] != nullptr){ continue; }
+				key.push_back(static_cast<long int>(i));
+				key.push_back(arg->getVal());
+				args[i] = arg;
+			}
+			if (key.empty()){ continue; }
+			groups[key].push_back(site);
+			groupArgs[key] = args;
+		}
+		std::vector<std::vector<long int>> order;
+		for (auto group : groups){ order.push_back(group.first); }
+		std::stable_sort(order.begin(), order.end(),
+			[&](const std::vector<long int>& a, const std::vector<long int>& b){
+				return groups[a].size() > groups[b].size();
+			});
+		if (order.size() > opts->specializeCopies){
+			order.resize(opts->specializeCopies);
+		}
+
+		size_t copies = 0;
+		for (auto key : order){
+			std::string name = callee->getName() + "." + std::to_string(++copies);
+			Procedure * copy = callee->clone(name);
+			bindFormals(copy, &groupArgs[key]);
+			SemSymbol * sym = groups[key].front().call->getCallee();
+			SemSymbol * copySym = new SemSymbol(FN, sym->getType(), name);
+			for (auto site : groups[key]){
+				std::list<Quad *> * quads = site.caller->getQuads();
+				auto pos = std::find(quads->begin(), quads->end(), site.call);
+				*pos = new CallQuad(copySym);
+			}
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+}
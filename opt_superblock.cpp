@@ -0,0 +1,246 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+//The edges out of each block, kept apart from the quads while
+// blocks are copied and moved: the block a jump at its end
+// goes to, and the block it falls into
+struct Edges{
+	std::map<BasicBlock *, BasicBlock *> jumpsTo;
+	std::map<BasicBlock *, BasicBlock *> fallsTo;
+};
+
+static Edges findEdges(ControlFlowGraph * cfg){
+	Edges res;
+	std::map<Label *, BasicBlock *> labelBlocks;
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	for (auto block : *blocks){
+		for (auto label : block->getQuads()->front()->getLabels()){
+			labelBlocks[label] = block;
+		}
+	}
+	labelBlocks[cfg->getProc()->getLeaveLabel()] = cfg->getExit();
+	for (size_t i = 0 ; i < blocks->size() ; i++){
+		BasicBlock * block = (*blocks)[i];
+		Quad * last = block->getQuads()->back();
+		if (last->getTarget() != nullptr){
+			res.jumpsTo[block] = labelBlocks[last->getTarget()];
+		}
+		if (last->fallsThrough()){
+			res.fallsTo[block] = i + 1 < blocks->size() ? (*blocks)[i + 1]
+				: cfg->getExit();
+		}
+	}
+	return res;
+}
+
+static bool doesIO(BasicBlock * block){
+	for (auto quad : *block->getQuads()){
+		if (quad->asCall() != nullptr || quad->asSyscall() != nullptr){
+			return true;
+		}
+	}
+	return false;
+}
+
+//Guess which way the branch ending block goes, by the static
+// heuristics of Ball and Larus: a loop goes round again rather
+// than leave, a test for equality or for a negative number is
+// false, and a path that calls or does I/O is not taken. With
+// nothing to go on, the branch falls through.
+static BasicBlock * likelySucc(NaturalLoop * loop, BasicBlock * block,
+	Edges * edges){
+	BasicBlock * jumps = edges->jumpsTo[block];
+	BasicBlock * falls = edges->fallsTo[block];
+	if (loop->contains(jumps) != loop->contains(falls)){
+		return loop->contains(jumps) ? jumps : falls;
+	}
+	if (jumps == loop->getHeader() || falls == loop->getHeader()){
+		return loop->getHeader();
+	}
+
+	JmpIfQuad * branch = block->getQuads()->back()->asJmpIf();
+	BasicBlock * ifTrue = branch->isInverted() ? jumps : falls;
+	BasicBlock * ifFalse = branch->isInverted() ? falls : jumps;
+	BinOpQuad * test = nullptr;
+	for (auto quad : *block->getQuads()){
+		if (quad->getDst() == branch->getCnd()){ test = quad->asBinOp(); }
+	}
+	if (test != nullptr){
+		LitOpd * left = test->getSrc1()->asLit();
+		LitOpd * right = test->getSrc2()->asLit();
+		bool rightZero = right != nullptr && right->getVal() == 0;
+		bool leftZero = left != nullptr && left->getVal() == 0;
+		switch (test->getOp()){
+		case EQ: return ifFalse;
+		case NEQ: return ifTrue;
+		case LT: case LTE:
+			if (rightZero){ return ifFalse; }
+			if (leftZero){ return ifTrue; }
+			break;
+		case GT: case GTE:
+			if (rightZero){ return ifTrue; }
+			if (leftZero){ return ifFalse; }
+			break;
+		default: break;
+		}
+	}
+	if (doesIO(jumps) != doesIO(falls)){ return doesIO(jumps) ? falls : jumps; }
+	return falls;
+}
+
+//Make falling through the blocks in order go where the edges
+// say, by turning branches around or adding jumps
+static void layOut(ControlFlowGraph * cfg, std::vector<BasicBlock *> * order,
+	Edges * edges){
+	for (size_t i = 0 ; i < order->size() ; i++){
+		BasicBlock * block = (*order)[i];
+		BasicBlock * next = i + 1 < order->size() ? (*order)[i + 1]
+			: cfg->getExit();
+		std::list<Quad *> * quads = block->getQuads();
+		auto jumps = edges->jumpsTo.find(block);
+		if (jumps != edges->jumpsTo.end()){
+			Label * label = cfg->getLabel(jumps->second);
+			if (JmpQuad * jmp = quads->back()->asJmp()){ jmp->setTarget(label); }
+			if (JmpIfQuad * jmpIf = quads->back()->asJmpIf()){
+				jmpIf->setTarget(label);
+			}
+		}
+		auto falls = edges->fallsTo.find(block);
+		if (falls == edges->fallsTo.end() || falls->second == next){ continue; }
+		JmpIfQuad * branch = quads->back()->asJmpIf();
+		if (branch != nullptr && jumps != edges->jumpsTo.end()
+			&& jumps->second == next){
+			branch->setInverted(!branch->isInverted());
+			branch->setTarget(cfg->getLabel(falls->second));
+		} else {
+			quads->push_back(new JmpQuad(cfg->getLabel(falls->second)));
+		}
+	}
+	*cfg->getBlocks() = *order;
+}
+
+//Form a superblock in an innermost loop: the trace of likely
+// blocks from the header, laid out in a row so that the likely
+// path falls through. Blocks of the trace that are entered from
+// elsewhere are copied, from the first such block to the end of
+// the trace, and the side entrances go to the copies instead,
+// so the trace is only entered at its head. This is skipped if
+// the copy would be larger than budget.
+static bool formSuperblock(ControlFlowGraph * cfg, NaturalLoop * loop,
+	size_t budget){
+	Edges edges = findEdges(cfg);
+	std::vector<BasicBlock *> trace = {loop->getHeader()};
+	std::set<BasicBlock *> inTrace = {loop->getHeader()};
+	while (true){
+		BasicBlock * cur = trace.back();
+		BasicBlock * succ = cur->getSuccs()->front();
+		if (cur->getSuccs()->size() == 2){ succ = likelySucc(loop, cur, &edges); }
+		if (!loop->contains(succ) || inTrace.count(succ)){ break; }
+		trace.push_back(succ);
+		inTrace.insert(succ);
+	}
+
+	size_t first = 1;
+	for ( ; first < trace.size() ; first++){
+		if (trace[first]->getPreds()->size() > 1){ break; }
+	}
+	size_t size = 0;
+	for (size_t i = first ; i < trace.size() ; i++){
+		for (auto quad : *trace[i]->getQuads()){
+			if (quad->asNop() == nullptr){ size++; }
+		}
+	}
+	if (size > budget){
+		for (size_t i = first ; i < trace.size() ; i++){ inTrace.erase(trace[i]); }
+		trace.resize(first);
+	}
+
+	//Copy the tail of the trace. Edges from the copies into the
+	// tail go to the copies, and so do the side entrances.
+	std::map<BasicBlock *, BasicBlock *> copies;
+	std::map<BasicBlock *, BasicBlock *> traceNext;
+	for (size_t i = 0 ; i + 1 < trace.size() ; i++){
+		traceNext[trace[i]] = trace[i + 1];
+	}
+	size_t id = cfg->getBlocks()->size() + 1;
+	for (size_t i = first ; i < trace.size() ; i++){
+		BasicBlock * copy = new BasicBlock(id++);
+		for (auto quad : *trace[i]->getQuads()){
+			copy->getQuads()->push_back(quad->clone());
+		}
+		copies[trace[i]] = copy;
+	}
+	auto toCopy = [&](BasicBlock * block){
+		auto found = copies.find(block);
+		return found == copies.end() ? block : found->second;
+	};
+	for (auto & copy : copies){
+		for (auto succs : {&edges.jumpsTo, &edges.fallsTo}){
+			auto found = succs->find(copy.first);
+			if (found != succs->end()){
+				(*succs)[copy.second] = toCopy(found->second);
+			}
+		}
+	}
+	for (auto block : *cfg->getBlocks()){
+		auto onTrace = traceNext.find(block);
+		for (auto succs : {&edges.jumpsTo, &edges.fallsTo}){
+			auto found = succs->find(block);
+			if (found == succs->end() || (onTrace != traceNext.end()
+				&& onTrace->second == found->second)){
+				continue;
+			}
+			found->second = toCopy(found->second);
+		}
+	}
+
+	std::vector<BasicBlock *> order;
+	for (auto block : *cfg->getBlocks()){
+		if (inTrace.count(block) && block != loop->getHeader()){ continue; }
+		if (block != loop->getHeader()){
+			order.push_back(block);
+			continue;
+		}
+		order.insert(order.end(), trace.begin(), trace.end());
+		for (size_t i = first ; i < trace.size() ; i++){
+			order.push_back(copies[trace[i]]);
+		}
+	}
+	if (copies.empty() && order == *cfg->getBlocks()){ return false; }
+	layOut(cfg, &order, &edges);
+	return true;
+}
+
+//Superblock formation for each innermost loop, once, as long
+// as the copies stay within the superblock budget
+bool formSuperblocks(Procedure * proc, OptOptions * opts){
+	bool changed = false;
+	std::set<Quad *> done;
+	bool again = true;
+	while (again){
+		again = false;
+		ControlFlowGraph cfg(proc);
+		Dominators doms(&cfg);
+		std::list<NaturalLoop *> loops = findLoops(&cfg, &doms);
+		for (auto loop : loops){
+			bool inner = true;
+			for (auto other : loops){
+				if (other != loop && loop->contains(other->getHeader())){
+					inner = false;
+				}
+			}
+			Quad * head = loop->getHeader()->getQuads()->front();
+			if (!inner || !done.insert(head).second){ continue; }
+			if (formSuperblock(&cfg, loop, opts->superblockBudget)){
+				cfg.commit();
+				changed = again = true;
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+}
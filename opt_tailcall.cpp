@@ -0,0 +1,296 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+//Whether the code from itr on only returns result: it holds
+// nothing but a setout of result (unless returned is already
+// set), nops and jumps, until the end of the procedure
+static bool onlyReturns(Procedure * proc, std::list<Quad *> * quads,
+	std::map<Label *, std::list<Quad *>::iterator> * targets,
+	std::list<Quad *>::iterator itr, Opd * result, bool returned){
+	for (size_t steps = 0 ; steps <= quads->size() ; steps++){
+		if (itr == quads->end()){ return returned; }
+		Quad * quad = *itr;
+		if (quad->asNop() != nullptr){
+			++itr;
+		} else if (SetOutQuad * setOut = quad->asSetOut()){
+			if (returned || setOut->getIndex() != 1
+				|| setOut->getOpd() != result){
+				return false;
+			}
+			returned = true;
+			++itr;
+		} else if (JmpQuad * jmp = quad->asJmp()){
+			if (jmp->getTarget() == proc->getLeaveLabel()){ return returned; }
+			auto found = targets->find(jmp->getTarget());
+			if (found == targets->end()){ return false; }
+			itr = found->second;
+		} else {
+			return false;
+		}
+	}
+	return false;
+}
+
+//Whether nothing happens after the call at callPos but passing
+// its result (if any) back out. The getout must not be a jump
+// target, since another path could then return through it.
+static bool inTailPosition(Procedure * proc, std::list<Quad *> * quads,
+	std::map<Label *, std::list<Quad *>::iterator> * targets,
+	std::list<Quad *>::iterator callPos){
+	auto itr = std::next(callPos);
+	Opd * result = nullptr;
+	if (itr != quads->end() && (*itr)->asGetOut() != nullptr){
+		GetOutQuad * getOut = (*itr)->asGetOut();
+		if (getOut->getIndex() != 1 || getOut->hasLabels()){ return false; }
+		result = getOut->getOpd();
+		++itr;
+	}
+	return onlyReturns(proc, quads, targets, itr, result, result == nullptr);
+}
+
+static std::map<Label *, std::list<Quad *>::iterator> findTargets(
+	std::list<Quad *> * quads){
+	std::map<Label *, std::list<Quad *>::iterator> targets;
+	for (auto itr = quads->begin() ; itr != quads->end() ; ++itr){
+		for (auto label : (*itr)->getLabels()){ targets[label] = itr; }
+	}
+	return targets;
+}
+
+static size_t numArgs(CallQuad * call){
+	return call->getCallee()->getType()->asFn()->getFormalTypes()
+		->getElts()->size();
+}
+
+static bool isSelfCall(Procedure * proc, Quad * quad){
+	CallQuad * call = quad->asCall();
+	return call != nullptr && call->getCallee()->getName() == proc->getName()
+		&& numArgs(call) == proc->getFormals()->size();
+}
+
+//The position right after the getins, which read the arguments
+// the procedure was first called with
+static std::list<Quad *>::iterator afterGetIns(std::list<Quad *> * quads){
+	auto pos = quads->begin();
+	while (pos != quads->end() && (*pos)->asGetIn() != nullptr){ ++pos; }
+	return pos;
+}
+
+//Replace the self call at callPos, and its getout if it has one,
+// by a jump back to entry (which is made on first use). The
+// arguments are evaluated into fresh temps where they were set,
+// and copied into the formals only at the call, since later
+// arguments may still read the formals' old values:
+//
+//   setin 1 x         a1 := x
+//   setin 2 y   ==>   a2 := y
+//   call f            n := a1
+//   getout 1 t        m := a2
+//                     goto entry
+//
+// Returns the position of the jump.
+static std::list<Quad *>::iterator jumpToEntry(Procedure * proc,
+	std::list<Quad *> * quads, std::list<Quad *>::iterator callPos,
+	std::vector<std::list<Quad *>::iterator> * setIns, Label ** entry){
+	if (*entry == nullptr){
+		Quad * nop = new NopQuad();
+		*entry = proc->makeLabel();
+		nop->addLabel(*entry);
+		quads->insert(afterGetIns(quads), nop);
+	}
+	size_t formals = proc->getFormals()->size();
+	std::vector<Opd *> formalOpds(formals + 1, nullptr);
+	for (auto quad : *quads){
+		GetInQuad * getIn = quad->asGetIn();
+		if (getIn == nullptr){ break; }
+		formalOpds[getIn->getIndex()] = getIn->getOpd();
+	}
+	std::list<Quad *> rebind;
+	for (size_t i = 1 ; i <= formals ; i++){
+		SetInQuad * setIn = (*(*setIns)[i])->asSetIn();
+		AuxOpd * arg = proc->makeTmp();
+		Quad * copy = new AssignQuad(arg, setIn->getOpd());
+		setIn->moveLabelsTo(copy);
+		*(*setIns)[i] = copy;
+		if (formalOpds[i] != nullptr){
+			rebind.push_back(new AssignQuad(formalOpds[i], arg));
+		}
+	}
+	Quad * jmp = new JmpQuad(*entry);
+	rebind.push_back(jmp);
+	auto next = std::next(callPos);
+	if (next != quads->end() && (*next)->asGetOut() != nullptr){
+		quads->erase(next);
+	}
+	quads->splice(callPos, rebind);
+	quads->erase(callPos);
+	return std::find(quads->begin(), quads->end(), jmp);
+}
+
+//Turn calls a procedure makes to itself in tail position into
+// jumps back to its start
+bool removeTailRecursion(Procedure * proc){
+	if (proc->getName() == "main"){ return false; }
+	std::list<Quad *> * quads = proc->getQuads();
+	size_t formals = proc->getFormals()->size();
+	Label * entry = nullptr;
+	bool changed = false;
+	auto targets = findTargets(quads);
+	for (auto itr = quads->begin() ; itr != quads->end() ; ++itr){
+		std::vector<std::list<Quad *>::iterator> setIns;
+		if (!isSelfCall(proc, *itr)
+			|| !inTailPosition(proc, quads, &targets, itr)
+			|| !findSetIns(quads, itr, formals, &setIns)){
+			continue;
+		}
+		itr = jumpToEntry(proc, quads, itr, &setIns, &entry);
+		changed = true;
+	}
+	return changed;
+}
+
+//A self call whose result is combined with x before being
+// returned, as in return x OP f(...)
+struct Accumulated{
+	std::list<Quad *>::iterator call;
+	std::vector<std::list<Quad *>::iterator> setIns;
+	BinOpQuad * combine;
+	Opd * x;
+};
+
+//Whether the self call at callPos is followed by
+//
+//   getout 1 t
+//   u := x OP t      (or t OP x)
+//   setout 1 u
+//
+// and then only a return, with x unchanged by the call
+static bool findAccumulated(Procedure * proc, std::list<Quad *> * quads,
+	std::map<Label *, std::list<Quad *>::iterator> * targets,
+	std::list<Quad *>::iterator callPos, Accumulated * site){
+	site->call = callPos;
+	if (!findSetIns(quads, callPos, proc->getFormals()->size(),
+		&site->setIns)){
+		return false;
+	}
+	Quad * after[3];
+	auto itr = callPos;
+	for (size_t i = 0 ; i < 3 ; i++){
+		if (++itr == quads->end() || (*itr)->hasLabels()){ return false; }
+		after[i] = *itr;
+	}
+	GetOutQuad * getOut = after[0]->asGetOut();
+	BinOpQuad * combine = after[1]->asBinOp();
+	SetOutQuad * setOut = after[2]->asSetOut();
+	if (getOut == nullptr || combine == nullptr || setOut == nullptr
+		|| setOut->getOpd() != combine->getDst()){
+		return false;
+	}
+	BinOp op = combine->getOp();
+	if (op != ADD && op != MULT && op != AND && op != OR){ return false; }
+	Opd * t = getOut->getOpd();
+	Opd * x = combine->getSrc1();
+	if (x == t){ x = combine->getSrc2(); }
+	else if (combine->getSrc2() != t){ return false; }
+	if (x == t || quadMayDefs(proc, *callPos).count(x)){ return false; }
+	site->combine = combine;
+	site->x = x;
+	return onlyReturns(proc, quads, targets, std::next(itr), setOut->getOpd(),
+		true);
+}
+
+//Accumulator introduction for linear recursion through an
+// associative and commutative operator. When every self call of
+// a procedure is returned as x OP f(...), the x's are folded into
+// an accumulator on the way down instead, starting from OP's
+// identity, every other return combines its value with the
+// accumulator, and the self calls become jumps back to the
+// start:
+//
+//   int fact(int n){            acc := 1
+//     if (n <= 1){ return 1; }  entry: if (n <= 1){ return acc * 1; }
+//     return n * fact(n - 1);   acc := acc * n; n := n - 1; goto entry
+//   }
+//
+// Since OP is associative and commutative (wrapping arithmetic
+// included), the result is the same as folding them on the way
+// back up.
+bool accumulateRecursion(Procedure * proc){
+	if (proc->getName() == "main"){ return false; }
+	std::list<Quad *> * quads = proc->getQuads();
+	auto targets = findTargets(quads);
+	std::list<Accumulated> sites;
+	for (auto itr = quads->begin() ; itr != quads->end() ; ++itr){
+		CallQuad * call = (*itr)->asCall();
+		if (call == nullptr
+			|| call->getCallee()->getName() != proc->getName()){
+			continue;
+		}
+		Accumulated site;
+		if (!isSelfCall(proc, call)
+			|| !findAccumulated(proc, quads, &targets, itr, &site)
+			|| (!sites.empty()
+				&& sites.front().combine->getOp() != site.combine->getOp())){
+			return false;
+		}
+		sites.push_back(site);
+	}
+	if (sites.empty()){ return false; }
+
+	BinOp op = sites.front().combine->getOp();
+	bool unit = op == MULT || op == AND;
+	AuxOpd * acc = proc->makeTmp();
+	std::set<Quad *> combined;
+	for (auto site : sites){
+		combined.insert(*std::next(site.call, 3));
+	}
+	for (auto itr = quads->begin() ; itr != quads->end() ; ++itr){
+		SetOutQuad * setOut = (*itr)->asSetOut();
+		if (setOut == nullptr || combined.count(setOut)){ continue; }
+		AuxOpd * res = proc->makeTmp();
+		Quad * fold = new BinOpQuad(res, op, acc, setOut->getOpd());
+		setOut->moveLabelsTo(fold);
+		quads->insert(itr, fold);
+		*itr = new SetOutQuad(1, res);
+	}
+	//The accumulator is set up before the start the self calls
+	// jump back to
+	auto start = afterGetIns(quads);
+	quads->insert(start, new AssignQuad(acc, new LitOpd(unit ? "1" : "0")));
+	Quad * nop = new NopQuad();
+	Label * entry = proc->makeLabel();
+	nop->addLabel(entry);
+	quads->insert(start, nop);
+	for (auto site : sites){
+		quads->insert(site.call, new BinOpQuad(acc, op, acc, site.x));
+		auto getOut = std::next(site.call);
+		quads->erase(std::next(getOut), std::next(getOut, 3));
+		jumpToEntry(proc, quads, site.call, &site.setIns, &entry);
+	}
+	return true;
+}
+
+//Mark the calls in tail position that can reuse the caller's
+// frame: the callee's arguments must fit where the caller's own
+// were passed. The main procedure has no caller to return to.
+bool markTailCalls(Procedure * proc){
+	if (proc->getName() == "main"){ return false; }
+	std::list<Quad *> * quads = proc->getQuads();
+	auto targets = findTargets(quads);
+	bool changed = false;
+	for (auto itr = quads->begin() ; itr != quads->end() ; ++itr){
+		CallQuad * call = (*itr)->asCall();
+		if (call == nullptr || call->isTail()
+			|| numArgs(call) > proc->getFormals()->size()
+			|| !inTailPosition(proc, quads, &targets, itr)){
+			continue;
+		}
+		call->setTail(true);
+		changed = true;
+	}
+	return changed;
+}
+
+}
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+//An edge into a block ending in a conditional branch whose
+// outcome is already known on that edge, along with a copy
+// of what the block does before branching
+struct Thread{
+	BasicBlock * pred;
+	BasicBlock * block;
+	BasicBlock * succ;
+	std::list<Quad *> body;
+};
+
+//Whether pred jumps to block (as opposed to falling into it)
+static bool jumpsTo(ControlFlowGraph * cfg, BasicBlock * pred,
+	BasicBlock * block){
+	Label * tgt = pred->getQuads()->back()->getTarget();
+	if (tgt == nullptr){ return false; }
+	if (block == cfg->getExit()){
+		return tgt == cfg->getProc()->getLeaveLabel();
+	}
+	std::list<Label *> labels = block->getQuads()->front()->getLabels();
+	return std::find(labels.begin(), labels.end(), tgt) != labels.end();
+}
+
+static BasicBlock * layoutNext(ControlFlowGraph * cfg, BasicBlock * block){
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	auto pos = std::find(blocks->begin(), blocks->end(), block);
+	if (pos + 1 < blocks->end()){ return *(pos + 1); }
+	return cfg->getExit();
+}
+
+//The quads of block before its branch, unless there are too
+// many of them or any of them is part of a call
+static bool findBody(BasicBlock * block, size_t budget,
+	std::list<Quad *> * body){
+	size_t size = 0;
+	for (auto quad : *block->getQuads()){
+		if (quad == block->getQuads()->back()){ break; }
+		if (quad->asNop() != nullptr){ continue; }
+		if (quad->asAssign() == nullptr && quad->asBinOp() == nullptr
+			&& quad->asUnaryOp() == nullptr && quad->asSyscall() == nullptr){
+			return false;
+		}
+		if (++size > budget){ return false; }
+		body->push_back(quad);
+	}
+	return true;
+}
+
+//Find the edges that can be threaded: those into a block
+// ending in a branch that range analysis decides on the edge.
+// Blocks entered by an edge that goes back against reverse
+// postorder (such as loop headers) are left alone: threading
+// through a header would give its loop a second entry, and
+// keeping out of them means threading cannot go round a cycle.
+static std::list<Thread> findThreads(Procedure * proc, ControlFlowGraph * cfg,
+	size_t budget){
+	ValueRanges ranges(proc, cfg);
+	Dominators doms(cfg);
+	std::map<BasicBlock *, size_t> orderIdx;
+	std::vector<BasicBlock *> * order = doms.getOrder();
+	for (size_t i = 0 ; i < order->size() ; i++){ orderIdx[(*order)[i]] = i; }
+	std::list<Thread> res;
+	for (auto block : *cfg->getBlocks()){
+		JmpIfQuad * branch = block->getQuads()->back()->asJmpIf();
+		if (branch == nullptr || block->getPreds()->size() < 2
+			|| block->getSuccs()->size() != 2){
+			continue;
+		}
+		auto idx = orderIdx.find(block);
+		if (idx == orderIdx.end()){ continue; }
+		bool header = false;
+		for (auto pred : *block->getPreds()){
+			auto found = orderIdx.find(pred);
+			if (found != orderIdx.end() && found->second >= idx->second){
+				header = true;
+			}
+		}
+		std::list<Quad *> body;
+		if (header || !findBody(block, budget, &body)){ continue; }
+		BasicBlock * next = layoutNext(cfg, block);
+		for (auto pred : *block->getPreds()){
+			bool jumps;
+			if (!ranges.decideBranch(pred, block, &jumps)){ continue; }
+			bool falls = pred->getQuads()->back()->fallsThrough()
+				&& layoutNext(cfg, pred) == block;
+			if (falls == jumpsTo(cfg, pred, block)){ continue; }
+			Thread thread;
+			thread.pred = pred;
+			thread.block = block;
+			thread.succ = jumps ? block->getSuccs()->front() : next;
+			for (auto quad : body){ thread.body.push_back(quad->clone()); }
+			res.push_back(thread);
+		}
+	}
+	return res;
+}
+
+//Send each edge that was found straight to the successor its
+// branch would take. The edge goes to a copy of the block's
+// quads ending in a jump to that successor: the copy takes the
+// place of a jump at the end of the predecessor, goes right
+// after a predecessor that fell into the block, or else goes
+// at the end of the procedure. When there is nothing to copy,
+// a jump to the block is just retargeted.
+static void thread(ControlFlowGraph * cfg, std::list<Thread> * threads){
+	Procedure * proc = cfg->getProc();
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	std::map<BasicBlock *, BasicBlock *> after;
+	std::list<BasicBlock *> atEnd;
+	for (auto & thread : *threads){
+		Label * succLabel = cfg->getLabel(thread.succ);
+		std::list<Quad *> * predQuads = thread.pred->getQuads();
+		Quad * last = predQuads->back();
+		bool falls = !jumpsTo(cfg, thread.pred, thread.block);
+		if (!falls && thread.body.empty()){
+			if (JmpQuad * jmp = last->asJmp()){ jmp->setTarget(succLabel); }
+			if (JmpIfQuad * jmpIf = last->asJmpIf()){
+				jmpIf->setTarget(succLabel);
+			}
+			continue;
+		}
+		thread.body.push_back(new JmpQuad(succLabel));
+		if (JmpQuad * jmp = last->asJmp()){
+			predQuads->pop_back();
+			jmp->moveLabelsTo(thread.body.front());
+			predQuads->splice(predQuads->end(), thread.body);
+			continue;
+		}
+		BasicBlock * copy = new BasicBlock(blocks->size() + after.size()
+			+ atEnd.size());
+		copy->getQuads()->splice(copy->getQuads()->end(), thread.body);
+		if (falls){
+			after[thread.pred] = copy;
+		} else {
+			last->asJmpIf()->setTarget(cfg->getLabel(copy));
+			atEnd.push_back(copy);
+		}
+	}
+
+	std::vector<BasicBlock *> layout;
+	for (auto block : *blocks){
+		layout.push_back(block);
+		auto found = after.find(block);
+		if (found != after.end()){ layout.push_back(found->second); }
+	}
+	if (!atEnd.empty() && layout.back()->getQuads()->back()->fallsThrough()){
+		layout.back()->getQuads()->push_back(
+			new JmpQuad(proc->getLeaveLabel()));
+	}
+	layout.insert(layout.end(), atEnd.begin(), atEnd.end());
+	*blocks = layout;
+}
+
+//Jump threading: an edge on which the branch at the end of
+// the block it leads to is already decided (by an assignment
+// or by an earlier test of the same values) skips the branch.
+// Threading can decide more branches further on, so it goes
+// on until nothing is left to thread.
+bool threadJumps(Procedure * proc, OptOptions * opts){
+	bool changed = false;
+	while (true){
+		ControlFlowGraph cfg(proc);
+		std::list<Thread> threads = findThreads(proc, &cfg, opts->threadBudget);
+		if (threads.empty()){ return changed; }
+		thread(&cfg, &threads);
+		cfg.commit();
+		changed = true;
+	}
+}
+
+}
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+//Replace a loop that runs a known, small number of times by
+// that many copies of its body
+static void unrollFully(Procedure * proc, CountedLoop * loop, size_t trips){
+	std::list<Quad *> copies;
+	for (size_t i = 1 ; i < trips ; i++){
+		std::list<Quad *> copy = loop->cloneBody(proc);
+		copies.splice(copies.end(), copy);
+	}
+	std::list<Quad *> * quads = loop->getBody()->back()->getQuads();
+	quads->pop_back();
+	quads->splice(quads->end(), copies);
+}
+
+//Put an unrolled copy of a loop in front of it. The copy runs
+// factor iterations per trip for as long as at least that many
+// are left, and the original loop then runs the remainder.
+//
+//   if not (at least factor left) goto B
+//   U: body; ...; body
+//   if (at least factor left) goto U
+//   if not (counter cmp bound) goto E
+//   B: original loop
+//   E:
+//
+// With a step of s towards the bound, at least factor
+// iterations are left while |bound - counter| is at least
+// (factor - 1) * |s|, plus one for a strict comparison. The
+// difference is taken in the direction of the step, so it is
+// positive whenever the loop would go around again; if it is
+// too large to represent it wraps negative, and the remainder
+// loop simply does all the work.
+static bool unrollPartially(Procedure * proc, ControlFlowGraph * cfg,
+	CountedLoop * loop, size_t factor){
+	long int step = loop->getStep();
+	BinOp cmp = loop->getCmp();
+	bool up = step > 0 && (cmp == LT || cmp == LTE);
+	bool down = step < 0 && (cmp == GT || cmp == GTE);
+	if (!up && !down){ return false; }
+	bool strict = cmp == LT || cmp == GT;
+	unsigned long int magnitude = static_cast<unsigned long int>(up ? step : -step);
+	unsigned long int least = (factor - 1) * magnitude + (strict ? 1 : 0);
+	Opd * minLeft = new LitOpd(std::to_string(least));
+
+	Opd * counter = loop->getCounter();
+	Opd * bound = loop->getBound();
+	AuxOpd * distance = proc->makeTmp();
+	AuxOpd * enough = proc->makeTmp();
+	auto checkLeft = [&](std::list<Quad *> * code, bool jumpIfEnough,
+		Label * target){
+		if (up){
+			code->push_back(new BinOpQuad(distance, SUB, bound, counter));
+		} else {
+			code->push_back(new BinOpQuad(distance, SUB, counter, bound));
+		}
+		code->push_back(new BinOpQuad(enough, GTE, distance, minLeft));
+		code->push_back(new JmpIfQuad(enough, jumpIfEnough, target));
+	};
+
+	BasicBlock * header = loop->getBody()->front();
+	Label * remainder = cfg->getLabel(header);
+	Label * exit = cfg->getLabel(loop->getExit());
+	std::list<Quad *> unrolled;
+	for (size_t i = 0 ; i < factor ; i++){
+		std::list<Quad *> copy = loop->cloneBody(proc);
+		unrolled.splice(unrolled.end(), copy);
+	}
+	Label * top = unrolled.front()->getLabels().front();
+
+	std::list<Quad *> code;
+	checkLeft(&code, false, remainder);
+	code.splice(code.end(), unrolled);
+	checkLeft(&code, true, top);
+	JmpIfQuad * branch = loop->getBranch();
+	code.push_back(loop->getTest()->clone());
+	code.push_back(new JmpIfQuad(branch->getCnd(), !branch->isInverted(),
+		exit));
+	std::list<Quad *> * quads = header->getQuads();
+	quads->splice(quads->begin(), code);
+	return true;
+}
+
+//Unrolling of innermost counted loops. A loop with a known trip
+// count whose copies fit in the unroll budget is unrolled
+// fully; otherwise it is unrolled by the configured factor
+// (with a remainder loop) if that many copies of the body fit.
+bool unrollLoops(Procedure * proc, OptOptions * opts){
+	ControlFlowGraph cfg(proc);
+	Dominators doms(&cfg);
+	std::list<NaturalLoop *> loops = findLoops(&cfg, &doms);
+	bool changed = false;
+	for (auto loop : loops){
+		bool innermost = true;
+		for (auto other : loops){
+			if (other != loop && loop->contains(other->getHeader())){
+				innermost = false;
+			}
+		}
+		if (!innermost){ continue; }
+		CountedLoop * counted = CountedLoop::analyze(&cfg, loop);
+		if (counted == nullptr){ continue; }
+		size_t size = std::max(counted->size(), static_cast<size_t>(1));
+		size_t trips;
+		if (counted->tripCount(opts->unrollBudget / size, &trips)){
+			unrollFully(proc, counted, trips);
+			changed = true;
+			continue;
+		}
+		size_t factor = opts->unrollFactor;
+		if (factor < 2 || factor * size > opts->unrollBudget){ continue; }
+		//Not worth it if the unrolled copy would never run
+		if (counted->tripCount(2 * factor, &trips)){ continue; }
+		changed = unrollPartially(proc, &cfg, counted, factor) || changed;
+	}
+	cfg.commit();
+	return changed;
+}
+
+}
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include "opt.hpp"
+
+namespace lake{
+
+//Turn a conditional branch into what it does when its
+// condition has the given value
+static void specialize(std::list<Quad *> * quads, JmpIfQuad * branch,
+	bool cndVal){
+	auto pos = std::find(quads->begin(), quads->end(), branch);
+	if (cndVal != branch->isInverted()){
+		eraseQuad(quads, pos);
+		return;
+	}
+	Quad * jmp = new JmpQuad(branch->getTarget());
+	branch->moveLabelsTo(jmp);
+	*pos = jmp;
+}
+
+//Unswitch a loop on a branch whose condition the loop never
+// changes. The loop is copied, with fresh labels, right after
+// itself, the original keeps the side of the branch taken when
+// the condition is true and the copy the side taken when it is
+// false, and the test is made once before the loop:
+//
+//   if not c goto L'
+//   L: loop, with c true; goto E
+//   L': loop, with c false
+//   E:
+//
+// The loop must be laid out as one run of blocks from its
+// header, so that the copy can be placed as a whole.
+static bool unswitch(Procedure * proc, ControlFlowGraph * cfg,
+	NaturalLoop * loop, size_t budget){
+	std::vector<BasicBlock *> * blocks = cfg->getBlocks();
+	auto first = std::find(blocks->begin(), blocks->end(), loop->getHeader());
+	if (first == blocks->end()
+		|| static_cast<size_t>(blocks->end() - first) < loop->getBlocks()->size()){
+		return false;
+	}
+	auto last = first + static_cast<long int>(loop->getBlocks()->size());
+	size_t size = 0;
+	std::set<Opd *> defined;
+	for (auto itr = first ; itr != last ; ++itr){
+		if (!loop->contains(*itr)){ return false; }
+		for (auto quad : *(*itr)->getQuads()){
+			if (quad->asNop() == nullptr){ size++; }
+			for (auto def : quadMayDefs(proc, quad)){ defined.insert(def); }
+		}
+	}
+	if (size > budget){ return false; }
+
+	JmpIfQuad * branch = nullptr;
+	BasicBlock * branchBlock = nullptr;
+	for (auto itr = first ; itr != last && branch == nullptr ; ++itr){
+		JmpIfQuad * jmpIf = (*itr)->getQuads()->back()->asJmpIf();
+		if (jmpIf == nullptr){ continue; }
+		Opd * cnd = jmpIf->getCnd();
+		if (isVar(cnd) && !defined.count(cnd)){
+			branch = jmpIf;
+			branchBlock = *itr;
+		}
+	}
+	if (branch == nullptr || !canPlacePreheader(cfg, loop)){ return false; }
+
+	//Leave the original by jump rather than by falling out of
+	// the end, since the copy goes in between
+	BasicBlock * next = last == blocks->end() ? cfg->getExit() : *last;
+	BasicBlock * tail = *(last - 1);
+	Label * nextLabel = cfg->getLabel(next);
+	Label * header = cfg->getLabel(loop->getHeader());
+
+	std::map<Label *, Label *> renamed;
+	std::list<Quad *> copy;
+	JmpIfQuad * branchCopy = nullptr;
+	for (auto itr = first ; itr != last ; ++itr){
+		for (auto quad : *(*itr)->getQuads()){
+			Quad * dup = quad->clone();
+			for (auto label : quad->getLabels()){
+				Label * fresh = proc->makeLabel();
+				renamed[label] = fresh;
+				dup->addLabel(fresh);
+			}
+			if (quad == branch){ branchCopy = dup->asJmpIf(); }
+			copy.push_back(dup);
+		}
+	}
+	for (auto quad : copy){
+		auto found = renamed.find(quad->getTarget());
+		if (found == renamed.end()){ continue; }
+		if (JmpQuad * jmp = quad->asJmp()){ jmp->setTarget(found->second); }
+		if (JmpIfQuad * jmpIf = quad->asJmpIf()){
+			jmpIf->setTarget(found->second);
+		}
+	}
+
+	Opd * cnd = branch->getCnd();
+	specialize(branchBlock->getQuads(), branch, true);
+	specialize(&copy, branchCopy, false);
+	std::list<Quad *> * tailQuads = tail->getQuads();
+	if (tailQuads->back()->fallsThrough()){
+		tailQuads->push_back(new JmpQuad(nextLabel));
+	}
+	tailQuads->splice(tailQuads->end(), copy);
+	std::list<Quad *> dispatch;
+	dispatch.push_back(new JmpIfQuad(cnd, false, renamed[header]));
+	placePreheader(proc, cfg, loop, &dispatch);
+	return true;
+}
+
+//Unswitching of loops on invariant conditions, as long as each
+// copy of a loop stays within the unswitch budget
+bool unswitchLoops(Procedure * proc, OptOptions * opts){
+	bool changed = false;
+	bool again = true;
+	while (again){
+		again = false;
+		ControlFlowGraph cfg(proc);
+		Dominators doms(&cfg);
+		for (auto loop : findLoops(&cfg, &doms)){
+			if (unswitch(proc, &cfg, loop, opts->unswitchBudget)){
+				cfg.commit();
+				changed = again = true;
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+}
@@ -7,10 +7,12 @@ long int getInt();
 
 void printInt(long int num){
 	fprintf(stdout, "%ld\n", num);
+	fflush(stdout);
 }
 
 void printString(const char * str){
 	fprintf(stdout, "%s\n", str);
+	fflush(stdout);
 }
 
 long int getInt(){
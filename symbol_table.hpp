@@ -31,7 +31,7 @@ public:
 	virtual std::string toString();
 	std::string getName() const { return myName; }
 	SymbolKind getKind() { return myKind; }
-	const DataType * getType() { return myType; }
+	const DataType * getType() const { return myType; }
 	static std::string kindToString(SymbolKind symKind) { 
 		switch(symKind){
 			case VAR: return "var";
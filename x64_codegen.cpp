@@ -1,3 +1,4 @@
+#include <climits>
 #include <ostream>
 #include "3ac.hpp"
 #include "err.hpp"
@@ -18,7 +19,8 @@ void IRProgram::allocGlobals(){
 	for (auto string : strings) {
 		AuxOpd * strHandle = string.first;
 		std::string memLoc = "str_" + strHandle->getName();
-		strHandle->setMemoryLoc(memLoc);
+		//A string is used by its address
+		strHandle->setMemoryLoc("$" + memLoc);
 	}
 	// TODO(Implement me)
 }
@@ -27,32 +29,45 @@ void IRProgram::datagenX64(std::ostream& out){
 	out << ".data\n";
 	allocGlobals();
 	for(auto global : globals) {
-		Opd * globalOpd = global.second;
+		SymOpd * globalOpd = global.second;
+		auto init = initials.find(globalOpd);
 		out << "gbl_" 
 			<< globalOpd->toString()
 			<< ":\n" 
-			<< ".quad"
-			<< " 0"
+			<< ".quad "
+			<< (init == initials.end() ? 0 : init->second)
 			<< "\n";
 	}
 
 	for(auto string : strings) {
 		std::string strData = string.second;
 		AuxOpd * strHandle = string.first;
-		out << strHandle->getMemoryLoc()
+		out << "str_" << strHandle->getName()
 			<< ":\n"
-			<< ".asciz"
+			<< ".asciz "
 			<< strData
 			<< "\n";
 			// finish this
 	}
 	out << ".align 8\n\n";
-	out << ".text\n";
-	out << ".globl _start\n";
-	for(auto procedure : procs) {
-		out << ".globl " << procedure->getName() << "\n";
+	if (!memoTables.empty()){
+		out << ".bss\n";
+		out << ".align 8\n";
+		for (auto table : memoTables){
+			out << ".globl " << table.first << "_hits\n";
+			out << ".globl " << table.first << "_misses\n";
+			out << table.first << ":\n";
+			out << ".zero " << table.second << "\n";
+			out << table.first << "_hits:\n";
+			out << ".zero 8\n";
+			out << table.first << "_misses:\n";
+			out << ".zero 8\n";
+		}
+		out << "\n";
 	}
-	out << "_start:\n\n";
+	//entry.o provides _start, which calls main
+	out << ".text\n";
+	out << ".globl main\n\n";
 	// TODO(Implement me)
 }
 
@@ -85,14 +100,15 @@ void Procedure::allocLocals(){
 		temp->setMemoryLoc(memLoc);
 		offset = offset + 8;
 	}
-	int formalPos = 0;
+	//Arguments are pushed first to last, so the last one is
+	// nearest the frame
+	size_t formalPos = formals.size();
 	for(auto formalOpd : formals) {
-		// double check
-		int formalOffset = formalPos * 8;
+		formalPos--;
+		size_t formalOffset = formalPos * 8;
 		std::string memLoc = std::to_string(formalOffset);
 		memLoc += "(%rbp)";
 		formalOpd->setMemoryLoc(memLoc);
-		formalPos++;
 	}
 	int tempPos = 0;
 
@@ -102,6 +118,7 @@ void Procedure::toX64(std::ostream& out){
 	//Allocate all locals
 	allocLocals();
 
+	if (myName == "main"){ out << "main:\n"; }
 	out << "fun_" << myName << ":" << "\n";
 
 	enter->codegenX64(out);
@@ -128,16 +145,185 @@ void Quad::codegenLabels(std::ostream& out){
 
 // https://cs.brown.edu/courses/cs033/docs/guides/x64_cheatsheet.pdf
 // https://piazza.com/class_profile/get_resource/j7ly9riuca97on/ja86xbbpp0b73b
+static bool isPowerOfTwo(unsigned long int val){
+	return val != 0 && (val & (val - 1)) == 0;
+}
+
+static int log2Of(unsigned long int val){
+	int res = 0;
+	while (val > 1){
+		val >>= 1;
+		res++;
+	}
+	return res;
+}
+
+static unsigned long int magnitude(long int val){
+	unsigned long int bits = static_cast<unsigned long int>(val);
+	return val < 0 ? 0 - bits : bits;
+}
+
+// Multiply src by the constant c without imulq where a
+// shift, lea or shift-and-add does it. Leaves the product
+// in %rax, or returns false (emitting nothing) if the
+// general multiply is the best we have.
+static bool genConstMult(std::ostream& out, Opd * src, long int c){
+	if (c == LONG_MIN){ return false; }
+	if (c == 0){
+		out << "\tmovq $0, %rax\n";
+		return true;
+	}
+	unsigned long int mag = magnitude(c);
+	// lea can scale by 2, 4 or 8 and add the base back in
+	int leaScale = 0;
+	for (int scale : {8, 4, 2}){
+		unsigned long int factor = static_cast<unsigned long int>(scale + 1);
+		if (mag % factor == 0 && isPowerOfTwo(mag / factor)){
+			leaScale = scale;
+			break;
+		}
+	}
+	bool shiftAdd = isPowerOfTwo(mag - 1);
+	bool shiftSub = isPowerOfTwo(mag + 1);
+	if (!isPowerOfTwo(mag) && leaScale == 0 && !shiftAdd && !shiftSub){
+		if (c < INT_MIN || c > INT_MAX){ return false; }
+		src->genLoad(out, "%rax");
+		out << "\timulq $" << c << ", %rax, %rax\n";
+		return true;
+	}
+	src->genLoad(out, "%rax");
+	if (isPowerOfTwo(mag)){
+		if (mag > 1){ out << "\tshlq $" << log2Of(mag) << ", %rax\n"; }
+	} else if (leaScale != 0){
+		out << "\tleaq (%rax,%rax," << leaScale << "), %rax\n";
+		unsigned long int rest = mag / static_cast<unsigned long int>(leaScale + 1);
+		if (rest > 1){ out << "\tshlq $" << log2Of(rest) << ", %rax\n"; }
+	} else {
+		out << "\tmovq %rax, %rcx\n";
+		out << "\tshlq $" << log2Of(shiftAdd ? mag - 1 : mag + 1) << ", %rax\n";
+		out << (shiftAdd ? "\taddq" : "\tsubq") << " %rcx, %rax\n";
+	}
+	if (c < 0){ out << "\tnegq %rax\n"; }
+	return true;
+}
+
+// The magic multiplier and shift for signed division by d
+// (Granlund and Montgomery, as given in Hacker's Delight
+// 10-1): the quotient is the high word of magic * n,
+// corrected by n when the signs of d and magic differ,
+// shifted right and rounded towards zero. d must not be
+// 0, 1 or -1.
+static void divisionMagic(long int d, long int * magic, int * shift){
+	const unsigned long int two63 = 1UL << 63;
+	unsigned long int ad = magnitude(d);
+	unsigned long int t = two63 + (static_cast<unsigned long int>(d) >> 63);
+	unsigned long int anc = t - 1 - t % ad;
+	int p = 63;
+	unsigned long int q1 = two63 / anc;
+	unsigned long int r1 = two63 - q1 * anc;
+	unsigned long int q2 = two63 / ad;
+	unsigned long int r2 = two63 - q2 * ad;
+	unsigned long int delta;
+	do {
+		p++;
+		q1 = 2 * q1;
+		r1 = 2 * r1;
+		if (r1 >= anc){ q1++; r1 -= anc; }
+		q2 = 2 * q2;
+		r2 = 2 * r2;
+		if (r2 >= ad){ q2++; r2 -= ad; }
+		delta = ad - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+	unsigned long int res = q2 + 1;
+	if (d < 0){ res = 0 - res; }
+	*magic = static_cast<long int>(res);
+	*shift = p - 64;
+}
+
+// Divide src by the constant d (truncating, like idivq)
+// with shifts or a multiply-high instead of idivq. Leaves
+// the quotient in %rax, or returns false (emitting nothing)
+// if d has to be left to idivq. A src known to be non-negative
+// rounds the right way without any correction.
+static bool genConstDiv(std::ostream& out, Opd * src, long int d,
+	bool nonNeg){
+	if (d == 0 || d == LONG_MIN){ return false; }
+	unsigned long int mag = magnitude(d);
+	src->genLoad(out, "%rax");
+	if (mag == 1){
+		// Nothing to do but the sign
+	} else if (isPowerOfTwo(mag)){
+		// Arithmetic shifts round down, so bias negative
+		// dividends by d - 1 to round towards zero instead
+		int k = log2Of(mag);
+		if (!nonNeg){
+			out << "\tmovq %rax, %rcx\n";
+			out << "\tsarq $63, %rcx\n";
+			out << "\tshrq $" << 64 - k << ", %rcx\n";
+			out << "\taddq %rcx, %rax\n";
+		}
+		out << "\tsarq $" << k << ", %rax\n";
+	} else {
+		long int magic;
+		int shift;
+		divisionMagic(d, &magic, &shift);
+		out << "\tmovq %rax, %rcx\n";
+		out << "\tmovabsq $" << magic << ", %rax\n";
+		out << "\timulq %rcx\n";
+		if (d > 0 && magic < 0){ out << "\taddq %rcx, %rdx\n"; }
+		if (d < 0 && magic > 0){ out << "\tsubq %rcx, %rdx\n"; }
+		if (shift > 0){ out << "\tsarq $" << shift << ", %rdx\n"; }
+		out << "\tmovq %rdx, %rax\n";
+		if (!nonNeg){
+			out << "\tshrq $63, %rax\n";
+			out << "\taddq %rdx, %rax\n";
+		}
+		return true;
+	}
+	if (d < 0){ out << "\tnegq %rax\n"; }
+	return true;
+}
+
 void BinOpQuad::codegenX64(std::ostream& out){
 	// out << "\n\n#Start BinOp\n";
+	LitOpd * lit1 = src1->asLit();
+	LitOpd * lit2 = src2->asLit();
 	if(op == DIV) {
-		out << "\tmovq $0, %rdx\n";
+		if (lit2 != nullptr
+			&& genConstDiv(out, src1, lit2->getVal(), nonNeg)){
+			dst->genStore(out, "%rax");
+			return;
+		}
 		src1->genLoad(out, "%rax");
 		src2->genLoad(out, "%rbx");
-		out << "\tidivq %rbx\n";
+		if (nonNeg && narrow){
+			// Writing %eax clears the upper half of %rax
+			out << "\txorl %edx, %edx\n";
+			out << "\tdivl %ebx\n";
+		} else if (nonNeg){
+			out << "\txorl %edx, %edx\n";
+			out << "\tdivq %rbx\n";
+		} else if (narrow){
+			out << "\tcltd\n";
+			out << "\tidivl %ebx\n";
+			out << "\tcltq\n";
+		} else {
+			out << "\tcqto\n";
+			out << "\tidivq %rbx\n";
+		}
 		dst->genStore(out, "%rax");
 		return;
 	} else if (op == MULT) {
+		bool reduced = false;
+		if (lit2 != nullptr){
+			reduced = genConstMult(out, src1, lit2->getVal());
+		} else if (lit1 != nullptr){
+			reduced = genConstMult(out, src2, lit1->getVal());
+		}
+		if (reduced){
+			dst->genStore(out, "%rax");
+			return;
+		}
 		src1->genLoad(out, "%rax");
 		src2->genLoad(out, "%rbx");
 		out << "\timulq %rbx\n";
@@ -151,8 +337,16 @@ void BinOpQuad::codegenX64(std::ostream& out){
 		case MULT: break;
 		case ADD: out << "\taddq %rbx, %rax\n"; break;
 		case SUB: out << "\tsubq %rbx, %rax\n"; break;
-		case OR: out  << "\torq $1, %rbx\n"; out << "cmpq $1, %rax\n"; break;
-		case AND: out << "\tandq $1, %rbx\n"; out << "cmpq $1, %rax\n"; break;
+		case OR: out  << "\tcmpq $0, %rax\n"
+					  << "\tsetne %al\n"
+					  << "\tcmpq $0, %rbx\n"
+					  << "\tsetne %bl\n"
+					  << "\torb %bl, %al\n"; break;
+		case AND: out << "\tcmpq $0, %rax\n"
+					  << "\tsetne %al\n"
+					  << "\tcmpq $0, %rbx\n"
+					  << "\tsetne %bl\n"
+					  << "\tandb %bl, %al\n"; break;
 		case EQ: out  << "\tcmpq %rbx, %rax\n"
 					  << "\tsete %al\n"; break;
 		case NEQ: out << "\tcmpq %rbx, %rax\n"
@@ -169,6 +363,10 @@ void BinOpQuad::codegenX64(std::ostream& out){
 					  << "\tsetge %al\n"; break;
 		default: break;
 	}
+	if (op != ADD && op != SUB){
+		//The result of a comparison or logical op is only in %al
+		out << "\tmovzbq %al, %rax\n";
+	}
 	dst->genStore(out, "%rax");
 	// out << "\n#End BinOp\n\n";
 	return;
@@ -178,13 +376,13 @@ void UnaryOpQuad::codegenX64(std::ostream& out){
 	src->genLoad(out, "%rax");
 	if(op == NEG)
 	{
-		out << "\tneg %rax";
+		out << "\tnegq %rax\n";
 	}
 	else if(op == NOT)
 	{
-		out << "\tnot %rax";
+		out << "\txorq $1, %rax\n";
 	} 
-	// TODO(Implement me)
+	dst->genStore(out, "%rax");
 }
 
 void AssignQuad::codegenX64(std::ostream& out){
@@ -205,40 +403,49 @@ void JmpQuad::codegenX64(std::ostream& out){
 
 void JmpIfQuad::codegenX64(std::ostream& out){
 	cnd->genLoad(out, "%rax");
+	out << "\ttestq %rax, %rax\n";
 	if(invert)
 	{
-		out << "\tje " << tgt->toString() << "\n";
+		out << "\tjne " << tgt->toString() << "\n";
 	}
 	else
 	{
-		out << "\tjne " << tgt->toString() << "\n";
+		out << "\tje " << tgt->toString() << "\n";
 	}
-	
-	//TODO(Implement me)
 }
 
 void NopQuad::codegenX64(std::ostream& out){
 	out << "\tnop" << "\n";
 }
 
+// Call into stdlake with the stack aligned to 16 bytes, as C
+// code expects, and put it back as it was after
+static void genLibCall(std::ostream& out, std::string fn){
+	out << "\tpushq %rsp\n";
+	out << "\tpushq (%rsp)\n";
+	out << "\tandq $-16, %rsp\n";
+	out << "\tcallq " << fn << "\n";
+	out << "\tmovq 8(%rsp), %rsp\n";
+}
+
 void SyscallQuad::codegenX64(std::ostream& out){
 	if(mySyscall == WRITE)
 	{
 		if(myArg->getType() == 1)
 		{
 			myArg->genLoad(out, "%rdi");
-			out << "\tcallq printInt\n";
+			genLibCall(out, "printInt");
 		}
 		else if(myArg->getType() == 0)
 		{
 			myArg->genLoad(out, "%rdi");
-			out << "\tcallq printString\n";
+			genLibCall(out, "printString");
 		}
 	}
 	else if(mySyscall == READ)
 	{
-		myArg->genLoad(out, "%rdi");
-		out << "\tcallq getInt\n";
+		genLibCall(out, "getInt");
+		myArg->genStore(out, "%rax");
 	}
 	else if(mySyscall == EXIT)
 	{
@@ -248,9 +455,72 @@ void SyscallQuad::codegenX64(std::ostream& out){
 	}
 }
 
+//Point %rbx at the table entry for the keys. Entries hold a
+// flag saying they are in use, the keys, and the result.
+void MemoQuad::genEntry(std::ostream& out){
+	keys[0]->genLoad(out, "%rax");
+	for (size_t i = 1 ; i < keys.size() ; i++){
+		out << "\timulq $31, %rax, %rax\n";
+		keys[i]->genLoad(out, "%rbx");
+		out << "\taddq %rbx, %rax\n";
+	}
+	out << "\tandq $" << entries - 1 << ", %rax\n";
+	out << "\timulq $" << (keys.size() + 2) * 8 << ", %rax, %rax\n";
+	out << "\tmovq $" << table << ", %rbx\n";
+	out << "\taddq %rax, %rbx\n";
+}
+
+void MemoQuad::codegenX64(std::ostream& out){
+	genEntry(out);
+	size_t resultOffset = (keys.size() + 1) * 8;
+	if (op == PROBE){
+		out << "\tmovq $0, %rcx\n";
+		out << "\tcmpq $0, 0(%rbx)\n";
+		out << "\tje 1f\n";
+		for (size_t i = 0 ; i < keys.size() ; i++){
+			keys[i]->genLoad(out, "%rax");
+			out << "\tcmpq " << (i + 1) * 8 << "(%rbx), %rax\n";
+			out << "\tjne 1f\n";
+		}
+		out << "\tmovq $1, %rcx\n";
+		out << "\tincq (" << table << "_hits)\n";
+		out << "\tjmp 2f\n";
+		out << "1:\n";
+		out << "\tincq (" << table << "_misses)\n";
+		out << "2:\n";
+		opd->genStore(out, "%rcx");
+	} else if (op == FETCH){
+		out << "\tmovq " << resultOffset << "(%rbx), %rax\n";
+		opd->genStore(out, "%rax");
+	} else {
+		out << "\tmovq $1, 0(%rbx)\n";
+		for (size_t i = 0 ; i < keys.size() ; i++){
+			keys[i]->genLoad(out, "%rax");
+			out << "\tmovq %rax, " << (i + 1) * 8 << "(%rbx)\n";
+		}
+		opd->genLoad(out, "%rax");
+		out << "\tmovq %rax, " << resultOffset << "(%rbx)\n";
+	}
+}
+
 void CallQuad::codegenX64(std::ostream& out){
+	size_t args = callee->getType()->asFn()->getFormalTypes()->getElts()->size();
+	if (tail){
+		//Move the pushed arguments over the caller's own (there
+		// are at least as many of those, and the caller's caller
+		// pops them), drop the frame, and jump
+		for (size_t i = 0 ; i < args ; i++){
+			out << "\tmovq " << 8*i << "(%rsp), %rax\n";
+			out << "\tmovq %rax, " << 8*i << "(%rbp)\n";
+		}
+		out << "\tmovq -16(%rbp), %rcx\n";
+		out << "\tleaq -8(%rbp), %rsp\n";
+		out << "\tmovq %rcx, %rbp\n";
+		out << "\tjmp fun_" << callee->getName() << "\n";
+		return;
+	}
 	out << "\tcallq fun_" << callee->getName() << "\n";
-	out << "\taddq $" << 8*callee->getType()->asFn()->getFormalTypes()->getElts()->size() << ", %rsp\n";
+	out << "\taddq $" << 8*args << ", %rsp\n";
 }
 
 void EnterQuad::codegenX64(std::ostream& out){